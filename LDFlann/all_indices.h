@@ -12,6 +12,7 @@
 
 #include "nn_index.h"
 #include "lsh_index.h"
+#include "autotuned_index.h"
 
 namespace LDFlann
 {
@@ -107,6 +108,27 @@ enum { value = sizeof (test<T>(0))==sizeof(Yes) }; \
         return NULL;
     }
     
+    /**
+     * Tunes the LSH parameters on the dataset, then creates the LSH index with them
+     */
+    template <typename Distance, typename T>
+    inline NNIndex<Distance>* create_autotuned_index_(LDFlann::Matrix<T> data, const LDFlann::IndexParams& params, const Distance& distance,
+                                                      typename enable_if<valid_combination<LshIndex,Distance,T>::value,void>::type* = 0)
+    {
+        if (data.rows==0) {
+            throw FLANNException("The autotuned index needs the dataset to choose its parameters");
+        }
+        LshAutotuner<Distance> autotuner(data, params, distance);
+        return new LshIndex<Distance>(data, autotuner.estimateBuildParams(), distance);
+    }
+    
+    template <typename Distance, typename T>
+    inline NNIndex<Distance>* create_autotuned_index_(LDFlann::Matrix<T> data, const LDFlann::IndexParams& params, const Distance& distance,
+                                                      typename disable_if<valid_combination<LshIndex,Distance,T>::value,void>::type* = 0)
+    {
+        return NULL;
+    }
+    
     template<typename Distance>
     inline NNIndex<Distance>*
     create_index_by_type(const flann_algorithm_t index_type,
@@ -121,6 +143,9 @@ enum { value = sizeof (test<T>(0))==sizeof(Yes) }; \
             case FLANN_INDEX_LSH:
                 nnIndex = create_index_<LshIndex,Distance,ElementType>(dataset, params, distance);
                 break;
+            case FLANN_INDEX_AUTOTUNED:
+                nnIndex = create_autotuned_index_<Distance,ElementType>(dataset, params, distance);
+                break;
             default:
                 throw FLANNException("Unknown index type");
         }
@@ -57,20 +57,20 @@ namespace LDFlann
         /* Minimum number of bytes requested at a time from	the system.  Must be multiple of WORDSIZE. */
         
         
-        int     remaining;  /* Number of bytes left in current block of storage. */
+        size_t  remaining;  /* Number of bytes left in current block of storage. */
         void*   base;     /* Pointer to base of current block of storage. */
         void*   loc;      /* Current location in block to next allocate memory. */
-        int     blocksize;
+        size_t  blocksize;
         
         
     public:
-        int     usedMemory;
-        int     wastedMemory;
+        size_t  usedMemory;
+        size_t  wastedMemory;
         
         /**
          Default constructor. Initializes a new pool.
          */
-        PooledAllocator(int blocksize = BLOCKSIZE)
+        PooledAllocator(size_t blocksize = BLOCKSIZE)
         {
             this->blocksize = blocksize;
             remaining = 0;
@@ -106,9 +106,9 @@ namespace LDFlann
          * Returns a pointer to a piece of new memory of the given size in bytes
          * allocated from the pool.
          */
-        void* allocateMemory(int size)
+        void* allocateMemory(size_t size)
         {
-            int blocksize;
+            size_t blocksize;
             
             /* Round size up to a multiple of wordsize.  The following expression
              only works for WORDSIZE that is a power of 2, by masking last bits of
@@ -163,7 +163,7 @@ namespace LDFlann
         template <typename T>
         T* allocate(size_t count = 1)
         {
-            T* mem = (T*) this->allocateMemory((int)(sizeof(T)*count));
+            T* mem = (T*) this->allocateMemory(sizeof(T)*count);
             return mem;
         }
         
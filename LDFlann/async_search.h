@@ -0,0 +1,315 @@
+//
+//  async_search.h
+//  LDFlann
+//
+
+#ifndef async_search_h
+#define async_search_h
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "general.h"
+#include "matrix.h"
+#include "params.h"
+#include "thread_pool.h"
+
+namespace LDFlann
+{
+
+    /**
+     * Parameters of the asynchronous search
+     */
+    struct AsyncSearchParams
+    {
+        AsyncSearchParams(size_t max_batch_size_ = 1024, int max_batch_latency_ = 1000) :
+        max_batch_size(max_batch_size_), max_batch_latency(max_batch_latency_)
+        {
+        }
+
+        // maximum number of queries coalesced in one batch
+        size_t max_batch_size;
+        // maximum time (in microseconds) a submission waits for others to be coalesced with
+        int max_batch_latency;
+    };
+
+    /**
+     * Checks if two searches can be run in the same batch
+     */
+    inline bool same_search(const SearchParams& a, const SearchParams& b)
+    {
+        return a.checks==b.checks && a.eps==b.eps && a.sorted==b.sorted && a.max_neighbors==b.max_neighbors &&
+        a.use_heap==b.use_heap && a.cores==b.cores && a.schedule==b.schedule && a.chunk_size==b.chunk_size &&
+        a.filter==b.filter;
+    }
+
+    /**
+     * Coalesces asynchronous knn searches into batches.
+     *
+     * Submissions are queued and a dispatcher thread groups the ones with the same knn
+     * and search parameters, in submission order, into one batch. A batch is started
+     * when it reaches max_batch_size queries or when its oldest submission has waited
+     * max_batch_latency. The queries of the batch are copied into one contiguous matrix,
+     * searched on the thread pool and the results are copied back to every submission,
+     * whose future (and callback) is then completed.
+     */
+    template<typename Distance>
+    class SearchBatcher
+    {
+    public:
+        typedef typename Distance::ElementType ElementType;
+        typedef typename Distance::ResultType DistanceType;
+
+        /** Runs a batch of queries, see NNIndex::knnSearch */
+        typedef std::function<int(const Matrix<ElementType>&, std::vector<std::vector<size_t> >&,
+                                  std::vector<std::vector<DistanceType> >&, size_t, const SearchParams&)> SearchFunction;
+        /** Called with the number of neighbors found once a submission is completed */
+        typedef std::function<void(int)> Callback;
+
+        SearchBatcher(SearchFunction search, const AsyncSearchParams& params) :
+        search_(search), params_(params), pending_rows_(0), running_(0), submitted_(0), flushed_(0), stop_(false)
+        {
+            dispatcher_ = std::thread(&SearchBatcher::dispatchLoop, this);
+        }
+
+        /**
+         * Completes all the pending submissions before returning
+         */
+        ~SearchBatcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            changed_.notify_all();
+            dispatcher_.join();
+            wait();
+        }
+
+        /**
+         * Queues a knn search. The query, indices and dists buffers must stay valid until
+         * the submission is completed.
+         * @param queries the query points
+         * @param indices receives the indices of the nearest neighbors
+         * @param dists receives the distances to the nearest neighbors
+         * @param knn number of nearest neighbors to search for
+         * @param params search parameters
+         * @param callback optional, called on completion (from a pool thread)
+         * @return future holding the number of neighbors found, or the error of the search
+         */
+        std::future<int> submit(const Matrix<ElementType>& queries, Matrix<size_t>& indices, Matrix<DistanceType>& dists,
+                                size_t knn, const SearchParams& params, Callback callback = Callback())
+        {
+            assert(indices.rows >= queries.rows);
+            assert(dists.rows >= queries.rows);
+            assert(indices.cols >= knn);
+            assert(dists.cols >= knn);
+
+            Submission* submission = new Submission(queries, indices, dists, knn, params, callback);
+            std::future<int> result = submission->promise.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                submission->sequence = ++submitted_;
+                pending_.push_back(submission);
+                pending_rows_ += queries.rows;
+            }
+            changed_.notify_all();
+            return result;
+        }
+
+        /**
+         * Starts the pending submissions without waiting for the batch latency, and waits
+         * until all the submissions are completed. The submissions made after the flush
+         * (by other threads) wait for their batch as usual.
+         */
+        void flush()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                flushed_ = submitted_;
+            }
+            changed_.notify_all();
+            wait();
+        }
+
+        /**
+         * Waits until all the submissions are completed
+         */
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!pending_.empty() || running_>0) {
+                changed_.wait(lock);
+            }
+        }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Submission
+        {
+            Submission(const Matrix<ElementType>& queries_, Matrix<size_t>& indices_, Matrix<DistanceType>& dists_,
+                       size_t knn_, const SearchParams& params_, Callback callback_) :
+            queries(queries_), indices(indices_), dists(dists_), knn(knn_), params(params_), callback(callback_),
+            submitted(Clock::now())
+            {
+            }
+
+            Matrix<ElementType> queries;
+            Matrix<size_t> indices;
+            Matrix<DistanceType> dists;
+            size_t knn;
+            SearchParams params;
+            Callback callback;
+            std::promise<int> promise;
+            Clock::time_point submitted;
+            /** Number of the submission, in submission order */
+            uint64_t sequence;
+        };
+
+        void dispatchLoop()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;) {
+                if (pending_.empty()) {
+                    if (stop_) return;
+                    changed_.wait(lock);
+                    continue;
+                }
+
+                Clock::time_point deadline = pending_.front()->submitted + std::chrono::microseconds(params_.max_batch_latency);
+                bool flushed = pending_.front()->sequence<=flushed_;
+                if (pending_rows_<params_.max_batch_size && !flushed && !stop_ && Clock::now()<deadline) {
+                    changed_.wait_until(lock, deadline);
+                    continue;
+                }
+
+                std::vector<Submission*>* batch = takeBatch();
+                ++running_;
+                lock.unlock();
+                ThreadPool::instance().submit([this, batch]() {
+                    runBatch(*batch);
+                    delete batch;
+                    // notify under the lock, wait() may return and the batcher be destroyed right after
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    --running_;
+                    changed_.notify_all();
+                });
+                lock.lock();
+            }
+        }
+
+        /**
+         * Removes from the queue the oldest submission and the following compatible ones,
+         * up to max_batch_size queries (mutex_ held)
+         */
+        std::vector<Submission*>* takeBatch()
+        {
+            std::vector<Submission*>* batch = new std::vector<Submission*>();
+            Submission* first = pending_.front();
+            size_t rows = 0;
+            typename std::deque<Submission*>::iterator it = pending_.begin();
+            while (it!=pending_.end()) {
+                Submission* submission = *it;
+                bool compatible = submission->knn==first->knn && same_search(submission->params, first->params);
+                if (compatible && (batch->empty() || rows+submission->queries.rows<=params_.max_batch_size)) {
+                    batch->push_back(submission);
+                    rows += submission->queries.rows;
+                    pending_rows_ -= submission->queries.rows;
+                    it = pending_.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            return batch;
+        }
+
+        void runBatch(std::vector<Submission*>& batch)
+        {
+            Submission* first = batch[0];
+            size_t veclen = first->queries.cols;
+            size_t rows = 0;
+            for (size_t i=0;i<batch.size();++i) rows += batch[i]->queries.rows;
+
+            try {
+                // gather the queries in one contiguous matrix
+                std::vector<ElementType> query_data(rows*veclen);
+                size_t row = 0;
+                for (size_t i=0;i<batch.size();++i) {
+                    const Matrix<ElementType>& queries = batch[i]->queries;
+                    for (size_t j=0;j<queries.rows;++j, ++row) {
+                        std::copy(queries[j], queries[j]+veclen, &query_data[row*veclen]);
+                    }
+                }
+                Matrix<ElementType> queries(query_data.empty() ? NULL : &query_data[0], rows, veclen);
+
+                std::vector<std::vector<size_t> > indices;
+                std::vector<std::vector<DistanceType> > dists;
+                search_(queries, indices, dists, first->knn, first->params);
+
+                // scatter the results back
+                row = 0;
+                for (size_t i=0;i<batch.size();++i) {
+                    Submission* submission = batch[i];
+                    int count = 0;
+                    for (size_t j=0;j<submission->queries.rows;++j, ++row) {
+                        size_t n = indices[row].size();
+                        std::copy(indices[row].begin(), indices[row].end(), submission->indices[j]);
+                        std::copy(dists[row].begin(), dists[row].end(), submission->dists[j]);
+                        count += n;
+                    }
+                    if (submission->callback) submission->callback(count);
+                    submission->promise.set_value(count);
+                }
+            }
+            catch (...) {
+                for (size_t i=0;i<batch.size();++i) {
+                    try {
+                        batch[i]->promise.set_exception(std::current_exception());
+                    }
+                    catch (const std::future_error&) {
+                        // already completed
+                    }
+                }
+            }
+
+            for (size_t i=0;i<batch.size();++i) {
+                delete batch[i];
+            }
+        }
+
+    private:
+        SearchBatcher(const SearchBatcher&);
+        SearchBatcher& operator=(const SearchBatcher&);
+
+        SearchFunction search_;
+        AsyncSearchParams params_;
+
+        std::mutex mutex_;
+        /** Signals new submissions, completed batches and stop/flush requests */
+        std::condition_variable changed_;
+        std::deque<Submission*> pending_;
+        size_t pending_rows_;
+        /** Number of batches started and not completed yet */
+        int running_;
+        /** Number of submissions made so far */
+        uint64_t submitted_;
+        /** The submissions up to this number are started without waiting (see flush()) */
+        uint64_t flushed_;
+        bool stop_;
+        std::thread dispatcher_;
+    };
+
+}
+
+#endif /* async_search_h */
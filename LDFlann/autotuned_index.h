@@ -0,0 +1,296 @@
+//
+//  autotuned_index.h
+//  LDFlann
+//
+
+#ifndef autotuned_index_h
+#define autotuned_index_h
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "general.h"
+#include "matrix.h"
+#include "params.h"
+#include "parallel.h"
+#include "random.h"
+#include "lsh_index.h"
+
+namespace LDFlann
+{
+
+    struct AutotunedIndexParams : public IndexParams
+    {
+        AutotunedIndexParams(float target_precision = 0.8, float memory_limit = 0, float sample_fraction = 0.1, unsigned int random_seed = 1)
+        {
+            (*this)["algorithm"] = FLANN_INDEX_AUTOTUNED;
+            // precision desired: fraction of the queries whose nearest neighbor is found
+            (*this)["target_precision"] = target_precision;
+            // maximum memory of the index (dataset and tables), in MB (0 for no limit)
+            (*this)["memory_limit"] = memory_limit;
+            // what fraction of the dataset to use for autotuning
+            (*this)["sample_fraction"] = sample_fraction;
+            // seed of the sampling and of the hash functions of the tuned index
+            (*this)["random_seed"] = random_seed;
+            // Number of cores used to evaluate the candidate parameters (0 for auto)
+            (*this)["cores"] = 0;
+        }
+    };
+
+
+    /**
+     * Chooses the LSH parameters (table_number, key_size, multi_probe_level) of a dataset.
+     *
+     * A sample of the dataset is indexed with every candidate parameter set, and a set of
+     * test queries (points of the dataset outside the sample) is searched in it. The
+     * precision is measured against the exact nearest neighbors found by a linear scan of
+     * the sample, and the speed as the queries per second of a single core (the candidates
+     * are evaluated in parallel, one per core). The key size is then scaled to the size of
+     * the whole dataset, so its buckets hold as many points as the buckets of the sample.
+     *
+     * The parameters returned give the highest QPS among the candidates that reach the
+     * target precision and whose estimated memory fits the limit (the most precise
+     * candidate if none reaches the target). They include the random seed, so building an
+     * index from them is reproducible.
+     */
+    template<typename Distance>
+    class LshAutotuner
+    {
+    public:
+        typedef typename Distance::ElementType ElementType;
+        typedef typename Distance::ResultType DistanceType;
+
+        /** The measures of one candidate */
+        struct Candidate
+        {
+            unsigned int table_number;
+            unsigned int key_size;
+            unsigned int multi_probe_level;
+            float precision;
+            float qps;
+            /** estimated for the whole dataset, in bytes */
+            size_t memory;
+        };
+
+        LshAutotuner(const Matrix<ElementType>& dataset, const IndexParams& params, Distance distance = Distance()) :
+        dataset_(dataset), params_(params), distance_(distance)
+        {
+            target_precision_ = get_param(params,"target_precision", 0.8f);
+            memory_limit_ = get_param(params,"memory_limit", 0.0f);
+            sample_fraction_ = get_param(params,"sample_fraction", 0.1f);
+            random_seed_ = get_param(params,"random_seed", 1u);
+            cores_ = get_param(params,"cores", 0);
+        }
+
+        /**
+         * Runs the tuning
+         * @return LSH index parameters
+         */
+        IndexParams estimateBuildParams()
+        {
+            seed_random(random_seed_);
+            sample();
+            computeGroundTruth();
+
+            size_t bits = dataset_.cols * sizeof(ElementType) * CHAR_BIT;
+            int log_scale = (int)floor(log(double(dataset_.rows) / sample_.rows) / log(2.0) + 0.5);
+            int sample_bits = (int)floor(log(double(sample_.rows)) / log(2.0));
+
+            const unsigned int table_numbers[] = { 1, 2, 4, 6, 8, 12, 16, 24, 32 };
+            for (unsigned int level = 0; level <= 2; ++level) {
+                for (int key_size = std::max(sample_bits-8, 4); key_size <= sample_bits+2; ++key_size) {
+                    // key size of the whole dataset, the keys are at most MAX_KEY_SIZE bits
+                    int full_key_size = key_size + log_scale;
+                    if (full_key_size>MAX_KEY_SIZE || (size_t)full_key_size>bits) break;
+
+                    for (size_t t = 0; t < FLANN_ARRAY_LEN(table_numbers); ++t) {
+                        Candidate candidate = evaluate(table_numbers[t], key_size, level);
+                        candidate.key_size = full_key_size;
+                        candidates_.push_back(candidate);
+                        // more tables only make the search slower once the precision is reached
+                        if (candidate.precision>=target_precision_ || !fitsMemory(candidate)) break;
+                    }
+                }
+            }
+
+            return bestParams();
+        }
+
+        /**
+         * @return All the candidates evaluated by estimateBuildParams
+         */
+        const std::vector<Candidate>& getCandidates() const
+        {
+            return candidates_;
+        }
+
+    private:
+        enum { MAX_KEY_SIZE = 28 };
+
+        /**
+         * Draws the sample and the test queries from the dataset
+         */
+        void sample()
+        {
+            size_t rows = dataset_.rows;
+            size_t sample_size = std::min(rows, std::max(size_t(rows*sample_fraction_), std::min(rows, size_t(1000))));
+            size_t test_size = std::min(size_t(1000), std::max(rows-sample_size, sample_size/10));
+
+            std::vector<size_t> order(rows);
+            for (size_t i=0;i<rows;++i) order[i] = i;
+            RandomGenerator generator;
+            std::random_shuffle(order.begin(), order.end(), generator);
+
+            // the test queries are taken out of the sample when the dataset is too small for both
+            if (sample_size+test_size>rows) sample_size = rows-test_size;
+
+            copyRows(order, 0, sample_size, sample_data_, sample_);
+            copyRows(order, sample_size, sample_size+test_size, test_data_, test_);
+        }
+
+        void copyRows(const std::vector<size_t>& order, size_t begin, size_t end, std::vector<ElementType>& data, Matrix<ElementType>& matrix)
+        {
+            size_t cols = dataset_.cols;
+            data.resize(std::max(end-begin, size_t(1))*cols);
+            for (size_t i=begin;i<end;++i) {
+                std::copy(dataset_[order[i]], dataset_[order[i]]+cols, &data[(i-begin)*cols]);
+            }
+            matrix = Matrix<ElementType>(&data[0], end-begin, cols);
+        }
+
+        /**
+         * Linear scan of the sample for the nearest neighbor of every test query
+         */
+        void computeGroundTruth()
+        {
+            gt_dists_.resize(test_.rows);
+            parallel_for(test_.rows, cores_, [&](size_t i) {
+                DistanceType best = std::numeric_limits<DistanceType>::max();
+                for (size_t j=0;j<sample_.rows;++j) {
+                    best = std::min(best, distance_(test_[i], sample_[j], sample_.cols));
+                }
+                gt_dists_[i] = best;
+            });
+        }
+
+        /**
+         * Builds an index of the sample with the given parameters and measures it
+         */
+        Candidate evaluate(unsigned int table_number, unsigned int key_size, unsigned int level)
+        {
+            Candidate candidate;
+            candidate.table_number = table_number;
+            candidate.key_size = key_size;
+            candidate.multi_probe_level = level;
+
+            IndexParams params = LshIndexParams(table_number, key_size, level);
+            params["random_seed"] = random_seed_;
+            params["cores"] = 1;
+            LshIndex<Distance> index(sample_, params, distance_);
+            index.buildIndex();
+
+            // the dataset and the buckets grow linearly with the number of points
+            candidate.memory = size_t(double(index.usedMemory())*dataset_.rows/sample_.rows);
+
+            // the queries are searched on one core, the candidates are spread over the cores
+            // the search leaves the result untouched when it finds nothing
+            std::vector<size_t> found(test_.rows, size_t(-1));
+            std::vector<DistanceType> dists(test_.rows);
+            SearchParams search_params;
+            search_params.cores = 1;
+            // the queries are searched again until the time measured is long enough
+            size_t runs = 0;
+            double seconds = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            do {
+                parallel_for(QUERY_BLOCKS, cores_, [&](size_t block) {
+                    size_t begin = test_.rows*block/QUERY_BLOCKS;
+                    size_t end = test_.rows*(block+1)/QUERY_BLOCKS;
+                    Matrix<ElementType> queries(test_[begin], end-begin, test_.cols);
+                    Matrix<size_t> indices(&found[begin], end-begin, 1);
+                    Matrix<DistanceType> distances(&dists[begin], end-begin, 1);
+                    if (end>begin) index.knnSearch(queries, indices, distances, 1, search_params);
+                });
+                ++runs;
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            } while (seconds<MIN_SEARCH_TIME);
+            int threads = get_batch_threads(cores_, QUERY_BLOCKS);
+
+            size_t correct = 0;
+            for (size_t i=0;i<test_.rows;++i) {
+                if (found[i]<sample_.rows && dists[i]<=gt_dists_[i]) ++correct;
+            }
+            candidate.precision = float(correct)/test_.rows;
+            candidate.qps = float(runs*test_.rows/(seconds*threads));
+            return candidate;
+        }
+
+        bool fitsMemory(const Candidate& candidate) const
+        {
+            return memory_limit_<=0 || candidate.memory<=memory_limit_*1024*1024;
+        }
+
+        IndexParams bestParams() const
+        {
+            const Candidate* best = NULL;
+            for (size_t i=0;i<candidates_.size();++i) {
+                const Candidate& candidate = candidates_[i];
+                if (!fitsMemory(candidate) || candidate.precision<target_precision_) continue;
+                if (best==NULL || candidate.qps>best->qps) best = &candidate;
+            }
+            if (best==NULL) {
+                // the target cannot be reached, take the most precise candidate
+                for (size_t i=0;i<candidates_.size();++i) {
+                    const Candidate& candidate = candidates_[i];
+                    if (!fitsMemory(candidate) && memory_limit_>0) continue;
+                    if (best==NULL || candidate.precision>best->precision ||
+                        (candidate.precision==best->precision && candidate.qps>best->qps)) best = &candidate;
+                }
+            }
+            if (best==NULL) {
+                throw FLANNException("No LSH parameters fit the memory limit");
+            }
+
+            // keep the other parameters given (e.g. inline_tables, compress_tables)
+            IndexParams params = params_;
+            params.erase("target_precision");
+            params.erase("memory_limit");
+            params.erase("sample_fraction");
+            params["algorithm"] = FLANN_INDEX_LSH;
+            params["table_number"] = best->table_number;
+            params["key_size"] = best->key_size;
+            params["multi_probe_level"] = best->multi_probe_level;
+            params["random_seed"] = random_seed_;
+            return params;
+        }
+
+    private:
+        /** Number of chunks of test queries (one per evaluating core) */
+        enum { QUERY_BLOCKS = 64 };
+        /** Minimum time of the search of the test queries, in seconds */
+        static constexpr double MIN_SEARCH_TIME = 0.01;
+
+        const Matrix<ElementType> dataset_;
+        IndexParams params_;
+        Distance distance_;
+
+        float target_precision_;
+        float memory_limit_;
+        float sample_fraction_;
+        unsigned int random_seed_;
+        int cores_;
+
+        std::vector<ElementType> sample_data_;
+        Matrix<ElementType> sample_;
+        std::vector<ElementType> test_data_;
+        Matrix<ElementType> test_;
+        std::vector<DistanceType> gt_dists_;
+
+        std::vector<Candidate> candidates_;
+    };
+
+}
+
+#endif /* autotuned_index_h */
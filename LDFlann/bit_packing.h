@@ -0,0 +1,146 @@
+//
+//  bit_packing.h
+//  LDFlann
+//
+
+#ifndef bit_packing_h
+#define bit_packing_h
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace LDFlann
+{
+
+    /**
+     * Compression of sorted lists of 32 bits integers (the LSH bucket lists).
+     *
+     * A list is cut in blocks of BLOCK_SIZE values (frame of reference): a block stores
+     * its first value on 4 bytes, then the gaps between the following values minus one,
+     * bit packed with the width of the largest gap of the block (one byte). Consecutive
+     * values thus take no space at all (width 0), which is the common case in the first
+     * table of a reordered dataset.
+     *
+     * The decoder reads the packed gaps with unaligned 64 bits loads, so the buffer
+     * holding the lists must have PADDING readable bytes after the last list.
+     */
+    namespace bitpacking
+    {
+
+        const size_t BLOCK_SIZE = 128;
+        const size_t PADDING = 8;
+
+        inline unsigned int bit_width(uint32_t value)
+        {
+            unsigned int width = 0;
+            while (value) {
+                ++width;
+                value >>= 1;
+            }
+            return width;
+        }
+
+        /**
+         * Appends a variable length (7 bits per byte) integer to a buffer
+         */
+        inline void encode_varint(size_t value, std::vector<unsigned char>& out)
+        {
+            while (value >= 0x80) {
+                out.push_back((unsigned char)(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back((unsigned char)value);
+        }
+
+        /**
+         * Reads a variable length integer
+         * @return pointer past the integer
+         */
+        inline const unsigned char* decode_varint(const unsigned char* in, size_t& value)
+        {
+            value = 0;
+            unsigned int shift = 0;
+            while (*in & 0x80) {
+                value |= size_t(*in++ & 0x7f) << shift;
+                shift += 7;
+            }
+            value |= size_t(*in++) << shift;
+            return in;
+        }
+
+        /**
+         * Appends the compressed form of a list to a buffer
+         * @param values the list, strictly increasing
+         * @param count number of values in the list
+         * @param out the buffer
+         */
+        inline void encode(const uint32_t* values, size_t count, std::vector<unsigned char>& out)
+        {
+            for (size_t begin = 0; begin < count; begin += BLOCK_SIZE) {
+                size_t end = std::min(begin + BLOCK_SIZE, count);
+
+                uint32_t max_gap = 0;
+                for (size_t i = begin + 1; i < end; ++i) {
+                    max_gap = std::max(max_gap, values[i] - values[i-1] - 1);
+                }
+                unsigned int width = bit_width(max_gap);
+
+                size_t offset = out.size();
+                size_t packed_bytes = ((end - begin - 1) * width + 7) / 8;
+                out.resize(offset + 5 + packed_bytes, 0);
+                memcpy(&out[offset], &values[begin], 4);
+                out[offset + 4] = (unsigned char)width;
+
+                unsigned char* packed = &out[offset + 5];
+                size_t bit = 0;
+                for (size_t i = begin + 1; i < end; ++i, bit += width) {
+                    uint64_t gap = values[i] - values[i-1] - 1;
+                    for (unsigned int b = 0; b < width; ++b) {
+                        if ((gap >> b) & 1) packed[(bit + b) >> 3] |= (unsigned char)(1 << ((bit + b) & 7));
+                    }
+                }
+            }
+        }
+
+        /**
+         * Decodes a list
+         * @param in the compressed list
+         * @param count number of values in the list
+         * @param out receives the values
+         * @return pointer past the compressed list
+         */
+        inline const unsigned char* decode(const unsigned char* in, size_t count, uint32_t* out)
+        {
+            for (size_t begin = 0; begin < count; begin += BLOCK_SIZE) {
+                size_t end = std::min(begin + BLOCK_SIZE, count);
+
+                uint32_t value;
+                memcpy(&value, in, 4);
+                unsigned int width = in[4];
+                const unsigned char* packed = in + 5;
+
+                out[begin] = value;
+                if (width == 0) {
+                    for (size_t i = begin + 1; i < end; ++i) out[i] = ++value;
+                }
+                else {
+                    const uint64_t mask = (uint64_t(1) << width) - 1;
+                    size_t bit = 0;
+                    for (size_t i = begin + 1; i < end; ++i, bit += width) {
+                        uint64_t word;
+                        memcpy(&word, packed + (bit >> 3), 8);
+                        value += uint32_t((word >> (bit & 7)) & mask) + 1;
+                        out[i] = value;
+                    }
+                }
+                in = packed + ((end - begin - 1) * width + 7) / 8;
+            }
+            return in;
+        }
+
+    }
+}
+
+#endif /* bit_packing_h */
@@ -0,0 +1,308 @@
+//
+//  compression.h
+//  LDFlann
+//
+
+#ifndef compression_h
+#define compression_h
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "general.h"
+
+namespace LDFlann
+{
+
+    /**
+     * The block compression of the index files: a byte oriented LZ77 codec (in the
+     * spirit of LZ4, with 64KB offsets and no entropy coding) that decodes at memory
+     * speed, and two filters applied to a block before it:
+     *
+     * - shuffle: the bytes of values of `width` bytes are grouped by position (all the
+     *   first bytes, then all the second bytes...), so the bytes that change little
+     *   between values form long runs (float datasets, large integers);
+     * - delta: each value is replaced by its difference with the previous one, then
+     *   shuffled, for sorted arrays (ids, bucket offsets, keys).
+     *
+     * Every block is compressed on its own, so the blocks of a section can be compressed
+     * and decompressed in parallel.
+     */
+    namespace compression
+    {
+
+        enum Codec
+        {
+            CODEC_NONE = 0,
+            CODEC_LZ = 1,
+            CODEC_SHUFFLE_LZ = 2,
+            CODEC_DELTA_LZ = 3
+        };
+
+        namespace lz
+        {
+            /** Shortest match encoded */
+            const size_t MIN_MATCH = 4;
+            /** The last bytes of a block are always literals, matches stop before them */
+            const size_t LAST_LITERALS = 5;
+            const size_t MAX_OFFSET = 65535;
+            const int HASH_BITS = 14;
+
+            inline uint32_t read32(const unsigned char* p)
+            {
+                uint32_t value;
+                memcpy(&value, p, sizeof(value));
+                return value;
+            }
+
+            inline uint32_t hash(uint32_t value)
+            {
+                return (value * 2654435761u) >> (32 - HASH_BITS);
+            }
+
+            /**
+             * Writes a length that does not fit in 4 bits, as bytes of 255 and a last byte
+             */
+            inline bool put_length(size_t length, unsigned char*& out, const unsigned char* out_end)
+            {
+                for (; length >= 255; length -= 255) {
+                    if (out == out_end) return false;
+                    *out++ = 255;
+                }
+                if (out == out_end) return false;
+                *out++ = (unsigned char)length;
+                return true;
+            }
+
+            /**
+             * Writes a sequence: literals followed by a match (none for the last sequence)
+             */
+            inline bool put_sequence(const unsigned char* literals, size_t literal_count, size_t offset, size_t match_length,
+                                     unsigned char*& out, const unsigned char* out_end)
+            {
+                if (out == out_end) return false;
+                unsigned char* token = out++;
+                *token = (unsigned char)(std::min<size_t>(literal_count, 15) << 4);
+                if (literal_count >= 15 && !put_length(literal_count - 15, out, out_end)) return false;
+                if ((size_t)(out_end - out) < literal_count) return false;
+                memcpy(out, literals, literal_count);
+                out += literal_count;
+                if (match_length == 0) return true;
+
+                if (out_end - out < 2) return false;
+                *out++ = (unsigned char)(offset & 0xff);
+                *out++ = (unsigned char)(offset >> 8);
+                size_t length = match_length - MIN_MATCH;
+                *token |= (unsigned char)std::min<size_t>(length, 15);
+                return length < 15 || put_length(length - 15, out, out_end);
+            }
+
+            /**
+             * Compresses a block
+             * @param src the block
+             * @param size its size
+             * @param dst receives the compressed block
+             * @param capacity the size of dst
+             * @return The size of the compressed block, 0 if it does not fit in capacity
+             */
+            inline size_t compress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity)
+            {
+                std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+                unsigned char* out = dst;
+                const unsigned char* out_end = dst + capacity;
+                size_t anchor = 0;
+                size_t pos = 0;
+                size_t limit = size > LAST_LITERALS + MIN_MATCH ? size - LAST_LITERALS - MIN_MATCH : 0;
+
+                while (pos < limit) {
+                    uint32_t value = read32(src + pos);
+                    uint32_t& slot = table[hash(value)];
+                    size_t candidate = slot;
+                    slot = (uint32_t)pos;
+                    if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(src + candidate) != value) {
+                        // the longer no match is found, the faster the data is skipped
+                        pos += 1 + ((pos - anchor) >> 6);
+                        continue;
+                    }
+
+                    size_t length = MIN_MATCH;
+                    size_t match_end = size - LAST_LITERALS;
+                    while (pos + length < match_end && src[candidate + length] == src[pos + length]) ++length;
+                    if (!put_sequence(src + anchor, pos - anchor, pos - candidate, length, out, out_end)) return 0;
+                    pos += length;
+                    anchor = pos;
+                    if (pos - 2 < limit) {
+                        table[hash(read32(src + pos - 2))] = (uint32_t)(pos - 2);
+                    }
+                }
+                if (!put_sequence(src + anchor, size - anchor, 0, 0, out, out_end)) return 0;
+                return out - dst;
+            }
+
+            /**
+             * Decompresses a block, checking that it stays in its bounds
+             * @return false if the block is corrupted
+             */
+            inline bool decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size)
+            {
+                const unsigned char* in = src;
+                const unsigned char* in_end = src + size;
+                unsigned char* out = dst;
+                unsigned char* out_end = dst + dst_size;
+
+                while (in < in_end) {
+                    unsigned char token = *in++;
+                    size_t literal_count = token >> 4;
+                    if (literal_count == 15) {
+                        unsigned char byte;
+                        do {
+                            if (in == in_end) return false;
+                            byte = *in++;
+                            literal_count += byte;
+                        } while (byte == 255);
+                    }
+                    if ((size_t)(in_end - in) < literal_count || (size_t)(out_end - out) < literal_count) return false;
+                    memcpy(out, in, literal_count);
+                    in += literal_count;
+                    out += literal_count;
+                    // the last sequence has no match
+                    if (in == in_end) break;
+
+                    if (in_end - in < 2) return false;
+                    size_t offset = in[0] | (size_t(in[1]) << 8);
+                    in += 2;
+                    size_t length = token & 15;
+                    if (length == 15) {
+                        unsigned char byte;
+                        do {
+                            if (in == in_end) return false;
+                            byte = *in++;
+                            length += byte;
+                        } while (byte == 255);
+                    }
+                    length += MIN_MATCH;
+                    if (offset == 0 || offset > (size_t)(out - dst) || (size_t)(out_end - out) < length) return false;
+                    const unsigned char* match = out - offset;
+                    if (offset >= length) {
+                        memcpy(out, match, length);
+                        out += length;
+                    }
+                    else {
+                        // the match overlaps the bytes it produces
+                        for (size_t i = 0; i < length; ++i) *out++ = match[i];
+                    }
+                }
+                return out == out_end;
+            }
+        }
+
+        /**
+         * Groups the bytes of values of `width` bytes by their position in the values,
+         * the bytes after the last whole value are copied
+         */
+        inline void shuffle(const unsigned char* src, size_t size, size_t width, unsigned char* dst)
+        {
+            size_t count = size / width;
+            for (size_t i = 0; i < count; ++i) {
+                for (size_t b = 0; b < width; ++b) dst[b * count + i] = src[i * width + b];
+            }
+            memcpy(dst + count * width, src + count * width, size - count * width);
+        }
+
+        inline void unshuffle(const unsigned char* src, size_t size, size_t width, unsigned char* dst)
+        {
+            size_t count = size / width;
+            for (size_t i = 0; i < count; ++i) {
+                for (size_t b = 0; b < width; ++b) dst[i * width + b] = src[b * count + i];
+            }
+            memcpy(dst + count * width, src + count * width, size - count * width);
+        }
+
+        template<typename T>
+        inline void delta_encode(unsigned char* data, size_t count)
+        {
+            T previous = 0;
+            for (size_t i = 0; i < count; ++i) {
+                T value;
+                memcpy(&value, data + i * sizeof(T), sizeof(T));
+                T delta = value - previous;
+                memcpy(data + i * sizeof(T), &delta, sizeof(T));
+                previous = value;
+            }
+        }
+
+        template<typename T>
+        inline void delta_decode(unsigned char* data, size_t count)
+        {
+            T previous = 0;
+            for (size_t i = 0; i < count; ++i) {
+                T delta;
+                memcpy(&delta, data + i * sizeof(T), sizeof(T));
+                previous += delta;
+                memcpy(data + i * sizeof(T), &previous, sizeof(T));
+            }
+        }
+
+        inline bool valid_width(Codec codec, size_t width)
+        {
+            switch (codec) {
+                case CODEC_LZ: return true;
+                case CODEC_SHUFFLE_LZ: return width > 0 && width <= 64;
+                case CODEC_DELTA_LZ: return width == 4 || width == 8;
+                default: return false;
+            }
+        }
+
+        /**
+         * Compresses a block
+         * @param codec the codec
+         * @param width the size of the values of the block, for the filters
+         * @param src the block
+         * @param size its size
+         * @param out receives the compressed block
+         * @return false if the block does not shrink (out is then undefined)
+         */
+        inline bool compress_block(Codec codec, size_t width, const unsigned char* src, size_t size, std::vector<unsigned char>& out)
+        {
+            std::vector<unsigned char> filtered;
+            if (codec == CODEC_SHUFFLE_LZ || codec == CODEC_DELTA_LZ) {
+                std::vector<unsigned char> values(src, src + size);
+                if (codec == CODEC_DELTA_LZ) {
+                    if (width == 4) delta_encode<uint32_t>(&values[0], size / 4);
+                    else delta_encode<uint64_t>(&values[0], size / 8);
+                }
+                filtered.resize(size);
+                shuffle(&values[0], size, width, &filtered[0]);
+                src = &filtered[0];
+            }
+            out.resize(size);
+            size_t compressed = size > 0 ? lz::compress(src, size, &out[0], size - 1) : 0;
+            out.resize(compressed);
+            return compressed > 0;
+        }
+
+        /**
+         * Decompresses a block compressed by compress_block
+         * @return false if the block is corrupted
+         */
+        inline bool decompress_block(Codec codec, size_t width, const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size)
+        {
+            if (codec == CODEC_LZ) {
+                return lz::decompress(src, size, dst, dst_size);
+            }
+            std::vector<unsigned char> filtered(dst_size);
+            if (!lz::decompress(src, size, filtered.empty() ? NULL : &filtered[0], dst_size)) return false;
+            if (dst_size == 0) return true;
+            unshuffle(&filtered[0], dst_size, width, dst);
+            if (codec == CODEC_DELTA_LZ) {
+                if (width == 4) delta_decode<uint32_t>(dst, dst_size / 4);
+                else delta_decode<uint64_t>(dst, dst_size / 8);
+            }
+            return true;
+        }
+    }
+}
+
+#endif /* compression_h */
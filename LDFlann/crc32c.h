@@ -0,0 +1,121 @@
+//
+//  crc32c.h
+//  LDFlann
+//
+
+#ifndef crc32c_h
+#define crc32c_h
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LDFLANN_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+namespace LDFlann
+{
+
+    /**
+     * CRC-32C (Castagnoli), the checksum of the sections of the index files. It is computed
+     * with the SSE4.2 crc32 instruction when the processor has it, with tables otherwise
+     * (slicing by 8), both giving the same values.
+     */
+    namespace crc32c
+    {
+
+        /** The reflected Castagnoli polynomial */
+        const uint32_t POLYNOMIAL = 0x82f63b78;
+
+        struct Tables
+        {
+            uint32_t table[8][256];
+
+            Tables()
+            {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t crc = i;
+                    for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+                    table[0][i] = crc;
+                }
+                for (uint32_t i = 0; i < 256; ++i) {
+                    for (int t = 1; t < 8; ++t) table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xff];
+                }
+            }
+        };
+
+        inline const Tables& tables()
+        {
+            static const Tables instance;
+            return instance;
+        }
+
+        inline uint32_t extend_portable(uint32_t crc, const unsigned char* data, size_t size)
+        {
+            const Tables& t = tables();
+            crc = ~crc;
+            for (; size >= 8; size -= 8, data += 8) {
+                uint32_t low, high;
+                memcpy(&low, data, 4);
+                memcpy(&high, data + 4, 4);
+                low ^= crc;
+                crc = t.table[7][low & 0xff] ^ t.table[6][(low >> 8) & 0xff] ^
+                      t.table[5][(low >> 16) & 0xff] ^ t.table[4][low >> 24] ^
+                      t.table[3][high & 0xff] ^ t.table[2][(high >> 8) & 0xff] ^
+                      t.table[1][(high >> 16) & 0xff] ^ t.table[0][high >> 24];
+            }
+            for (; size > 0; --size, ++data) {
+                crc = (crc >> 8) ^ t.table[0][(crc ^ *data) & 0xff];
+            }
+            return ~crc;
+        }
+
+#ifdef LDFLANN_CRC32C_SSE42
+        __attribute__((target("sse4.2")))
+        inline uint32_t extend_sse42(uint32_t crc, const unsigned char* data, size_t size)
+        {
+            uint64_t crc64 = ~crc;
+            for (; size >= 8; size -= 8, data += 8) {
+                uint64_t word;
+                memcpy(&word, data, 8);
+                crc64 = _mm_crc32_u64(crc64, word);
+            }
+            uint32_t crc32 = (uint32_t)crc64;
+            for (; size > 0; --size, ++data) {
+                crc32 = _mm_crc32_u8(crc32, *data);
+            }
+            return ~crc32;
+        }
+
+        inline bool has_sse42()
+        {
+            static const bool supported = __builtin_cpu_supports("sse4.2");
+            return supported;
+        }
+#endif
+
+        /**
+         * Extends a checksum with more bytes
+         * @param crc the checksum of the previous bytes (0 for none)
+         * @param data the bytes
+         * @param size number of bytes
+         * @return The checksum of all the bytes
+         */
+        inline uint32_t extend(uint32_t crc, const void* data, size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#ifdef LDFLANN_CRC32C_SSE42
+            if (has_sse42()) return extend_sse42(crc, bytes, size);
+#endif
+            return extend_portable(crc, bytes, size);
+        }
+
+        inline uint32_t value(const void* data, size_t size)
+        {
+            return extend(0, data, size);
+        }
+    }
+}
+
+#endif /* crc32c_h */
@@ -146,7 +146,15 @@ namespace LDFlann {
         FLANN_CHECKS_UNLIMITED = -1,
         FLANN_CHECKS_AUTOTUNED = -2,
     };
-    
+
+    /* How the queries of a search batch are distributed among the cores */
+    enum flann_schedule_t
+    {
+        FLANN_SCHEDULE_STATIC 		= 0,
+        FLANN_SCHEDULE_DYNAMIC 		= 1,
+        FLANN_SCHEDULE_WORK_STEALING 	= 2,
+    };
+
 #ifdef __cplusplus
 }
 #endif
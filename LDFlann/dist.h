@@ -253,6 +253,46 @@ namespace LDFlann
             return result;
         }
     };
+    
+    
+    /**
+     * The flann_distance_t of a distance functor (0 if it has none), saved in the index files
+     */
+    template<typename Distance>
+    struct flann_distance_value
+    {
+        static const flann_distance_t value = (flann_distance_t)0;
+    };
+    
+    template<>
+    struct flann_distance_value<HammingLUT>
+    {
+        static const flann_distance_t value = FLANN_DIST_HAMMING_LUT;
+    };
+    
+    template<typename T>
+    struct flann_distance_value<HammingPopcnt<T> >
+    {
+        static const flann_distance_t value = FLANN_DIST_HAMMING_POPCNT;
+    };
+    
+    template<typename T>
+    struct flann_distance_value<Hamming<T> >
+    {
+        static const flann_distance_t value = FLANN_DIST_HAMMING;
+    };
+    
+    /**
+     * @return true if an index built with a distance can be searched with the other one
+     * (they are the same, or compute the same values as the Hamming distances)
+     */
+    inline bool compatible_distances(flann_distance_t a, flann_distance_t b)
+    {
+        if (a == b) return true;
+        bool hamming_a = a == FLANN_DIST_HAMMING || a == FLANN_DIST_HAMMING_LUT || a == FLANN_DIST_HAMMING_POPCNT;
+        bool hamming_b = b == FLANN_DIST_HAMMING || b == FLANN_DIST_HAMMING_LUT || b == FLANN_DIST_HAMMING_POPCNT;
+        return hamming_a && hamming_b;
+    }
 }
 
 #endif /* dist_h */
@@ -9,18 +9,17 @@
 #ifndef dynamic_bitset_h
 #define dynamic_bitset_h
 
-#if FLANN_USE_BOOST
-#include <boost/dynamic_bitset.hpp>
-typedef boost::dynamic_bitset<> DynamicBitset;
-#else
-
+#include <algorithm>
 #include <limits.h>
+#include <vector>
 
 namespace LDFlann {
     
     /** Class re-implementing the boost version of it
      * This helps not depending on boost, it also does not do the bound checks
-     * and has a way to reset a block for speed
+     * and has a way to reset a block for speed. The index relies on what boost does
+     * not have (atomic_set, access to the blocks, serialization), so this class is
+     * always used, FLANN_USE_BOOST does not switch to boost::dynamic_bitset anymore.
      */
     class DynamicBitset
     {
@@ -98,6 +97,16 @@ namespace LDFlann {
             bitset_[index / cell_bit_size_] |= size_t(1) << (index % cell_bit_size_);
         }
         
+        /** @brief sets a bit to true, several threads can set bits at the same time
+         * @param index the index of the bit to set to 1
+         * @return false if the bit was already set
+         */
+        bool atomic_set(size_t index)
+        {
+            size_t mask = size_t(1) << (index % cell_bit_size_);
+            return (__atomic_fetch_or(&bitset_[index / cell_bit_size_], mask, __ATOMIC_RELAXED) & mask) == 0;
+        }
+        
         /** @param gives the number of contained bits
          */
         size_t size() const
@@ -105,6 +114,30 @@ namespace LDFlann {
             return size_;
         }
         
+        /** @return the blocks holding the bits (size()/(8*sizeof(size_t))+1 of them)
+         */
+        const std::vector<size_t>& blocks() const
+        {
+            return bitset_;
+        }
+        
+        /** @param replaces the bits
+         * @param size the number of bits
+         * @param blocks the blocks holding them, as returned by blocks()
+         */
+        void assign(size_t size, const size_t* blocks)
+        {
+            resize(size);
+            std::copy(blocks, blocks + bitset_.size(), bitset_.begin());
+        }
+        
+        /** @return the memory used by the bits, in bytes
+         */
+        size_t usedMemory() const
+        {
+            return bitset_.capacity() * sizeof(size_t);
+        }
+        
         /** @param check if a bit is set
          * @param index the index of the bit to check
          * @return true if the bit is set
@@ -131,7 +164,5 @@ namespace LDFlann {
     
 } // namespace flann
 
-#endif
-
 
 #endif /* dynamic_bitset_h */
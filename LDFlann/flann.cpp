@@ -11,12 +11,20 @@
 #include <string>
 #include <cassert>
 #include <cstdio>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <unistd.h>
 
 #include "matrix.h"
 #include "params.h"
 #include "saving.h"
 #include "dist.h"
 #include "all_indices.h"
+#include "async_search.h"
+#include "journal.h"
 
 namespace LDFlann
 {
@@ -26,10 +34,15 @@ namespace LDFlann
      */
     struct SavedIndexParams : public IndexParams
     {
-        SavedIndexParams(std::string filename)
+        SavedIndexParams(std::string filename, bool verify_checksums = true, std::string journal = "")
         {
             (*this)["algorithm"] = FLANN_INDEX_SAVED;
             (*this)["filename"] = filename;
+            // check the checksums of all the sections of the file before loading it
+            (*this)["verify_checksums"] = verify_checksums;
+            // journal of the updates made since the file was saved (see Index::startJournal),
+            // replayed after loading the file, the following updates are appended to it
+            (*this)["journal"] = journal;
         }
     };
     
@@ -44,7 +57,7 @@ namespace LDFlann
         typedef NNIndex<Distance> IndexType;//基类，利用了C++的多态
         
         Index(const IndexParams& params, Distance distance = Distance() )
-        : index_params_(params)
+        : index_params_(params), batcher_(NULL), rebuilding_(false), journal_compress_(false), journal_compact_size_(0)
         {
             //获取参数类型
             flann_algorithm_t index_type = get_param<flann_algorithm_t>(params,"algorithm");
@@ -52,37 +65,53 @@ namespace LDFlann
             
             Matrix<ElementType> features;
             if (index_type == FLANN_INDEX_SAVED) {
-                nnIndex_ = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
+                journal::JournalState state;
+                bool journaled;
+                std::string filename = get_param<std::string>(params,"filename");
+                nnIndex_.reset(load_saved_index(features, filename, get_param(params,"verify_checksums",true), distance, state, journaled));
                 loaded_ = true;
+                std::string journal = get_param(params,"journal",std::string());
+                if (!journal.empty()) {
+                    resumeJournal(filename, journal, state, journaled);
+                }
             }
             else {
                 flann_algorithm_t index_type = get_param<flann_algorithm_t>(params, "algorithm");
-                nnIndex_ = create_index_by_type<Distance>(index_type, features, params, distance);//建立对应的nnindex
+                nnIndex_.reset(create_index_by_type<Distance>(index_type, features, params, distance));//建立对应的nnindex
                 
             }
         }
         
         
         Index(const Matrix<ElementType>& features, const IndexParams& params, Distance distance = Distance() )
-        : index_params_(params)
+        : index_params_(params), batcher_(NULL), rebuilding_(false), journal_compress_(false), journal_compact_size_(0)
         {
             flann_algorithm_t index_type = get_param<flann_algorithm_t>(params,"algorithm");
             loaded_ = false;
             
             if (index_type == FLANN_INDEX_SAVED) {
-                nnIndex_ = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
+                journal::JournalState state;
+                bool journaled;
+                std::string filename = get_param<std::string>(params,"filename");
+                nnIndex_.reset(load_saved_index(features, filename, get_param(params,"verify_checksums",true), distance, state, journaled));
                 loaded_ = true;
+                std::string journal = get_param(params,"journal",std::string());
+                if (!journal.empty()) {
+                    resumeJournal(filename, journal, state, journaled);
+                }
             }
             else {
                 flann_algorithm_t index_type = get_param<flann_algorithm_t>(params, "algorithm");
-                nnIndex_ = create_index_by_type<Distance>(index_type, features, params, distance);
+                nnIndex_.reset(create_index_by_type<Distance>(index_type, features, params, distance));
             }
         }
         
         
-        Index(const Index& other) : loaded_(other.loaded_), index_params_(other.index_params_)
+        Index(const Index& other) : loaded_(other.loaded_), index_params_(other.index_params_),
+        async_params_(other.async_params_), batcher_(NULL), rebuilding_(false),
+        journal_compress_(false), journal_compact_size_(0)
         {
-            nnIndex_ = other.nnIndex_->clone();
+            nnIndex_.reset(other.snapshot()->clone());
         }
         
         Index& operator=(Index other)
@@ -93,27 +122,105 @@ namespace LDFlann
         
         virtual ~Index()
         {
-            delete nnIndex_;
+            // completes the pending asynchronous searches
+            delete batcher_;
+            waitForRebuild();
         }
         
+        /*
+         * Concurrency: the searches (and the other const methods) always run on the
+         * published snapshot of the index, they can run concurrently with each other and
+         * with one writer. A writer (buildIndex, addPoints, removePoint(s)) applies its
+         * change to a copy of the index and atomically publishes it once complete, so a
+         * search sees the index either before or after the change, never in between. A
+         * snapshot is freed when the last search using it is done.
+         *
+         * The copy shares the dataset (see PointArena), the ids (see PagedArray) and the
+         * LSH buckets (see LshTable) with the snapshot, it only copies what the change
+         * touches: a small change costs milliseconds whatever the size of the index.
+         */
+        
         /**
          * Builds the index.
          */
         void buildIndex()
         {
             if (!loaded_) {
-                nnIndex_->buildIndex();
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                std::shared_ptr<IndexType> next(snapshot()->clone());
+                next->buildIndex();
+                publish(next);
             }
         }
         
         void buildIndex(const Matrix<ElementType>& points)
         {
-            nnIndex_->buildIndex(points);
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            std::shared_ptr<IndexType> next(snapshot()->clone());
+            next->buildIndex(points);
+            publish(next);
         }
         
+        /**
+         * Builds the index on the given points, with ids chosen by the caller: the searches
+         * return them, removePoint(s) takes them
+         * @param points the points
+         * @param ids their ids (distinct, any value but size_t(-1))
+         */
+        void buildIndex(const Matrix<ElementType>& points, const std::vector<size_t>& ids)
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            std::shared_ptr<IndexType> next(snapshot()->clone());
+            next->buildIndex(points, ids);
+            publish(next);
+        }
+        
+        /**
+         * Adds points to the index. When the index has grown past rebuild_threshold times
+         * its size at the last build, the index is rebuilt: by slices spread over the
+         * following calls if the index supports it (see LshIndex::addPoints), otherwise in
+         * the background. The searches and the following updates go on with the current
+         * index in the meantime.
+         * @param points Matrix with points to be added
+         * @param rebuild_threshold
+         */
         void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
         {
-            nnIndex_->addPoints(points, rebuild_threshold);
+            addPoints(points, std::vector<size_t>(), rebuild_threshold);
+        }
+        
+        /**
+         * Adds points with ids chosen by the caller, see addPoints above
+         * @param points Matrix with points to be added
+         * @param ids their ids (not in the index yet), empty to number them after the
+         * largest id of the index
+         * @param rebuild_threshold
+         */
+        void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2)
+        {
+            bool compact;
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                std::shared_ptr<IndexType> next(snapshot()->clone());
+                bool incremental = next->rebuildsIncrementally();
+                next->addPoints(points, ids, incremental ? rebuild_threshold : 0);
+                if (journal_) {
+                    // the update is only made if it is in the journal
+                    journal_->appendAdd(points, ids);
+                }
+                publish(next);
+                
+                if (rebuilding_) {
+                    rebuild_log_.push_back(Update(points, ids));
+                }
+                else if (!incremental && next->needsRebuild(rebuild_threshold)) {
+                    startRebuild();
+                }
+                compact = needsCompaction();
+            }
+            if (compact) {
+                compactJournal();
+            }
         }
         
         /**
@@ -122,7 +229,44 @@ namespace LDFlann
          */
         void removePoint(size_t point_id)
         {
-            nnIndex_->removePoint(point_id);
+            removePoints(std::vector<size_t>(1, point_id));
+        }
+        
+        /**
+         * Removes several points from the index, in a single update
+         * @param point_ids Ids of the points to be removed
+         */
+        void removePoints(const std::vector<size_t>& point_ids)
+        {
+            bool compact;
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                std::shared_ptr<IndexType> next(snapshot()->clone());
+                next->removePoints(point_ids, get_param(index_params_,"cores",0));
+                if (journal_) {
+                    journal_->appendRemove(point_ids);
+                }
+                publish(next);
+                
+                if (rebuilding_) {
+                    rebuild_log_.push_back(Update(point_ids));
+                }
+                compact = needsCompaction();
+            }
+            if (compact) {
+                compactJournal();
+            }
+        }
+        
+        /**
+         * Waits for the background rebuild started by addPoints, if any
+         */
+        void waitForRebuild()
+        {
+            std::unique_lock<std::mutex> lock(write_mutex_);
+            while (rebuilding_) {
+                rebuild_done_.wait(lock);
+            }
         }
         
         /**
@@ -132,21 +276,119 @@ namespace LDFlann
          */
         ElementType* getPoint(size_t point_id)
         {
-            return nnIndex_->getPoint(point_id);
+            return snapshot()->getPoint(point_id);
         }
         
         /**
-         * Save index to file
+         * Save index to file, in the mapped format (see MappedWriter): loading it maps the
+         * file and uses the index where it lies, without deserialization
          * @param filename
+         * @param compress compress the sections of the file (they are then decompressed
+         * when loading it)
          */
-        void save(std::string filename)
+        void save(std::string filename, bool compress = false)
         {
-            FILE* fout = fopen(filename.c_str(), "wb");
-            if (fout == NULL) {
-                throw FLANNException("Cannot open file");
+            saveSnapshot(snapshot(), filename, compress, NULL);
+        }
+        
+        /**
+         * Persists the index incrementally: saves it to a file, then appends each update
+         * (addPoints, removePoint(s)) to a journal instead of saving the whole index again.
+         * The journal is replayed when the index is loaded with SavedIndexParams(filename,
+         * verify, journal_filename), which goes on appending to it.
+         * @param filename the file of the index
+         * @param journal_filename the journal, created again
+         * @param compress compress the file of the index
+         * @param compact_size size of the journal (in bytes) above which an update compacts
+         * it (0 to only compact it with compactJournal)
+         */
+        void startJournal(const std::string& filename, const std::string& journal_filename, bool compress = false, size_t compact_size = 0)
+        {
+            std::lock_guard<std::mutex> compacting(compact_mutex_);
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            journal_.reset();
+            ::unlink(journal_filename.c_str());
+            journal_.reset(new IndexJournal<ElementType>(journal_filename, snapshot()->veclen(), new_journal_id()));
+            journal::JournalState state;
+            state.journal_id = journal_->id();
+            state.offset = journal_->endOffset();
+            try {
+                saveSnapshot(snapshot(), filename, compress, &state);
+            }
+            catch (...) {
+                journal_.reset();
+                throw;
+            }
+            journal_filename_ = filename;
+            journal_compress_ = compress;
+            journal_compact_size_ = compact_size;
+        }
+        
+        /**
+         * Sets how the journal is compacted
+         * @param compress compress the file of the index
+         * @param compact_size size of the journal (in bytes) above which an update compacts
+         * it (0 to only compact it with compactJournal)
+         */
+        void setJournalCompaction(bool compress, size_t compact_size)
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            journal_compress_ = compress;
+            journal_compact_size_ = compact_size;
+        }
+        
+        /**
+         * Merges the journal into the file of the index: the index is saved again (the
+         * updates go on meanwhile) and the journal keeps the updates made since. The
+         * files can be loaded at any time during the compaction.
+         */
+        void compactJournal()
+        {
+            std::lock_guard<std::mutex> compacting(compact_mutex_);
+            std::shared_ptr<IndexType> index;
+            journal::JournalState state;
+            std::string filename;
+            bool compress;
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                if (!journal_) {
+                    throw FLANNException("The index has no journal");
+                }
+                index = snapshot();
+                state.journal_id = journal_->id();
+                state.offset = journal_->endOffset();
+                filename = journal_filename_;
+                compress = journal_compress_;
+            }
+            
+            // the saved index covers the journal up to state.offset, the journal is
+            // replayed from there until it is compacted
+            std::string temporary = filename + ".tmp";
+            try {
+                saveSnapshot(index, temporary, compress, &state);
+            }
+            catch (...) {
+                ::unlink(temporary.c_str());
+                throw;
+            }
+            if (::rename(temporary.c_str(), filename.c_str()) != 0) {
+                ::unlink(temporary.c_str());
+                throw FLANNException("Cannot replace the index file " + filename);
+            }
+            
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            journal_->compact(state.offset);
+        }
+        
+        /**
+         * Flushes the journal to the disk, the updates made before are then persisted
+         */
+        void syncJournal()
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            if (journal_) {
+                journal_->sync();
             }
-            nnIndex_->saveIndex(fout);
-            fclose(fout);
         }
         
         /**
@@ -154,7 +396,7 @@ namespace LDFlann
          */
         size_t veclen() const
         {
-            return nnIndex_->veclen();
+            return snapshot()->veclen();
         }
         
         /**
@@ -162,7 +404,7 @@ namespace LDFlann
          */
         size_t size() const
         {
-            return nnIndex_->size();
+            return snapshot()->size();
         }
         
         /**
@@ -170,15 +412,47 @@ namespace LDFlann
          */
         flann_algorithm_t getType() const
         {
-            return nnIndex_->getType();
+            return snapshot()->getType();
         }
         
         /**
          * \returns The amount of memory (in bytes) used by the index.
          */
-        int usedMemory() const
+        size_t usedMemory() const
         {
-            return nnIndex_->usedMemory();
+            return snapshot()->usedMemory();
+        }
+        
+        /**
+         * Bucket occupancy statistics of the tables of an LSH index, see LshIndex::getStats
+         */
+        std::vector<lsh::LshStats> getLshStats() const
+        {
+            return lshIndex()->getStats();
+        }
+        
+        /**
+         * @return The expected number of distance evaluations of a query, for an LSH index
+         */
+        float expectedDistanceEvaluations() const
+        {
+            return lshIndex()->expectedDistanceEvaluations();
+        }
+        
+        /**
+         * Prints the bucket occupancy report of an LSH index
+         */
+        void printLshStats(std::ostream& out = std::cout) const
+        {
+            lshIndex()->printStats(out);
+        }
+        
+        /**
+         * @return The memory used by the index, by component
+         */
+        MemoryStats memoryStats() const
+        {
+            return snapshot()->memoryStats();
         }
         
         
@@ -187,7 +461,7 @@ namespace LDFlann
          */
         IndexParams getParameters() const
         {
-            return nnIndex_->getParameters();
+            return snapshot()->getParameters();
         }
         
         /**
@@ -204,7 +478,7 @@ namespace LDFlann
                       size_t knn,
                       const SearchParams& params) const
         {
-            return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+            return snapshot()->knnSearch(queries, indices, dists, knn, params);
         }
         
         /**
@@ -222,7 +496,7 @@ namespace LDFlann
                       size_t knn,
                       const SearchParams& params) const
         {
-            return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+            return snapshot()->knnSearch(queries, indices, dists, knn, params);
         }
         
         /**
@@ -239,7 +513,7 @@ namespace LDFlann
                       size_t knn,
                       const SearchParams& params)
         {
-            return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+            return snapshot()->knnSearch(queries, indices, dists, knn, params);
         }
         
         /**
@@ -257,7 +531,7 @@ namespace LDFlann
                       size_t knn,
                       const SearchParams& params) const
         {
-            return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+            return snapshot()->knnSearch(queries, indices, dists, knn, params);
         }
         
         /**
@@ -275,7 +549,7 @@ namespace LDFlann
                          float radius,
                          const SearchParams& params) const
         {
-            return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+            return snapshot()->radiusSearch(queries, indices, dists, radius, params);
         }
         
         /**
@@ -293,7 +567,7 @@ namespace LDFlann
                          float radius,
                          const SearchParams& params) const
         {
-            return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+            return snapshot()->radiusSearch(queries, indices, dists, radius, params);
         }
         
         /**
@@ -311,7 +585,7 @@ namespace LDFlann
                          float radius,
                          const SearchParams& params) const
         {
-            return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+            return snapshot()->radiusSearch(queries, indices, dists, radius, params);
         }
         
         /**
@@ -329,45 +603,374 @@ namespace LDFlann
                          float radius,
                          const SearchParams& params) const
         {
-            return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+            return snapshot()->radiusSearch(queries, indices, dists, radius, params);
+        }
+        
+        /**
+         * \brief Perform k-nearest neighbor search among some of the points: the points
+         * the filter does not allow are skipped before their distance is computed
+         * \param[in] filter the allowed points, by id: a DynamicBitset, or
+         * SearchFilter(predicate)
+         * (the other parameters as above)
+         */
+        int knnSearch(const Matrix<ElementType>& queries,
+                      Matrix<size_t>& indices,
+                      Matrix<DistanceType>& dists,
+                      size_t knn,
+                      const SearchParams& params,
+                      const SearchFilter& filter) const
+        {
+            SearchParams filtered(params);
+            filtered.filter = &filter;
+            return snapshot()->knnSearch(queries, indices, dists, knn, filtered);
+        }
+        
+        int knnSearch(const Matrix<ElementType>& queries,
+                      std::vector< std::vector<size_t> >& indices,
+                      std::vector<std::vector<DistanceType> >& dists,
+                      size_t knn,
+                      const SearchParams& params,
+                      const SearchFilter& filter) const
+        {
+            SearchParams filtered(params);
+            filtered.filter = &filter;
+            return snapshot()->knnSearch(queries, indices, dists, knn, filtered);
+        }
+        
+        /**
+         * \brief Perform radius search among some of the points, see knnSearch above
+         */
+        int radiusSearch(const Matrix<ElementType>& queries,
+                         Matrix<size_t>& indices,
+                         Matrix<DistanceType>& dists,
+                         float radius,
+                         const SearchParams& params,
+                         const SearchFilter& filter) const
+        {
+            SearchParams filtered(params);
+            filtered.filter = &filter;
+            return snapshot()->radiusSearch(queries, indices, dists, radius, filtered);
+        }
+        
+        int radiusSearch(const Matrix<ElementType>& queries,
+                         std::vector< std::vector<size_t> >& indices,
+                         std::vector<std::vector<DistanceType> >& dists,
+                         float radius,
+                         const SearchParams& params,
+                         const SearchFilter& filter) const
+        {
+            SearchParams filtered(params);
+            filtered.filter = &filter;
+            return snapshot()->radiusSearch(queries, indices, dists, radius, filtered);
+        }
+        
+        /**
+         * Sets how the asynchronous searches are coalesced into batches. Waits for the
+         * pending asynchronous searches, must not be called concurrently with them.
+         * @param params batching parameters
+         */
+        void setAsyncParams(const AsyncSearchParams& params)
+        {
+            std::lock_guard<std::mutex> lock(async_mutex_);
+            if (batcher_) {
+                delete batcher_;
+                batcher_ = NULL;
+            }
+            async_params_ = params;
+        }
+        
+        /**
+         * \brief Queues a k-nearest neighbor search and returns without waiting for it.
+         *
+         * Small submissions are coalesced with other submissions into larger batches (see
+         * AsyncSearchParams). The queries, indices and dists buffers must stay valid until
+         * the returned future is ready.
+         * \param[in] queries The query points for which to find the nearest neighbors
+         * \param[out] indices The indices of the nearest neighbors found
+         * \param[out] dists Distances to the nearest neighbors found
+         * \param[in] knn Number of nearest neighbors to return
+         * \param[in] params Search parameters
+         * \param[in] callback Optional, called with the number of neighbors found on completion
+         * \returns future holding the number of neighbors found
+         */
+        std::future<int> knnSearchAsync(const Matrix<ElementType>& queries,
+                                        Matrix<size_t>& indices,
+                                        Matrix<DistanceType>& dists,
+                                        size_t knn,
+                                        const SearchParams& params,
+                                        typename SearchBatcher<Distance>::Callback callback = typename SearchBatcher<Distance>::Callback())
+        {
+            return getBatcher()->submit(queries, indices, dists, knn, params, callback);
+        }
+        
+        /**
+         * Starts the queued asynchronous searches right away and waits for all of them
+         */
+        void flushAsync()
+        {
+            SearchBatcher<Distance>* batcher;
+            {
+                // not held while waiting, the callbacks may submit new searches
+                std::lock_guard<std::mutex> lock(async_mutex_);
+                batcher = batcher_;
+            }
+            if (batcher) {
+                batcher->flush();
+            }
         }
         
     private:
-        IndexType* load_saved_index(const Matrix<ElementType>& dataset, const std::string& filename, Distance distance)
+        /**
+         * An update applied to the index while it was rebuilt in the background
+         */
+        struct Update
+        {
+            Update(const Matrix<ElementType>& points_, const std::vector<size_t>& ids_) : ids(ids_)
+            {
+                // the index owns its points, the caller may release them once addPoints returns
+                points.assign(points_);
+            }
+            
+            Update(const std::vector<size_t>& removed_ids_) : removed_ids(removed_ids_)
+            {
+            }
+            
+            PointArena<ElementType> points;
+            /** ids of the points added, empty if the index numbered them */
+            std::vector<size_t> ids;
+            std::vector<size_t> removed_ids;
+        };
+        
+        /**
+         * @return The current snapshot, if it is an LSH index
+         */
+        std::shared_ptr<const LshIndex<Distance> > lshIndex() const
+        {
+            std::shared_ptr<const LshIndex<Distance> > index = std::dynamic_pointer_cast<const LshIndex<Distance> >(snapshot());
+            if (!index) {
+                throw FLANNException("Statistics are only available for LSH indices");
+            }
+            return index;
+        }
+        
+        /**
+         * @return The current snapshot of the index
+         */
+        std::shared_ptr<IndexType> snapshot() const
         {
+            return std::atomic_load(&nnIndex_);
+        }
+        
+        /**
+         * Makes an updated index visible to the searches (write_mutex_ held)
+         */
+        void publish(const std::shared_ptr<IndexType>& next)
+        {
+            std::atomic_store(&nnIndex_, next);
+        }
+        
+        /**
+         * Rebuilds a copy of the current index on the thread pool. The updates done in
+         * the meantime are logged and replayed on the rebuilt index before it replaces
+         * the current one (write_mutex_ held).
+         */
+        void startRebuild()
+        {
+            rebuilding_ = true;
+            std::shared_ptr<IndexType> base = snapshot();
+            ThreadPool::instance().submit([this, base]() {
+                std::shared_ptr<IndexType> rebuilt;
+                try {
+                    rebuilt.reset(base->clone());
+                    rebuilt->buildIndex();
+                }
+                catch (...) {
+                    // keep going with the incrementally updated index
+                    rebuilt.reset();
+                }
+                
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                if (!rebuilt) {
+                    rebuild_log_.clear();
+                    rebuilding_ = false;
+                    rebuild_done_.notify_all();
+                    return;
+                }
+                for (size_t i=0;i<rebuild_log_.size();++i) {
+                    const Update& update = rebuild_log_[i];
+                    if (update.points.size()>0) {
+                        rebuilt->addPoints(update.points.matrix(), update.ids, 0);
+                    }
+                    rebuilt->removePoints(update.removed_ids);
+                }
+                rebuild_log_.clear();
+                publish(rebuilt);
+                rebuilding_ = false;
+                rebuild_done_.notify_all();
+            });
+        }
+        
+        SearchBatcher<Distance>* getBatcher()
+        {
+            std::lock_guard<std::mutex> lock(async_mutex_);
+            if (batcher_==NULL) {
+                batcher_ = new SearchBatcher<Distance>(
+                    [this](const Matrix<ElementType>& queries, std::vector< std::vector<size_t> >& indices,
+                           std::vector<std::vector<DistanceType> >& dists, size_t knn, const SearchParams& params) {
+                        return snapshot()->knnSearch(queries, indices, dists, knn, params);
+                    }, async_params_);
+            }
+            return batcher_;
+        }
+        
+        void saveSnapshot(const std::shared_ptr<IndexType>& index, const std::string& filename, bool compress, const journal::JournalState* state)
+        {
+            MappedWriter writer(filename, flann_datatype_value<ElementType>::value, sizeof(ElementType), index->getType(), flann_distance_value<Distance>::value);
+            writer.setCompression(compress);
+            index->saveMapped(writer);
+            if (state != NULL) {
+                writer.addCopy(mapped::JOURNAL, 0, state, sizeof(*state));
+            }
+            // the sections are written in parallel
+            writer.finish(get_param(index_params_,"cores",0));
+        }
+        
+        static uint64_t new_journal_id()
+        {
+            std::random_device device;
+            uint64_t id = (uint64_t(device()) << 32) ^ device();
+            return id ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+        }
+        
+        /**
+         * Replays the journal of a loaded index and appends the following updates to it
+         */
+        void resumeJournal(const std::string& filename, const std::string& journal_filename, const journal::JournalState& state, bool journaled)
+        {
+            if (!journaled) {
+                throw FLANNException("The index file " + filename + " was not saved with a journal (see Index::startJournal)");
+            }
+            std::shared_ptr<IndexType> index = snapshot();
+            journal_.reset(new IndexJournal<ElementType>(journal_filename, index->veclen(), state.journal_id));
+            if (journal_->id() != state.journal_id) {
+                journal_.reset();
+                throw FLANNException("The journal " + journal_filename + " is not the one of the index file " + filename);
+            }
+            
+            std::shared_ptr<IndexType> next(index->clone());
+            journal_->replay(state.offset,
+                             [&](const Matrix<ElementType>& points, const std::vector<size_t>& ids) { next->addPoints(points, ids, 0); },
+                             [&](const std::vector<size_t>& ids) { next->removePoints(ids); });
+            nnIndex_ = next;
+            journal_filename_ = filename;
+        }
+        
+        /**
+         * Checks if the journal has grown enough to be compacted (write_mutex_ held)
+         */
+        bool needsCompaction() const
+        {
+            return journal_ && journal_compact_size_>0 && journal_->endOffset()-journal_->startOffset()>journal_compact_size_;
+        }
+        
+        /**
+         * Loads an index file, throws a FLANNException if it cannot be opened or read
+         * @param state receives the part of its journal covered by the index, if saved with one
+         * @param journaled set if the index was saved with a journal
+         */
+        IndexType* load_saved_index(const Matrix<ElementType>& dataset, const std::string& filename, bool verify_checksums, Distance distance,
+                                    journal::JournalState& state, bool& journaled)
+        {
+            journaled = false;
+            if (mapped::is_mapped_file(filename)) {
+                // the index uses the file where it lies in memory
+                MappedReader reader(filename, verify_checksums, get_param(index_params_,"cores",0));
+                if (reader.hasSection(mapped::JOURNAL)) {
+                    state = reader.get<journal::JournalState>(mapped::JOURNAL);
+                    journaled = true;
+                }
+                IndexParams params;
+                params["algorithm"] = (flann_algorithm_t)reader.header().index_type;
+                std::unique_ptr<IndexType> nnIndex(create_index_by_type<Distance>((flann_algorithm_t)reader.header().index_type, dataset, params, distance));
+                nnIndex->loadMapped(reader);
+                return nnIndex.release();
+            }
+            
             FILE* fin = fopen(filename.c_str(), "rb");
             if (fin == NULL) {
-                return NULL;
+                throw FLANNException("Cannot open file " + filename);
             }
-            IndexHeader header = load_header(fin);
-            if (header.data_type != flann_datatype_value<ElementType>::value) {
-                throw FLANNException("Datatype of saved index is different than of the one to be created.");
+            std::unique_ptr<IndexType> nnIndex;
+            try {
+                IndexHeader header = load_header(fin);
+                if (header.data_type != flann_datatype_value<ElementType>::value) {
+                    throw FLANNException("Datatype of saved index is different than of the one to be created.");
+                }
+                
+                IndexParams params;
+                params["algorithm"] = header.index_type;
+                nnIndex.reset(create_index_by_type<Distance>(header.index_type, dataset, params, distance));
+                rewind(fin);
+                nnIndex->loadIndex(fin);
+            }
+            catch (...) {
+                fclose(fin);
+                throw;
             }
-            
-            IndexParams params;
-            params["algorithm"] = header.index_type;
-            IndexType* nnIndex = create_index_by_type<Distance>(header.index_type, dataset, params, distance);
-            rewind(fin);
-            nnIndex->loadIndex(fin);
             fclose(fin);
             
-            return nnIndex;
+            return nnIndex.release();
         }
         
         void swap( Index& other)
         {
+            // the pending asynchronous searches run on the index they were submitted to
+            flushAsync();
+            other.flushAsync();
+            waitForRebuild();
+            other.waitForRebuild();
             std::swap(nnIndex_, other.nnIndex_);
             std::swap(loaded_, other.loaded_);
             std::swap(index_params_, other.index_params_);
+            std::swap(journal_, other.journal_);
+            std::swap(journal_filename_, other.journal_filename_);
+            std::swap(journal_compress_, other.journal_compress_);
+            std::swap(journal_compact_size_, other.journal_compact_size_);
+            // the batchers search their own index, they are made again with the swapped parameters
+            AsyncSearchParams async_params = async_params_;
+            setAsyncParams(other.async_params_);
+            other.setAsyncParams(async_params);
         }
         
     private:
-        /** Pointer to actual index class */
-        IndexType* nnIndex_;
+        /** Pointer to actual index class, the snapshot currently published to the searches */
+        std::shared_ptr<IndexType> nnIndex_;
         /** Indices if the index was loaded from a file */
         bool loaded_;
         /** Parameters passed to the index */
         IndexParams index_params_;
+        /** Batching parameters of the asynchronous search */
+        AsyncSearchParams async_params_;
+        /** Coalesces the asynchronous searches, created on first use */
+        SearchBatcher<Distance>* batcher_;
+        /** Protects batcher_ */
+        std::mutex async_mutex_;
+        /** Serializes the updates of the index */
+        std::mutex write_mutex_;
+        /** Flag indicating if a rebuild is running in the background */
+        bool rebuilding_;
+        /** Updates done since the background rebuild was started */
+        std::vector<Update> rebuild_log_;
+        /** Signals the end of the background rebuild */
+        std::condition_variable rebuild_done_;
+        /** Journal of the updates, if the index is persisted incrementally */
+        std::unique_ptr<IndexJournal<ElementType> > journal_;
+        /** File of the index the journal applies to */
+        std::string journal_filename_;
+        bool journal_compress_;
+        size_t journal_compact_size_;
+        /** Serializes the compactions of the journal */
+        std::mutex compact_mutex_;
     };
     
     
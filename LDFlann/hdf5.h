@@ -9,6 +9,11 @@
 #ifndef hdf5_h
 #define hdf5_h
 #include <hdf5.h>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
 #include "matrix.h"
 #define CHECK_ERROR(x,y) if ((x)<0) throw FLANNException((y));
 
@@ -96,7 +101,7 @@ namespace LDFlann{
         void load_from_file(LDFlann::Matrix<T>& dataset, const std::string& filename, const std::string& name)
         {
             herr_t status;
-            hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+            hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
             CHECK_ERROR(file_id,"Error opening hdf5 file.");
             
             hid_t dataset_id;
@@ -121,6 +126,183 @@ namespace LDFlann{
             H5Dclose(dataset_id);
             H5Fclose(file_id);
         }
+        
+        /**
+         * A two dimensional dataset of a file, opened read only and read by ranges of rows
+         * (hyperslabs) into a buffer of bounded size
+         */
+        template<typename T>
+        class HDF5DatasetReader
+        {
+        public:
+            HDF5DatasetReader(const std::string& filename, const std::string& name) :
+            file_id_(-1), dataset_id_(-1), space_id_(-1)
+            {
+                file_id_ = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+                if (file_id_<0) {
+                    throw FLANNException("Error opening hdf5 file.");
+                }
+#if H5Dopen_vers == 2
+                dataset_id_ = H5Dopen2(file_id_, name.c_str(), H5P_DEFAULT);
+#else
+                dataset_id_ = H5Dopen(file_id_, name.c_str());
+#endif
+                if (dataset_id_>=0) space_id_ = H5Dget_space(dataset_id_);
+                if (dataset_id_<0 || space_id_<0 || H5Sget_simple_extent_ndims(space_id_)!=2) {
+                    close();
+                    throw FLANNException("Error opening dataset in file.");
+                }
+                H5Sget_simple_extent_dims(space_id_, dims_, NULL);
+                
+                // the rows of a storage chunk of the dataset, read in one piece
+                chunk_rows_ = 1;
+                hid_t plist_id = H5Dget_create_plist(dataset_id_);
+                if (plist_id>=0) {
+                    hsize_t chunk_dims[2];
+                    if (H5Pget_layout(plist_id)==H5D_CHUNKED && H5Pget_chunk(plist_id, 2, chunk_dims)==2) {
+                        chunk_rows_ = std::max<size_t>(chunk_dims[0], 1);
+                    }
+                    H5Pclose(plist_id);
+                }
+            }
+            
+            ~HDF5DatasetReader()
+            {
+                close();
+            }
+            
+            size_t rows() const
+            {
+                return dims_[0];
+            }
+            
+            size_t cols() const
+            {
+                return dims_[1];
+            }
+            
+            /**
+             * @param bytes the size wanted for a range of rows
+             * @return The number of rows of a range of about that size, a multiple of the
+             * rows of the storage chunks of the dataset
+             */
+            size_t rowsPerRead(size_t bytes) const
+            {
+                size_t rows = std::max<size_t>(bytes / std::max<size_t>(cols()*sizeof(T), 1), 1);
+                return std::max<size_t>(rows / chunk_rows_, 1) * chunk_rows_;
+            }
+            
+            /**
+             * Reads a range of rows
+             * @param first the first row
+             * @param count the number of rows
+             * @param buffer receives the rows (count*cols() values)
+             */
+            void read(size_t first, size_t count, T* buffer) const
+            {
+                hsize_t start[2] = { first, 0 };
+                hsize_t size[2] = { count, dims_[1] };
+                herr_t status = H5Sselect_hyperslab(space_id_, H5S_SELECT_SET, start, NULL, size, NULL);
+                CHECK_ERROR(status, "Error selecting rows of dataset");
+                hid_t memspace_id = H5Screate_simple(2, size, NULL);
+                CHECK_ERROR(memspace_id, "Error reading dataset");
+                status = H5Dread(dataset_id_, get_hdf5_type<T>(), memspace_id, space_id_, H5P_DEFAULT, buffer);
+                H5Sclose(memspace_id);
+                CHECK_ERROR(status, "Error reading dataset");
+            }
+            
+        private:
+            HDF5DatasetReader(const HDF5DatasetReader&);
+            HDF5DatasetReader& operator=(const HDF5DatasetReader&);
+            
+            void close()
+            {
+                if (space_id_>=0) H5Sclose(space_id_);
+                if (dataset_id_>=0) H5Dclose(dataset_id_);
+                if (file_id_>=0) H5Fclose(file_id_);
+                space_id_ = dataset_id_ = file_id_ = -1;
+            }
+            
+            hid_t file_id_;
+            hid_t dataset_id_;
+            hid_t space_id_;
+            hsize_t dims_[2];
+            size_t chunk_rows_;
+        };
+        
+        /**
+         * Reads a dataset of a file by ranges of rows into two buffers of bounded size,
+         * without loading it whole: the next range is read on another thread while the
+         * current one is processed. Only one
+         * HDF5 call runs at a time, so the library does not have to be thread safe.
+         * @param filename the file
+         * @param name the dataset
+         * @param consumer called with each range of rows and the number of its first row,
+         * the rows are only valid during the call
+         * @param chunk_bytes the size of a range (about, whole storage chunks are read)
+         * @return The number of rows of the dataset
+         */
+        template<typename T>
+        size_t stream_from_file(const std::string& filename, const std::string& name,
+                                const std::function<void(const LDFlann::Matrix<T>&, size_t)>& consumer,
+                                size_t chunk_bytes = 64<<20)
+        {
+            HDF5DatasetReader<T> reader(filename, name);
+            size_t rows = reader.rows();
+            size_t cols = reader.cols();
+            size_t step = reader.rowsPerRead(chunk_bytes);
+            
+            // one range is processed while the other one is read
+            std::vector<T> buffers[2];
+            std::future<void> pending;
+            std::function<void(size_t, std::vector<T>*)> read = [&](size_t first, std::vector<T>* buffer) {
+                size_t count = std::min(step, rows-first);
+                buffer->resize(count*cols);
+                reader.read(first, count, buffer->data());
+            };
+            
+            if (rows>0) {
+                pending = std::async(std::launch::async, read, size_t(0), &buffers[0]);
+            }
+            for (size_t first=0, current=0; first<rows; first+=step, current^=1) {
+                // rethrows the errors of the read
+                pending.get();
+                if (first+step<rows) {
+                    pending = std::async(std::launch::async, read, first+step, &buffers[current^1]);
+                }
+                size_t count = std::min(step, rows-first);
+                consumer(LDFlann::Matrix<T>(buffers[current].data(), count, cols), first);
+            }
+            return rows;
+        }
+        
+        /**
+         * Builds an index on a dataset of a file, streamed by ranges of rows (see
+         * stream_from_file): the first range builds the index, the next ones are added to
+         * it while the following range is read. Only the read buffers are bounded: the
+         * index keeps its own copy of the points, so the dataset has to fit in memory once
+         * (instead of twice with load_from_file and buildIndex).
+         * @param index the index (Index or an NNIndex), its points are replaced
+         * @param filename the file
+         * @param name the dataset
+         * @param rebuild_threshold passed to addPoints (0 to never rebuild the index while
+         * the points are added)
+         * @param chunk_bytes the size of a range
+         */
+        template<typename IndexType>
+        void build_index_from_file(IndexType& index, const std::string& filename, const std::string& name,
+                                   float rebuild_threshold = 0, size_t chunk_bytes = 64<<20)
+        {
+            typedef typename IndexType::ElementType ElementType;
+            stream_from_file<ElementType>(filename, name, [&](const LDFlann::Matrix<ElementType>& points, size_t first) {
+                if (first==0) {
+                    index.buildIndex(points);
+                }
+                else {
+                    index.addPoints(points, rebuild_threshold);
+                }
+            }, chunk_bytes);
+        }
 
 }
 #endif /* hdf5_h */
@@ -0,0 +1,470 @@
+//
+//  journal.h
+//  LDFlann
+//
+
+#ifndef journal_h
+#define journal_h
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "general.h"
+#include "matrix.h"
+#include "crc32c.h"
+
+namespace LDFlann
+{
+
+    /**
+     * The journal of the updates of an index, appended to after each update so the index
+     * can be persisted without rewriting it. It holds the updates as they were made (the
+     * points added, the ids removed), replaying them on the saved index gives the same
+     * points, ids and buckets.
+     *
+     *   JournalHeader | RecordHeader payload | RecordHeader payload | ...
+     *
+     * The records are addressed by their logical offset: the offset of the first record of
+     * the file is the start_offset of its header, each record moves it by its size. A saved
+     * index covering the records up to some offset (see IndexJournal) only replays the
+     * following ones, so a journal can be compacted by saving the index and starting a
+     * new file at that offset.
+     *
+     * A record is written with one write and has a checksum: a record cut by a crash ends
+     * the journal, it is dropped when the journal is opened again.
+     */
+    namespace journal
+    {
+        const char SIGNATURE[] = "LDFLANN_JOURNAL";
+        const uint32_t VERSION = 1;
+
+        enum RecordType
+        {
+            /** rows, veclen, points */
+            ADD_POINTS = 1,
+            /** count, ids */
+            REMOVE_POINTS = 2,
+            /** rows, veclen, ids, points */
+            ADD_POINTS_WITH_IDS = 3
+        };
+
+        struct JournalHeader
+        {
+            char signature[16];
+            uint32_t version;
+            uint32_t data_type;
+            uint64_t veclen;
+            /** identifies the journal, the saved indices refer to it */
+            uint64_t journal_id;
+            /** logical offset of the first record */
+            uint64_t start_offset;
+            uint32_t header_crc;
+            uint32_t reserved;
+        };
+
+        struct RecordHeader
+        {
+            uint32_t type;
+            /** checksum of the payload */
+            uint32_t crc;
+            uint64_t size;
+        };
+
+        /**
+         * The part of a journal covered by a saved index
+         */
+        struct JournalState
+        {
+            uint64_t journal_id;
+            uint64_t offset;
+        };
+
+        inline uint32_t header_crc(JournalHeader header)
+        {
+            header.header_crc = 0;
+            return crc32c::value(&header, sizeof(header));
+        }
+
+        inline void write_all(int fd, const void* data, size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            while (size > 0) {
+                ssize_t count = ::write(fd, bytes, size);
+                if (count < 0 && errno == EINTR) continue;
+                if (count <= 0) {
+                    throw FLANNException("Error writing the journal");
+                }
+                bytes += count;
+                size -= count;
+            }
+        }
+
+        inline bool read_all(int fd, void* data, size_t size)
+        {
+            unsigned char* bytes = static_cast<unsigned char*>(data);
+            while (size > 0) {
+                ssize_t count = ::read(fd, bytes, size);
+                if (count < 0 && errno == EINTR) continue;
+                if (count <= 0) return false;
+                bytes += count;
+                size -= count;
+            }
+            return true;
+        }
+    }
+
+
+    /**
+     * Appends the updates of an index to its journal, and reads them back
+     * @param ElementType the type of the points
+     */
+    template<typename ElementType>
+    class IndexJournal
+    {
+    public:
+        /**
+         * Opens a journal. An existing journal is checked and its records are read, the
+         * end of a record cut by a crash is dropped. A missing journal is created.
+         * @param filename the journal
+         * @param veclen the size of the points
+         * @param journal_id the id of a new journal
+         */
+        IndexJournal(const std::string& filename, size_t veclen, uint64_t journal_id) :
+        filename_(filename), fd_(-1), veclen_(veclen)
+        {
+            fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd_ < 0) {
+                throw FLANNException("Cannot open the journal " + filename);
+            }
+            try {
+                struct stat st;
+                if (::fstat(fd_, &st) != 0) {
+                    throw FLANNException("Cannot read the journal " + filename);
+                }
+                if (st.st_size == 0) {
+                    create(journal_id, 0);
+                }
+                else {
+                    read();
+                }
+            }
+            catch (...) {
+                ::close(fd_);
+                throw;
+            }
+        }
+
+        ~IndexJournal()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        inline uint64_t id() const
+        {
+            return header_.journal_id;
+        }
+
+        /**
+         * @return The logical offset of the end of the journal
+         */
+        inline uint64_t endOffset() const
+        {
+            return header_.start_offset + size_;
+        }
+
+        /**
+         * @return The logical offset of the first record of the file
+         */
+        inline uint64_t startOffset() const
+        {
+            return header_.start_offset;
+        }
+
+        /**
+         * Appends the adding of points
+         * @param points the points
+         * @param ids their ids, empty if the index assigned them
+         */
+        void appendAdd(const Matrix<ElementType>& points, const std::vector<size_t>& ids = std::vector<size_t>())
+        {
+            size_t ids_size = ids.size()*sizeof(uint64_t);
+            std::vector<unsigned char> payload(2*sizeof(uint64_t) + ids_size + points.rows*veclen_*sizeof(ElementType));
+            uint64_t counts[2] = { points.rows, veclen_ };
+            memcpy(&payload[0], counts, sizeof(counts));
+            for (size_t i = 0; i < ids.size(); ++i) {
+                uint64_t id = ids[i];
+                memcpy(&payload[sizeof(counts) + i*sizeof(id)], &id, sizeof(id));
+            }
+            for (size_t i = 0; i < points.rows; ++i) {
+                memcpy(&payload[sizeof(counts) + ids_size + i*veclen_*sizeof(ElementType)], points[i], veclen_*sizeof(ElementType));
+            }
+            append(ids.empty() ? journal::ADD_POINTS : journal::ADD_POINTS_WITH_IDS, payload);
+        }
+
+        /**
+         * Appends the removal of points
+         */
+        void appendRemove(const std::vector<size_t>& ids)
+        {
+            std::vector<unsigned char> payload(sizeof(uint64_t) + ids.size()*sizeof(uint64_t));
+            uint64_t count = ids.size();
+            memcpy(&payload[0], &count, sizeof(count));
+            for (size_t i = 0; i < ids.size(); ++i) {
+                uint64_t id = ids[i];
+                memcpy(&payload[sizeof(count) + i*sizeof(id)], &id, sizeof(id));
+            }
+            append(journal::REMOVE_POINTS, payload);
+        }
+
+        /**
+         * Flushes the journal to the disk
+         */
+        void sync()
+        {
+            if (::fsync(fd_) != 0) {
+                throw FLANNException("Error writing the journal " + filename_);
+            }
+        }
+
+        /**
+         * Replays the records from a logical offset
+         * @param offset the offset of the first record to replay
+         * @param add called with the points of each ADD_POINTS record and their ids (empty
+         * if the index assigned them)
+         * @param remove called with the ids of each REMOVE_POINTS record
+         */
+        template<typename AddFunction, typename RemoveFunction>
+        void replay(uint64_t offset, AddFunction add, RemoveFunction remove) const
+        {
+            if (offset < header_.start_offset || offset > endOffset()) {
+                throw FLANNException("The journal " + filename_ + " does not hold the updates of the saved index");
+            }
+            size_t first = 0;
+            while (first < records_.size() && records_[first].offset < offset) ++first;
+            if (first < records_.size() ? records_[first].offset != offset : offset != endOffset()) {
+                throw FLANNException("The saved index does not end at a record of the journal " + filename_);
+            }
+
+            std::vector<unsigned char> payload;
+            for (size_t i = first; i < records_.size(); ++i) {
+                const Record& record = records_[i];
+                payload.resize(record.size);
+                if (::pread(fd_, payload.empty() ? NULL : &payload[0], record.size, record.position) != (ssize_t)record.size) {
+                    throw FLANNException("Error reading the journal " + filename_);
+                }
+                if (record.type == journal::REMOVE_POINTS) {
+                    uint64_t count;
+                    memcpy(&count, &payload[0], sizeof(count));
+                    remove(readIds(payload, sizeof(count), count));
+                }
+                else {
+                    uint64_t counts[2];
+                    memcpy(counts, &payload[0], sizeof(counts));
+                    std::vector<size_t> ids;
+                    if (record.type == journal::ADD_POINTS_WITH_IDS) {
+                        ids = readIds(payload, sizeof(counts), counts[0]);
+                    }
+                    size_t rows = sizeof(counts) + ids.size()*sizeof(uint64_t);
+                    add(Matrix<ElementType>(reinterpret_cast<ElementType*>(&payload[rows]), counts[0], counts[1]), ids);
+                }
+            }
+        }
+
+        /**
+         * Starts a new journal file holding the records after a logical offset, which
+         * replaces this one. The records before the offset are covered by a saved index.
+         * @param offset the offset of the first record kept
+         */
+        void compact(uint64_t offset)
+        {
+            size_t first = 0;
+            while (first < records_.size() && records_[first].offset < offset) ++first;
+
+            std::string temporary = filename_ + ".tmp";
+            int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw FLANNException("Cannot open the journal " + temporary);
+            }
+            try {
+                journal::JournalHeader header = header_;
+                header.start_offset = offset;
+                header.header_crc = journal::header_crc(header);
+                journal::write_all(fd, &header, sizeof(header));
+                std::vector<unsigned char> buffer;
+                for (size_t i = first; i < records_.size(); ++i) {
+                    size_t size = sizeof(journal::RecordHeader) + records_[i].size;
+                    buffer.resize(size);
+                    off_t position = records_[i].position - sizeof(journal::RecordHeader);
+                    if (::pread(fd_, &buffer[0], size, position) != (ssize_t)size) {
+                        throw FLANNException("Error reading the journal " + filename_);
+                    }
+                    journal::write_all(fd, &buffer[0], size);
+                }
+                if (::fsync(fd) != 0 || ::rename(temporary.c_str(), filename_.c_str()) != 0) {
+                    throw FLANNException("Error writing the journal " + filename_);
+                }
+            }
+            catch (...) {
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                throw;
+            }
+
+            ::close(fd_);
+            fd_ = fd;
+            header_.start_offset = offset;
+            header_.header_crc = journal::header_crc(header_);
+            std::vector<Record> records(records_.begin() + first, records_.end());
+            size_ = 0;
+            for (size_t i = 0; i < records.size(); ++i) {
+                records[i].position = sizeof(header_) + size_ + sizeof(journal::RecordHeader);
+                size_ += sizeof(journal::RecordHeader) + records[i].size;
+            }
+            records_.swap(records);
+        }
+
+    private:
+        struct Record
+        {
+            uint32_t type;
+            /** logical offset */
+            uint64_t offset;
+            /** position of the payload in the file */
+            off_t position;
+            uint64_t size;
+        };
+
+        void create(uint64_t journal_id, uint64_t start_offset)
+        {
+            memset(&header_, 0, sizeof(header_));
+            strncpy(header_.signature, journal::SIGNATURE, sizeof(header_.signature));
+            header_.version = journal::VERSION;
+            header_.data_type = flann_datatype_value<ElementType>::value;
+            header_.veclen = veclen_;
+            header_.journal_id = journal_id;
+            header_.start_offset = start_offset;
+            header_.header_crc = journal::header_crc(header_);
+            journal::write_all(fd_, &header_, sizeof(header_));
+            size_ = 0;
+        }
+
+        /**
+         * Reads the header and the list of the records, drops a record cut by a crash
+         */
+        void read()
+        {
+            if (!journal::read_all(fd_, &header_, sizeof(header_)) ||
+                strncmp(header_.signature, journal::SIGNATURE, sizeof(header_.signature)) != 0 ||
+                header_.header_crc != journal::header_crc(header_)) {
+                throw FLANNException("Invalid journal " + filename_);
+            }
+            if (header_.version != journal::VERSION) {
+                throw FLANNException("Unsupported journal version");
+            }
+            if (header_.data_type != (uint32_t)flann_datatype_value<ElementType>::value || header_.veclen != veclen_) {
+                throw FLANNException("The journal " + filename_ + " holds points of another type or size");
+            }
+
+            size_ = 0;
+            std::vector<unsigned char> payload;
+            journal::RecordHeader record;
+            while (journal::read_all(fd_, &record, sizeof(record))) {
+                if (record.type != journal::ADD_POINTS && record.type != journal::REMOVE_POINTS &&
+                    record.type != journal::ADD_POINTS_WITH_IDS) break;
+                payload.resize(record.size);
+                if (!journal::read_all(fd_, payload.empty() ? NULL : &payload[0], record.size)) break;
+                if (crc32c::value(payload.empty() ? NULL : &payload[0], record.size) != record.crc || !validPayload(record, payload)) break;
+                Record entry;
+                entry.type = record.type;
+                entry.offset = header_.start_offset + size_;
+                entry.position = sizeof(header_) + size_ + sizeof(record);
+                entry.size = record.size;
+                records_.push_back(entry);
+                size_ += sizeof(record) + record.size;
+            }
+            // the following bytes are the start of a record that was not completely written
+            if (::ftruncate(fd_, sizeof(header_) + size_) != 0 || ::lseek(fd_, 0, SEEK_END) < 0) {
+                throw FLANNException("Error writing the journal " + filename_);
+            }
+        }
+
+        static std::vector<size_t> readIds(const std::vector<unsigned char>& payload, size_t position, size_t count)
+        {
+            std::vector<size_t> ids(count);
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t id;
+                memcpy(&id, &payload[position + i*sizeof(id)], sizeof(id));
+                ids[i] = id;
+            }
+            return ids;
+        }
+
+        bool validPayload(const journal::RecordHeader& record, const std::vector<unsigned char>& payload) const
+        {
+            if (record.type != journal::REMOVE_POINTS) {
+                uint64_t counts[2];
+                if (payload.size() < sizeof(counts)) return false;
+                memcpy(counts, &payload[0], sizeof(counts));
+                size_t row_size = veclen_*sizeof(ElementType);
+                if (record.type == journal::ADD_POINTS_WITH_IDS) row_size += sizeof(uint64_t);
+                return counts[1] == veclen_ && counts[0] <= payload.size() &&
+                payload.size() - sizeof(counts) == counts[0]*row_size;
+            }
+            uint64_t count;
+            if (payload.size() < sizeof(count)) return false;
+            memcpy(&count, &payload[0], sizeof(count));
+            return payload.size() - sizeof(count) == count*sizeof(uint64_t);
+        }
+
+        void append(journal::RecordType type, const std::vector<unsigned char>& payload)
+        {
+            journal::RecordHeader record;
+            record.type = type;
+            record.crc = crc32c::value(&payload[0], payload.size());
+            record.size = payload.size();
+            // the record is written with one call
+            std::vector<unsigned char> buffer(sizeof(record) + payload.size());
+            memcpy(&buffer[0], &record, sizeof(record));
+            memcpy(&buffer[sizeof(record)], &payload[0], payload.size());
+            try {
+                journal::write_all(fd_, &buffer[0], buffer.size());
+            }
+            catch (...) {
+                // the journal must end at a record for the next ones to be read back
+                if (::ftruncate(fd_, sizeof(header_) + size_) == 0) {
+                    ::lseek(fd_, 0, SEEK_END);
+                }
+                throw;
+            }
+
+            Record entry;
+            entry.type = type;
+            entry.offset = endOffset();
+            entry.position = sizeof(header_) + size_ + sizeof(record);
+            entry.size = payload.size();
+            records_.push_back(entry);
+            size_ += buffer.size();
+        }
+
+        IndexJournal(const IndexJournal&);
+        IndexJournal& operator=(const IndexJournal&);
+
+        std::string filename_;
+        int fd_;
+        size_t veclen_;
+        journal::JournalHeader header_;
+        /** size of the records in the file */
+        uint64_t size_;
+        std::vector<Record> records_;
+    };
+
+}
+
+#endif /* journal_h */
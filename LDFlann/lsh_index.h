@@ -12,6 +12,7 @@
 #include <cassert>
 #include <cstring>
 #include <map>
+#include <sstream>
 #include <vector>
 
 #include "general.h"
@@ -38,6 +39,22 @@ namespace LDFlann
             (*this)["key_size"] = key_size;
             // Number of levels to use in multi-probe (0 for standard LSH)
             (*this)["multi_probe_level"] = multi_probe_level;
+            // Number of cores used to fill the tables (0 for auto)
+            (*this)["cores"] = 0;
+            // Minimum number of points rehashed by every addPoints call while the index is rebuilt
+            (*this)["rebuild_step"] = 4096;
+            // Reorder the dataset at build time so the points of a bucket of the first table are adjacent
+            (*this)["reorder"] = false;
+            // Number of tables whose buckets keep a copy of the points next to their indices: the
+            // buckets of these tables are scanned without reading the dataset, but each of them
+            // takes about as much memory as the dataset (0 to only store the indices)
+            (*this)["inline_tables"] = 0;
+            // Bit pack the bucket lists once the tables are built: less memory per table, a little
+            // more work per probed bucket (does not apply to the inline tables)
+            (*this)["compress_tables"] = false;
+            // Fraction of the entries of the tables belonging to removed points above which a
+            // removal purges them from the buckets (0 to only purge at the next build)
+            (*this)["purge_ratio"] = 0.1f;
         }
     };
     
@@ -66,6 +83,11 @@ namespace LDFlann
             table_number_ = get_param<unsigned int>(index_params_,"table_number",12);
             key_size_ = get_param<unsigned int>(index_params_,"key_size",20);
             multi_probe_level_ = get_param<unsigned int>(index_params_,"multi_probe_level",2);
+            inline_tables_ = get_param<int>(index_params_,"inline_tables",0);
+            rebuild_step_ = get_param<int>(index_params_,"rebuild_step",4096);
+            rebuilt_size_ = 0;
+            purge_ratio_ = get_param(index_params_,"purge_ratio",0.1f);
+            purged_count_ = 0;
             
             fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
         }
@@ -82,6 +104,11 @@ namespace LDFlann
             table_number_ = get_param<unsigned int>(index_params_,"table_number",12);
             key_size_ = get_param<unsigned int>(index_params_,"key_size",20);
             multi_probe_level_ = get_param<unsigned int>(index_params_,"multi_probe_level",2);
+            inline_tables_ = get_param<int>(index_params_,"inline_tables",0);
+            rebuild_step_ = get_param<int>(index_params_,"rebuild_step",4096);
+            rebuilt_size_ = 0;
+            purge_ratio_ = get_param(index_params_,"purge_ratio",0.1f);
+            purged_count_ = 0;
             
             fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
             
@@ -93,7 +120,13 @@ namespace LDFlann
         table_number_(other.table_number_),
         key_size_(other.key_size_),
         multi_probe_level_(other.multi_probe_level_),
-        xor_masks_(other.xor_masks_)
+        xor_masks_(other.xor_masks_),
+        inline_tables_(other.inline_tables_),
+        rebuild_step_(other.rebuild_step_),
+        next_tables_(other.next_tables_),
+        rebuilt_size_(other.rebuilt_size_),
+        purge_ratio_(other.purge_ratio_),
+        purged_count_(other.purged_count_)
         {
         }
         
@@ -115,25 +148,98 @@ namespace LDFlann
         }
         
         using BaseClass::buildIndex;
+        using BaseClass::addPoints;
         
-        void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
+        /**
+         * Incrementally adds points to the index.
+         *
+         * Once the index has grown past rebuild_threshold times its size at the last build,
+         * a new set of tables is started and every following call rehashes a slice of the
+         * dataset into it (at least rebuild_step points, and twice the number of points
+         * added), so the cost of a call does not depend on the size of the index. The
+         * searches use the current tables until the new ones hold the whole dataset and
+         * replace them. An index that was never built is built on the whole dataset.
+         * @param points Matrix with points to be added
+         * @param ids the ids of the points, empty to number them
+         * @param rebuild_threshold
+         */
+        void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2)
         {
+            if (tables_.empty() && table_number_>0) {
+                // the index was never built: build it on the whole dataset
+                if (size_==0) {
+                    buildIndex(points, ids);
+                }
+                else {
+                    extendDataset(points, ids);
+                    buildIndex();
+                }
+                return;
+            }
+            
             assert(points.cols==veclen_);
             size_t old_size = size_;
             
-            extendDataset(points);
+            extendDataset(points, ids);
             
-            if (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_) {
-                buildIndex();
-            }
-            else {
-                for (unsigned int i = 0; i < table_number_; ++i) {
-                    lsh::LshTable<ElementType>& table = tables_[i];
-                    for (size_t i=old_size;i<size_;++i) {
-                        table.add(i, points_[i]);
-                    }
+            parallel_for(table_number_, get_param(index_params_,"cores",0), [&](size_t t) {
+                lsh::LshTable<ElementType>& table = tables_[t];
+                for (size_t i=old_size;i<size_;++i) {
+                    table.add(i, points_[i]);
                 }
+            });
+            
+            if (next_tables_.empty() && this->needsRebuild(rebuild_threshold)) {
+                startRebuild();
             }
+            if (!next_tables_.empty()) {
+                continueRebuild(std::max(size_t(rebuild_step_), 2*points.rows));
+            }
+        }
+        
+        /**
+         * Removes a point, purges the removed points from the tables if they hold too many
+         * (see purge_ratio)
+         */
+        void removePoint(size_t id)
+        {
+            BaseClass::removePoint(id);
+            if (needsPurge()) purgeRemovedPoints();
+        }
+        
+        void removePoints(const std::vector<size_t>& ids, int cores = 0)
+        {
+            BaseClass::removePoints(ids, cores);
+            if (needsPurge()) purgeRemovedPoints(cores);
+        }
+        
+        /**
+         * Removes the entries of the removed points from the buckets of the tables (one table
+         * per core), the searches then stop checking them. The points stay in the dataset
+         * until the next build.
+         * @param cores number of cores to use (0 for auto)
+         */
+        void purgeRemovedPoints(int cores = 0)
+        {
+            if (removed_count_==purged_count_) return;
+            size_t count = tables_.size();
+            parallel_for(count + next_tables_.size(), cores, [&](size_t t) {
+                (t<count ? tables_[t] : next_tables_[t-count]).purge(removed_points_);
+            });
+            purged_count_ = removed_count_;
+        }
+        
+        /**
+         * @return true while a rebuild started by addPoints is in progress
+         */
+        bool rebuilding() const
+        {
+            return !next_tables_.empty();
+        }
+        
+        bool rebuildsIncrementally() const
+        {
+            return true;
         }
         
         
@@ -158,32 +264,124 @@ namespace LDFlann
             ar & tables_;
             
             if (Archive::is_loading::value) {
-                index_params_["algorithm"] = getType();
-                index_params_["table_number"] = table_number_;
-                index_params_["key_size"] = key_size_;
-                index_params_["multi_probe_level"] = multi_probe_level_;
+                finishLoadingTables();
             }
         }
         
         void saveIndex(FILE* stream)
         {
-            serialization::SaveArchive sa(stream);
+            // the space of the index is reserved in the file at once
+            serialization::SizeArchive size;
+            size & *this;
+            serialization::BufferedSaveArchive sa(stream);
+            sa.preallocate(size.size());
             sa & *this;
+            sa.close();
         }
         
         void loadIndex(FILE* stream)
         {
-            serialization::LoadArchive la(stream);
+            serialization::BufferedLoadArchive la(stream);
             la & *this;
+            la.close();
+        }
+        
+        void saveMapped(MappedWriter& writer) const
+        {
+            BaseClass::saveMapped(writer);
+            
+            MappedMeta meta;
+            meta.table_number = table_number_;
+            meta.key_size = key_size_;
+            meta.multi_probe_level = multi_probe_level_;
+            meta.table_count = (uint32_t)tables_.size();
+            writer.addCopy(mapped::LSH_META, 0, &meta, sizeof(meta));
+            // the buckets of the tables are frozen in parallel
+            parallel_for(tables_.size(), get_param(index_params_,"cores",0), [&](size_t i) {
+                tables_[i].saveMapped(writer, i);
+            });
+        }
+        
+        void loadMapped(const MappedReader& reader)
+        {
+            BaseClass::loadMapped(reader);
+            
+            const MappedMeta& meta = reader.get<MappedMeta>(mapped::LSH_META);
+            table_number_ = meta.table_number;
+            key_size_ = meta.key_size;
+            multi_probe_level_ = meta.multi_probe_level;
+            xor_masks_.clear();
+            fill_xor_mask(0, key_size_, multi_probe_level_, xor_masks_);
+            
+            tables_.clear();
+            tables_.resize(meta.table_count);
+            parallel_for(tables_.size(), get_param(index_params_,"cores",0), [&](size_t i) {
+                tables_[i].loadMapped(reader, i);
+            });
+            finishLoadingTables();
         }
         
         /**
-         * Computes the index memory usage
+         * Computes the index memory usage, by table
          * Returns: memory used by the index
          */
-        int usedMemory() const
+        MemoryStats memoryStats() const
         {
-            return size_ * sizeof(int);
+            MemoryStats stats = BaseClass::memoryStats();
+            for (size_t i = 0; i < tables_.size(); ++i) {
+                std::ostringstream name;
+                name << "table " << i;
+                tables_[i].memoryStats(stats, name.str());
+            }
+            for (size_t i = 0; i < next_tables_.size(); ++i) {
+                std::ostringstream name;
+                name << "rebuilt table " << i;
+                next_tables_[i].memoryStats(stats, name.str());
+            }
+            stats.add("tables", memory::used(tables_) + memory::used(next_tables_));
+            stats.add("xor masks", memory::used(xor_masks_));
+            return stats;
+        }
+        
+        /**
+         * Statistics of the tables: bucket occupancy and expected number of candidates per query
+         * (with the multi-probe level of the index). Skewed tables show a large max size and
+         * std dev, and a candidate count well above table_number times the mean size.
+         */
+        std::vector<lsh::LshStats> getStats() const
+        {
+            std::vector<lsh::LshStats> stats(tables_.size());
+            parallel_for(tables_.size(), get_param(index_params_,"cores",0), [&](size_t i) {
+                stats[i] = tables_[i].getStats(xor_masks_);
+            });
+            return stats;
+        }
+        
+        /**
+         * @return The expected number of distance evaluations of a query drawn from the dataset
+         */
+        float expectedDistanceEvaluations() const
+        {
+            std::vector<lsh::LshStats> stats = getStats();
+            float evaluations = 0;
+            for (size_t i = 0; i < stats.size(); ++i) {
+                evaluations += stats[i].expected_candidates_;
+            }
+            return evaluations;
+        }
+        
+        /**
+         * Prints the statistics of every table and the expected number of distance evaluations
+         */
+        void printStats(std::ostream& out) const
+        {
+            std::vector<lsh::LshStats> stats = getStats();
+            float evaluations = 0;
+            for (size_t i = 0; i < stats.size(); ++i) {
+                out << "Table " << i << ":\n" << stats[i] << "\n";
+                evaluations += stats[i].expected_candidates_;
+            }
+            out << "Expected distance evaluations per query : " << evaluations << std::endl;
         }
         
         /**
@@ -208,34 +406,40 @@ namespace LDFlann
             
             int count = 0;
             if (params.use_heap==FLANN_True) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNUniqueResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        resultSet.copy(indices[i], dists[i], n, params.sorted);
-                        indices_to_ids(indices[i], indices[i], n);
-                        count += n;
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                            indices_to_ids(indices[i], indices[i], n);
+                            found += n;
+                        }
                     }
-                }
+                    return found;
+                });
             }
             else {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        resultSet.copy(indices[i], dists[i], n, params.sorted);
-                        indices_to_ids(indices[i], indices[i], n);
-                        count += n;
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                            indices_to_ids(indices[i], indices[i], n);
+                            found += n;
+                        }
                     }
-                }
+                    return found;
+                });
             }
             
             return count;
@@ -261,42 +465,48 @@ namespace LDFlann
             
             int count = 0;
             if (params.use_heap==FLANN_True) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNUniqueResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        indices[i].resize(n);
-                        dists[i].resize(n);
-                        if (n > 0) {
-                            resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                            indices_to_ids(&indices[i][0], &indices[i][0], n);
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            indices[i].resize(n);
+                            dists[i].resize(n);
+                            if (n > 0) {
+                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                            }
+                            found += n;
                         }
-                        count += n;
                     }
-                }
+                    return found;
+                });
             }
             else {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        indices[i].resize(n);
-                        dists[i].resize(n);
-                        if (n > 0) {
-                            resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                            indices_to_ids(&indices[i][0], &indices[i][0], n);
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            indices[i].resize(n);
+                            dists[i].resize(n);
+                            if (n > 0) {
+                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                            }
+                            found += n;
                         }
-                        count += n;
                     }
-                }
+                    return found;
+                });
             }
             
             return count;
@@ -311,9 +521,9 @@ namespace LDFlann
          *     vec = the vector for which to search the nearest neighbors
          *     maxCheck = the maximum number of restarts (in a best-bin-first manner)
          */
-        void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& /*searchParams*/) const
+        void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
         {
-            getNeighbors(vec, result);
+            getNeighbors(vec, result, searchParams.filter);
         }
         
     protected:
@@ -323,19 +533,40 @@ namespace LDFlann
          */
         void buildIndexImpl()
         {
+            // a seed makes the build reproducible (e.g. the parameters found by LshAutotuner)
+            if (index_params_.find("random_seed")!=index_params_.end()) {
+                seed_random(get_param<unsigned int>(index_params_,"random_seed"));
+            }
+            
             tables_.resize(table_number_);
+            // The random masks are drawn serially, so the tables do not depend on the number of cores
+            for (unsigned int i = 0; i < table_number_; ++i) {
+                tables_[i] = lsh::LshTable<ElementType>(veclen_, key_size_);
+                tables_[i].setInline(i < inline_tables_);
+            }
+            
+            if (get_param(index_params_,"reorder",false) && table_number_>0) {
+                reorderDataset();
+            }
+            
             std::vector<std::pair<size_t,ElementType*> > features;
             features.reserve(points_.size());
             for (size_t i=0;i<points_.size();++i) {
                 features.push_back(std::make_pair(i, points_[i]));
             }
-            for (unsigned int i = 0; i < table_number_; ++i) {
-                lsh::LshTable<ElementType>& table = tables_[i];
-                table = lsh::LshTable<ElementType>(veclen_, key_size_);
-                
-                // Add the features to the table
-                table.add(features);
-            }
+            
+            // Add the features to the tables
+            bool compress = get_param(index_params_,"compress_tables",false);
+            parallel_for(table_number_, get_param(index_params_,"cores",0), [&](size_t i) {
+                tables_[i].add(features);
+                if (compress) tables_[i].compress();
+            });
+            
+            // a full build supersedes an incremental rebuild in progress
+            next_tables_.clear();
+            rebuilt_size_ = 0;
+            // the removed points were cleaned from the dataset
+            purged_count_ = 0;
         }
         
         void freeIndex()
@@ -345,6 +576,82 @@ namespace LDFlann
         
         
     private:
+        /**
+         * Sorts the dataset by bucket of the first table: the candidates of a bucket are
+         * then read sequentially instead of one random row each. The other tables still
+         * scatter, but their buckets are sorted by position too, so the rows are read in
+         * increasing address order.
+         */
+        void reorderDataset()
+        {
+            std::vector<std::pair<size_t,size_t> > keys(size_);
+            for (size_t i=0;i<size_;++i) {
+                keys[i] = std::make_pair(tables_[0].getKey(points_[i]), i);
+            }
+            std::sort(keys.begin(), keys.end());
+            
+            std::vector<size_t> order(size_);
+            for (size_t i=0;i<size_;++i) {
+                order[i] = keys[i].second;
+            }
+            permuteDataset(order);
+        }
+        
+        /**
+         * Starts an incremental rebuild: draws the masks of the new tables, which are
+         * then filled by continueRebuild()
+         */
+        void startRebuild()
+        {
+            next_tables_.resize(table_number_);
+            for (unsigned int i = 0; i < table_number_; ++i) {
+                next_tables_[i] = lsh::LshTable<ElementType>(veclen_, key_size_);
+                next_tables_[i].setInline(i < inline_tables_);
+            }
+            rebuilt_size_ = 0;
+        }
+        
+        /**
+         * Rehashes the next points into the new tables, and swaps them in once they hold
+         * the whole dataset
+         * @param count maximum number of points to rehash
+         */
+        void continueRebuild(size_t count)
+        {
+            size_t begin = rebuilt_size_;
+            size_t end = std::min(begin+count, size_);
+            bool compress = get_param(index_params_,"compress_tables",false);
+            parallel_for(table_number_, get_param(index_params_,"cores",0), [&](size_t t) {
+                lsh::LshTable<ElementType>& table = next_tables_[t];
+                for (size_t i=begin;i<end;++i) {
+                    table.add(i, points_[i]);
+                }
+                if (end==size_) {
+                    table.optimize();
+                    if (compress) table.compress();
+                }
+            });
+            rebuilt_size_ = end;
+            
+            if (rebuilt_size_==size_) {
+                tables_.swap(next_tables_);
+                next_tables_.clear();
+                rebuilt_size_ = 0;
+                size_at_build_ = size_;
+                // the new tables may hold points removed during the rebuild
+                purged_count_ = 0;
+            }
+        }
+        
+        /**
+         * @return true if the entries of the removed points make up more than purge_ratio
+         * of the entries of the tables
+         */
+        bool needsPurge() const
+        {
+            return purge_ratio_>0 && removed_count_>purged_count_ && removed_count_-purged_count_ > purge_ratio_*size_;
+        }
+        
         /** Defines the comparator on score and index
          */
         typedef std::pair<float, unsigned int> ScoreIndexPair;
@@ -459,9 +766,11 @@ namespace LDFlann
         /** Performs the approximate nearest-neighbor search.
          * This is a slower version than the above as it uses the ResultSet
          * @param vec the feature to analyze
+         * @param filter if not NULL, the points it does not allow are skipped
          */
-        void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result) const
+        void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result, const SearchFilter* filter = NULL) const
         {
+            std::vector<lsh::FeatureIndex> frozen_buffer;
             typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
             typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
             for (; table != table_end; ++table) {
@@ -470,26 +779,80 @@ namespace LDFlann
                 std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
                 for (; xor_mask != xor_mask_end; ++xor_mask) {
                     size_t sub_key = key ^ (*xor_mask);
-                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                    if (bucket == 0) continue;
-                    
-                    // Go over each descriptor index
-                    std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                    std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                    DistanceType hamming_distance;
                     
-                    // Process the rest of the candidates
-                    for (; training_index < last_training_index; ++training_index) {
-                        if (removed_ && removed_points_.test(*training_index)) continue;
-                        // Compute the Hamming distance
-                        //distance_ = Hamming<ElementType>();
-                        hamming_distance = distance_(vec, points_[*training_index], veclen_);
-                        result.addPoint(hamming_distance, *training_index);
+                    if (table->isFrozen()) {
+                        // The bucket as it was when the table was compressed or mapped
+                        const lsh::FeatureIndex* entries;
+                        size_t count = table->getFrozenBucket(sub_key, frozen_buffer, entries);
+                        if (count > 0) addEntries(vec, *table, entries, entries + count, result, filter);
                     }
+                    
+                    const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
+                    if (bucket == 0 || bucket->empty()) continue;
+                    addEntries(vec, *table, bucket->data(), bucket->data() + bucket->size(), result, filter);
                 }
             }
         }
         
+        /** Adds the features of the entries of a bucket to the result
+         */
+        inline void addEntries(const ElementType* vec, const lsh::LshTable<ElementType>& table,
+                               const lsh::FeatureIndex* entry, const lsh::FeatureIndex* entry_end, ResultSet<DistanceType>& result,
+                               const SearchFilter* filter) const
+        {
+            // no check once the removed points are purged from the tables
+            const bool removed = removed_count_>purged_count_;
+            if (table.isInline()) {
+                // The features are in the bucket, next to their index
+                const unsigned int entry_size = table.entrySize();
+                for (; entry < entry_end; entry += entry_size) {
+                    if (removed && removed_points_.test(*entry)) continue;
+                    if (filter != NULL && !filter->allows(removed_ ? ids_[*entry] : *entry)) continue;
+                    DistanceType dist = distance_(vec, lsh::LshTable<ElementType>::entryFeature(entry), veclen_);
+                    result.addPoint(dist, *entry);
+                }
+                return;
+            }
+            
+            for (; entry < entry_end; ++entry) {
+                if (removed && removed_points_.test(*entry)) continue;
+                if (filter != NULL && !filter->allows(removed_ ? ids_[*entry] : *entry)) continue;
+                // Compute the Hamming distance
+                DistanceType hamming_distance = distance_(vec, points_[*entry], veclen_);
+                result.addPoint(hamming_distance, *entry);
+            }
+        }
+        
+        /** Sets the state derived from the tables once they are loaded
+         */
+        void finishLoadingTables()
+        {
+            index_params_["algorithm"] = getType();
+            index_params_["table_number"] = table_number_;
+            index_params_["key_size"] = key_size_;
+            index_params_["multi_probe_level"] = multi_probe_level_;
+            
+            inline_tables_ = 0;
+            for (size_t i = 0; i < tables_.size(); ++i) {
+                if (tables_[i].isInline()) ++inline_tables_;
+            }
+            index_params_["inline_tables"] = (int)inline_tables_;
+            next_tables_.clear();
+            rebuilt_size_ = 0;
+            purge_ratio_ = get_param(index_params_,"purge_ratio",0.1f);
+            // the removed points may still be in the tables
+            purged_count_ = 0;
+        }
+        
+        /** The state of an LSH index in a mapped index file */
+        struct MappedMeta
+        {
+            uint32_t table_number;
+            uint32_t key_size;
+            uint32_t multi_probe_level;
+            uint32_t table_count;
+        };
+        
         
         void swap(LshIndex& other)
         {
@@ -500,6 +863,12 @@ namespace LDFlann
             std::swap(key_size_, other.key_size_);
             std::swap(multi_probe_level_, other.multi_probe_level_);
             std::swap(xor_masks_, other.xor_masks_);
+            std::swap(inline_tables_, other.inline_tables_);
+            std::swap(rebuild_step_, other.rebuild_step_);
+            std::swap(next_tables_, other.next_tables_);
+            std::swap(rebuilt_size_, other.rebuilt_size_);
+            std::swap(purge_ratio_, other.purge_ratio_);
+            std::swap(purged_count_, other.purged_count_);
         }
         
         /** The different hash tables */
@@ -515,6 +884,21 @@ namespace LDFlann
         /** The XOR masks to apply to a key to get the neighboring buckets */
         std::vector<lsh::BucketKey> xor_masks_;
         
+        /** Number of tables (the first ones) storing the points inline in their buckets */
+        unsigned int inline_tables_;
+        
+        /** Minimum number of points rehashed per addPoints call during a rebuild */
+        int rebuild_step_;
+        /** The tables being rebuilt by addPoints (empty when no rebuild is in progress) */
+        std::vector<lsh::LshTable<ElementType> > next_tables_;
+        /** Number of points already rehashed into next_tables_ */
+        size_t rebuilt_size_;
+        
+        /** Fraction of dead entries in the tables above which they are purged */
+        float purge_ratio_;
+        /** Number of removed points whose entries were purged from the tables */
+        size_t purged_count_;
+        
         USING_BASECLASS_SYMBOLS
     };
 }
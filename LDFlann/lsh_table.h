@@ -19,10 +19,17 @@
 #include <map>
 #endif
 #include <math.h>
+#include <memory>
 #include <stddef.h>
+#include <string.h>
+#include <utility>
 
+#include "bit_packing.h"
 #include "dynamic_bitset.h"
+#include "mapped_file.h"
+#include "memory_stats.h"
 #include "matrix.h"
+#include "paged_array.h"
 using namespace std;
 namespace LDFlann
 {
@@ -50,12 +57,18 @@ namespace LDFlann
         struct LshStats
         {
             std::vector<unsigned int> bucket_sizes_;
+            /** Number of non empty buckets
+             */
             size_t n_buckets_;
-            size_t bucket_size_mean_;
+            float bucket_size_mean_;
             size_t bucket_size_median_;
             size_t bucket_size_min_;
             size_t bucket_size_max_;
-            size_t bucket_size_std_dev;
+            float bucket_size_std_dev;
+            /** Expected number of candidates (distance evaluations) of a query drawn from the dataset
+             * in this table, over all the probed buckets
+             */
+            float expected_candidates_;
             /** Each contained vector contains three value: beginning/end for interval, number of elements in the bin
              */
             std::vector<std::vector<unsigned int> > size_histogram_;
@@ -75,7 +88,9 @@ namespace LDFlann
             << std::setiosflags(std::ios::right) << "median size : " << stats.bucket_size_median_ << "\n" << std::setw(w)
             << std::setiosflags(std::ios::right) << "min size : " << std::setiosflags(std::ios::left)
             << stats.bucket_size_min_ << "\n" << std::setw(w) << std::setiosflags(std::ios::right) << "max size : "
-            << std::setiosflags(std::ios::left) << stats.bucket_size_max_;
+            << std::setiosflags(std::ios::left) << stats.bucket_size_max_ << "\n" << std::setw(w)
+            << std::setiosflags(std::ios::right) << "std dev : " << stats.bucket_size_std_dev << "\n" << std::setw(w)
+            << std::setiosflags(std::ios::right) << "candidates/query : " << stats.expected_candidates_;
             
             // Display the histogram
             out << std::endl << std::setw(w) << std::setiosflags(std::ios::right) << "histogram : "
@@ -93,6 +108,10 @@ namespace LDFlann
          * the size of it is pretty small, we keep it as a continuous memory array.
          * The value is an index in the corpus of features (we keep it as an unsigned
          * int for pure memory reasons, it could be a size_t)
+         *
+         * The buckets are split by the high bits of their key into pages, which the copies of
+         * a table share: a change copies the pages it touches first (copy on write), so
+         * copying a table to update it (see Index::addPoints) costs one page per key added.
          */
         template<typename ElementType>
         class LshTable
@@ -112,7 +131,7 @@ namespace LDFlann
             
             /** Default constructor
              */
-            LshTable()
+            LshTable() : feature_size_(0), entry_size_(1), frozen_(false), packed_(false)
             {
             }
             
@@ -136,33 +155,73 @@ namespace LDFlann
             {
                 // Add the value to the corresponding bucket
                 BucketKey key = getKey(feature);
+                BucketPage& page = writablePage(key >> page_shift_);
                 
                 switch (speed_level_) {
                     case kArray:
                         // That means we get the buckets from an array
-                        buckets_speed_[key].push_back(value);
+                        addEntry(page.speed[key & page_mask_], value, feature);
                         break;
                     case kBitsetHash:
                         // That means we can check the bitset for the presence of a key
-                        key_bitset_.set(key);
-                        buckets_space_[key].push_back(value);
+                        page.key_bitset.set(key & page_mask_);
+                        addEntry(page.space[key], value, feature);
                         break;
                     case kHash:
                     {
                         // That means we have to check for the hash table for the presence of a key
-                        buckets_space_[key].push_back(value);
+                        addEntry(page.space[key], value, feature);
                         break;
                     }
                 }
             }
             
+            /** Makes the buckets keep a copy of the features next to their index, so a bucket
+             * can be scanned without reading the dataset. Must be called on an empty table.
+             * An entry of a bucket is then entrySize() values: the index, a padding value
+             * (so the feature is 8-byte aligned) and the feature bytes.
+             * @param inline_features true to store the features in the buckets
+             */
+            void setInline(bool inline_features)
+            {
+                entry_size_ = 1;
+                if (inline_features) {
+                    size_t feature_bytes = feature_size_ * sizeof(ElementType);
+                    entry_size_ = 2 + 2 * (unsigned int)((feature_bytes + 7) / 8);
+                }
+            }
+            
+            /** @return true if the buckets hold a copy of the features
+             */
+            inline bool isInline() const
+            {
+                return entry_size_ > 1;
+            }
+            
+            /** @return The number of values of a bucket entry (1 unless the features are inline)
+             */
+            inline unsigned int entrySize() const
+            {
+                return entry_size_;
+            }
+            
+            /** @return The feature stored in a bucket entry of an inline table
+             */
+            static inline const ElementType* entryFeature(const FeatureIndex* entry)
+            {
+                return reinterpret_cast<const ElementType*>(entry + 2);
+            }
+            
             /** Add a set of features to the table
              * @param dataset the values to store
              */
             void add(const std::vector< std::pair<size_t, ElementType*> >& features)
             {
 #if USE_UNORDERED_MAP
-                buckets_space_.rehash((buckets_space_.size() + features.size()) * 1.2);
+                for (size_t i = 0; i < pages_.size(); ++i) {
+                    BucketPage& page = writablePage(i);
+                    page.space.rehash((page.space.size() + features.size() / pages_.size()) * 1.2);
+                }
 #endif
                 //计算出index
                 // Add the features to the table
@@ -180,21 +239,22 @@ namespace LDFlann
             inline const Bucket* getBucketFromKey(BucketKey key) const
             {
                 // Generate other buckets
+                const BucketPage& page = *pages_[key >> page_shift_];
                 switch (speed_level_) {
                     case kArray:
                         // That means we get the buckets from an array
-                        return &buckets_speed_[key];
+                        return &page.speed[key & page_mask_];
                         break;
                     case kBitsetHash:
                         // That means we can check the bitset for the presence of a key
-                        if (key_bitset_.test(key)) return &buckets_space_.find(key)->second;
+                        if (page.key_bitset.test(key & page_mask_)) return &page.space.find(key)->second;
                         else return 0;
                         break;
                     case kHash:
                     {
                         // That means we have to check for the hash table for the presence of a key
-                        BucketsSpace::const_iterator bucket_it, bucket_end = buckets_space_.end();
-                        bucket_it = buckets_space_.find(key);
+                        BucketsSpace::const_iterator bucket_it, bucket_end = page.space.end();
+                        bucket_it = page.space.find(key);
                         // Stop here if that bucket does not exist
                         if (bucket_it == bucket_end) return 0;
                         else return &bucket_it->second;
@@ -213,12 +273,327 @@ namespace LDFlann
                 return 1;
             }
             
+            /** The buckets of a table laid out in three flat arrays: the bucket of a slot spans
+             * [offsets[slot], offsets[slot+1]) in data (in bytes). The slot of a key is the key
+             * itself if keys is empty, its position in the sorted keys otherwise.
+             */
+            struct FrozenBuckets
+            {
+                std::vector<unsigned char> data;
+                std::vector<BucketKey> keys;
+                std::vector<uint64_t> offsets;
+            };
+            
+            /** Lays out the buckets (frozen and regular) in flat arrays
+             * @param pack true to bit pack the lists (see compress()), false to copy the entries
+             * @param frozen receives the arrays
+             * @param removed if not NULL, the entries of these features are left out
+             * @return the number of entries left out
+             */
+            size_t freeze(bool pack, FrozenBuckets& frozen, const DynamicBitset* removed = NULL) const
+            {
+                std::vector<std::pair<BucketKey, size_t> > sizes;
+                getBucketSizes(sizes);
+                // a dense index if more than half of the keys are used, like optimize()
+                bool dense = sizes.size() > (size_t(1) << key_size_) / 2;
+                size_t slots = dense ? (size_t(1) << key_size_) : sizes.size();
+                
+                frozen.data.clear();
+                frozen.keys.clear();
+                frozen.offsets.clear();
+                frozen.offsets.reserve(slots + 1);
+                if (!dense) frozen.keys.reserve(slots);
+                
+                std::vector<FeatureIndex> buffer;
+                std::vector<FeatureIndex> values;
+                size_t next = 0;
+                size_t purged = 0;
+                for (size_t slot = 0; slot < slots; ++slot) {
+                    BucketKey key = dense ? (BucketKey)slot : sizes[slot].first;
+                    
+                    values.clear();
+                    if (next < sizes.size() && sizes[next].first == key) {
+                        ++next;
+                        const FeatureIndex* entries;
+                        size_t count = getFrozenBucket(key, buffer, entries);
+                        values.insert(values.end(), entries, entries + count);
+                        const Bucket* bucket = getBucketFromKey(key);
+                        if (bucket != 0) values.insert(values.end(), bucket->begin(), bucket->end());
+                    }
+                    if (removed != NULL) {
+                        purged += purgeEntries(values, *removed);
+                        // the buckets left empty are dropped, unless the buckets are indexed by key
+                        if (!dense && values.empty()) continue;
+                    }
+                    
+                    frozen.offsets.push_back(frozen.data.size());
+                    if (!dense) frozen.keys.push_back(key);
+                    if (pack) {
+                        // a bucket is its size followed by the packed list
+                        std::sort(values.begin(), values.end());
+                        values.erase(std::unique(values.begin(), values.end()), values.end());
+                        bitpacking::encode_varint(values.size(), frozen.data);
+                        if (!values.empty()) bitpacking::encode(&values[0], values.size(), frozen.data);
+                    }
+                    else if (!values.empty()) {
+                        size_t offset = frozen.data.size();
+                        frozen.data.resize(offset + values.size() * sizeof(FeatureIndex));
+                        memcpy(&frozen.data[offset], &values[0], values.size() * sizeof(FeatureIndex));
+                    }
+                }
+                frozen.offsets.push_back(frozen.data.size());
+                if (pack) frozen.data.resize(frozen.data.size() + bitpacking::PADDING, 0);
+                return purged;
+            }
+            
+            /** Removes the entries of removed features from the buckets, so the searches do not
+             * scan them anymore. The regular buckets are compacted in place, the frozen ones
+             * (compressed or mapped) are laid out again without them.
+             * @param removed the removed features, by index
+             * @return the number of entries removed
+             */
+            size_t purge(const DynamicBitset& removed)
+            {
+                if (frozen_) {
+                    // the regular buckets are merged into the new frozen ones
+                    FrozenBuckets frozen;
+                    size_t purged = freeze(packed_, frozen, &removed);
+                    setFrozen(frozen);
+                    return purged;
+                }
+                
+                size_t purged = 0;
+                for (size_t p = 0; p < pages_.size(); ++p) {
+                    // the pages without removed features stay shared
+                    if (!hasEntries(*pages_[p], removed)) continue;
+                    BucketPage& page = writablePage(p);
+                    for (size_t key = 0; key < page.speed.size(); ++key) {
+                        purged += purgeEntries(page.speed[key], removed);
+                    }
+                    for (BucketsSpace::iterator it = page.space.begin(); it != page.space.end();) {
+                        purged += purgeEntries(it->second, removed);
+                        if (it->second.empty()) {
+                            if (speed_level_ == kBitsetHash) page.key_bitset.reset(it->first & page_mask_);
+                            it = page.space.erase(it);
+                        }
+                        else {
+                            ++it;
+                        }
+                    }
+                }
+                return purged;
+            }
+            
+            /** Compresses the buckets of a full table: the bucket lists are sorted and bit packed
+             * (see bitpacking), which typically divides their memory by 3 or more, and read with
+             * getFrozenBucket(). The features added afterwards go to regular buckets, looked up
+             * with getBucketFromKey() as before. Tables with inline features are not compressed.
+             */
+            void compress()
+            {
+                if (packed_ || isInline()) return;
+                
+                FrozenBuckets frozen;
+                freeze(true, frozen);
+                setFrozen(frozen);
+                packed_ = true;
+            }
+            
+            /** @return true if the table was compressed
+             */
+            inline bool isPacked() const
+            {
+                return packed_;
+            }
+            
+            /** @return true if the table has frozen buckets (compressed, or mapped from a file)
+             */
+            inline bool isFrozen() const
+            {
+                return frozen_;
+            }
+            
+            /** Gets the frozen part of a bucket
+             * @param key the key of the bucket
+             * @param buffer receives the decoded indices if the table is compressed
+             * @param entries set to the first entry of the bucket
+             * @return the number of values in the bucket, entrySize() per feature (0 if there is
+             * no such bucket)
+             */
+            inline size_t getFrozenBucket(BucketKey key, std::vector<FeatureIndex>& buffer, const FeatureIndex*& entries) const
+            {
+                size_t slot = getFrozenSlot(key);
+                if (slot == size_t(-1)) return 0;
+                const unsigned char* begin = frozen_data_.data() + frozen_offsets_[slot];
+                if (!packed_) {
+                    entries = reinterpret_cast<const FeatureIndex*>(begin);
+                    return (frozen_offsets_[slot + 1] - frozen_offsets_[slot]) / sizeof(FeatureIndex);
+                }
+                size_t count;
+                const unsigned char* list = bitpacking::decode_varint(begin, count);
+                if (count == 0) return 0;
+                if (buffer.size() < count) buffer.resize(count);
+                bitpacking::decode(list, count, &buffer[0]);
+                entries = &buffer[0];
+                return count;
+            }
+            
             /** Get statistics about the table
+             * @param xor_masks the masks giving the buckets probed by a query (multi-probe), by default
+             * only the bucket of the query
              * @return
              */
-            LshStats getStats() const;
+            LshStats getStats(const std::vector<BucketKey>& xor_masks = std::vector<BucketKey>(1, 0)) const;
+            
+            /** @return the number of features in a bucket (0 if it does not exist)
+             */
+            size_t getBucketSize(BucketKey key) const
+            {
+                size_t size = getFrozenSize(getFrozenSlot(key));
+                const Bucket* bucket = getBucketFromKey(key);
+                if (bucket != 0) size += bucket->size() / entry_size_;
+                return size;
+            }
+            
+            /** Gets the keys and sizes of all the non empty buckets
+             * @param sizes receives the (key, size) pairs, sorted by key
+             */
+            void getBucketSizes(std::vector<std::pair<BucketKey, size_t> >& sizes) const
+            {
+                sizes.clear();
+                if (frozen_) {
+                    for (size_t slot = 0; slot + 1 < frozen_offsets_.size(); ++slot) {
+                        size_t size = getFrozenSize(slot);
+                        BucketKey key = frozen_keys_.empty() ? (BucketKey)slot : frozen_keys_[slot];
+                        if (size > 0) sizes.push_back(std::make_pair(key, size));
+                    }
+                }
+                for (size_t p = 0; p < pages_.size(); ++p) {
+                    const BucketPage& page = *pages_[p];
+                    for (size_t key = 0; key < page.speed.size(); ++key) {
+                        BucketKey page_key = (BucketKey)((p << page_shift_) | key);
+                        if (!page.speed[key].empty()) sizes.push_back(std::make_pair(page_key, page.speed[key].size() / entry_size_));
+                    }
+                    for (BucketsSpace::const_iterator it = page.space.begin(); it != page.space.end(); ++it) {
+                        if (!it->second.empty()) sizes.push_back(std::make_pair(it->first, it->second.size() / entry_size_));
+                    }
+                }
+                
+                // merge the compressed and the regular part of a bucket
+                std::sort(sizes.begin(), sizes.end());
+                size_t last = 0;
+                for (size_t i = 1; i < sizes.size(); ++i) {
+                    if (sizes[i].first == sizes[last].first) sizes[last].second += sizes[i].second;
+                    else sizes[++last] = sizes[i];
+                }
+                if (!sizes.empty()) sizes.resize(last + 1);
+            }
+            
+            /** Adds the memory used by the table to the stats
+             * @param stats the memory stats
+             * @param name the name of the table in the stats
+             */
+            void memoryStats(MemoryStats& stats, const std::string& name) const
+            {
+                size_t lists = 0;
+                size_t index = memory::used(pages_) + memory::used(mask_);
+                for (size_t p = 0; p < pages_.size(); ++p) {
+                    const BucketPage& page = *pages_[p];
+                    for (size_t i = 0; i < page.speed.size(); ++i) lists += memory::used(page.speed[i]);
+                    for (BucketsSpace::const_iterator it = page.space.begin(); it != page.space.end(); ++it) lists += memory::used(it->second);
+#if USE_UNORDERED_MAP
+                    index += memory::used_hash(page.space);
+#else
+                    index += memory::used(page.space);
+#endif
+                    index += sizeof(BucketPage) + memory::used(page.speed) + page.key_bitset.usedMemory();
+                }
+                stats.add(name + " buckets", lists);
+                stats.add(name + " bucket index", index);
+                
+                if (frozen_) {
+                    stats.add(name + (packed_ ? " packed buckets" : " frozen buckets"),
+                              frozen_data_.usedMemory() + frozen_keys_.usedMemory() + frozen_offsets_.usedMemory());
+                }
+            }
+            
+            /** Writes the table to a mapped index file, with its buckets frozen
+             * @param writer the file
+             * @param table the number of the table
+             */
+            void saveMapped(MappedWriter& writer, size_t table) const
+            {
+                MappedMeta meta;
+                meta.key_size = key_size_;
+                meta.feature_size = feature_size_;
+                meta.entry_size = entry_size_;
+                meta.packed = packed_;
+                writer.addCopy(mapped::TABLE_META, table, &meta, sizeof(meta));
+                writer.addSection(mapped::TABLE_MASK, table, mask_);
+                if (!packed_ && entry_size_ == 1) {
+                    // plain lists of indices, whose high bytes change little
+                    writer.setCodec(mapped::TABLE_DATA, table, compression::CODEC_SHUFFLE_LZ, sizeof(FeatureIndex));
+                }
+                
+                if (frozen_ && !hasBuckets()) {
+                    // nothing was added since the table was frozen
+                    writer.addSection(mapped::TABLE_KEYS, table, frozen_keys_);
+                    writer.addSection(mapped::TABLE_OFFSETS, table, frozen_offsets_);
+                    writer.addSection(mapped::TABLE_DATA, table, frozen_data_);
+                }
+                else {
+                    FrozenBuckets frozen;
+                    freeze(packed_, frozen);
+                    writer.addSection(mapped::TABLE_KEYS, table, std::move(frozen.keys));
+                    writer.addSection(mapped::TABLE_OFFSETS, table, std::move(frozen.offsets));
+                    writer.addSection(mapped::TABLE_DATA, table, std::move(frozen.data));
+                }
+            }
+            
+            /** Uses the frozen buckets of a table of a mapped index file, where they lie in the mapping
+             * @param reader the file
+             * @param table the number of the table
+             */
+            void loadMapped(const MappedReader& reader, size_t table)
+            {
+                const MappedMeta& meta = reader.get<MappedMeta>(mapped::TABLE_META, table);
+                initialize(meta.feature_size, meta.key_size);
+                entry_size_ = meta.entry_size;
+                ConstArray<size_t> mask = reader.array<size_t>(mapped::TABLE_MASK, table);
+                mask_.assign(mask.begin(), mask.end());
+                
+                frozen_data_ = reader.array<unsigned char>(mapped::TABLE_DATA, table);
+                frozen_keys_ = reader.array<BucketKey>(mapped::TABLE_KEYS, table);
+                frozen_offsets_ = reader.array<uint64_t>(mapped::TABLE_OFFSETS, table);
+                frozen_ = true;
+                packed_ = (meta.packed != 0);
+                
+                // the buckets are read without bound checks, check the layout once
+                size_t slots = frozen_offsets_.size() - 1;
+                size_t entry_bytes = sizeof(FeatureIndex) * entry_size_;
+                bool valid = !frozen_offsets_.empty() && key_size_ < 32 && entry_size_ > 0 &&
+                (frozen_keys_.empty() ? slots == (size_t(1) << key_size_) : slots == frozen_keys_.size()) &&
+                frozen_offsets_[slots] + (packed_ ? bitpacking::PADDING : 0) <= frozen_data_.size();
+                for (size_t slot = 0; valid && slot < slots; ++slot) {
+                    uint64_t size = frozen_offsets_[slot + 1] - frozen_offsets_[slot];
+                    valid = frozen_offsets_[slot] <= frozen_offsets_[slot + 1] && (packed_ ? size > 0 : size % entry_bytes == 0);
+                }
+                if (!valid) {
+                    throw FLANNException("Invalid index file, corrupted hash table");
+                }
+            }
             
         private:
+            /** The description of a table in a mapped index file
+             */
+            struct MappedMeta
+            {
+                uint32_t key_size;
+                uint32_t feature_size;
+                uint32_t entry_size;
+                uint32_t packed;
+            };
+            
             /** defines the speed fo the implementation
              * kArray uses a vector for storing data
              * kBitsetHash uses a hash map but checks for the validity of a key with a bitset
@@ -229,49 +604,194 @@ namespace LDFlann
                 kArray, kBitsetHash, kHash
             };
             
+            /** The regular buckets of the keys of a page
+             */
+            struct BucketPage
+            {
+                /** The buckets of the page, by key & page_mask_ (kArray) */
+                BucketsSpeed speed;
+                /** The buckets of the page, by key (kBitsetHash and kHash) */
+                BucketsSpace space;
+                /** The keys of the buckets of space, by key & page_mask_ (kBitsetHash) */
+                DynamicBitset key_bitset;
+            };
+            
+            /** Number of bits of the keys giving their page (the high ones)
+             */
+            enum { kPageBits = 10 };
+            
             /** Initialize some variables
              */
-            void initialize(size_t key_size)
+            void initialize(size_t feature_size, size_t key_size)
             {
                 speed_level_ = kHash;
                 key_size_ = key_size;
+                feature_size_ = feature_size;
+                entry_size_ = 1;
+                frozen_ = false;
+                packed_ = false;
+                clearPages();
+            }
+            
+            /** Replaces the pages by empty ones, for the current key size
+             */
+            void clearPages()
+            {
+                page_shift_ = key_size_ > kPageBits ? key_size_ - kPageBits : 0;
+                page_mask_ = (BucketKey)((size_t(1) << page_shift_) - 1);
+                // the empty pages are shared until something is added to them
+                pages_.assign(size_t(1) << (key_size_ - page_shift_), std::make_shared<BucketPage>());
             }
             
-            /** Optimize the table for speed/space
+            /** @return A page, copied first if another table (or another page) uses it too
+             */
+            inline BucketPage& writablePage(size_t page)
+            {
+                return detach_page(pages_[page]);
+            }
+            
+            /** @return true if the table has regular buckets (besides the frozen ones)
+             */
+            bool hasBuckets() const
+            {
+                for (size_t p = 0; p < pages_.size(); ++p) {
+                    if (!pages_[p]->speed.empty() || !pages_[p]->space.empty()) return true;
+                }
+                return false;
+            }
+            
+            /** @return true if a page has entries of removed features
+             */
+            bool hasEntries(const BucketPage& page, const DynamicBitset& removed) const
+            {
+                for (size_t key = 0; key < page.speed.size(); ++key) {
+                    for (size_t entry = 0; entry < page.speed[key].size(); entry += entry_size_) {
+                        if (removed.test(page.speed[key][entry])) return true;
+                    }
+                }
+                for (BucketsSpace::const_iterator it = page.space.begin(); it != page.space.end(); ++it) {
+                    for (size_t entry = 0; entry < it->second.size(); entry += entry_size_) {
+                        if (removed.test(it->second[entry])) return true;
+                    }
+                }
+                return false;
+            }
+            
+            /** @return The slot of a key in the frozen buckets, -1 if it has none
+             */
+            inline size_t getFrozenSlot(BucketKey key) const
+            {
+                if (!frozen_) return size_t(-1);
+                if (frozen_keys_.empty()) {
+                    return key + 1 < frozen_offsets_.size() ? key : size_t(-1);
+                }
+                const BucketKey* it = std::lower_bound(frozen_keys_.begin(), frozen_keys_.end(), key);
+                if (it == frozen_keys_.end() || *it != key) return size_t(-1);
+                return it - frozen_keys_.begin();
+            }
+            
+            /** @return The number of features in the frozen bucket of a slot
+             */
+            inline size_t getFrozenSize(size_t slot) const
+            {
+                if (slot == size_t(-1)) return 0;
+                if (!packed_) {
+                    return (frozen_offsets_[slot + 1] - frozen_offsets_[slot]) / (sizeof(FeatureIndex) * entry_size_);
+                }
+                size_t size;
+                bitpacking::decode_varint(frozen_data_.data() + frozen_offsets_[slot], size);
+                return size;
+            }
+            
+            /** Replaces all the buckets by frozen ones, the features added afterwards go to the hash table
+             */
+            void setFrozen(FrozenBuckets& frozen)
+            {
+                frozen_data_ = ConstArray<unsigned char>(frozen.data);
+                frozen_keys_ = ConstArray<BucketKey>(frozen.keys);
+                frozen_offsets_ = ConstArray<uint64_t>(frozen.offsets);
+                frozen_ = true;
+                
+                speed_level_ = kHash;
+                clearPages();
+            }
+            
+            /** Removes the entries of removed features from a list of entries, keeping their order
+             * @return the number of entries removed
+             */
+            size_t purgeEntries(std::vector<FeatureIndex>& entries, const DynamicBitset& removed) const
+            {
+                size_t kept = 0;
+                for (size_t entry = 0; entry < entries.size(); entry += entry_size_) {
+                    if (removed.test(entries[entry])) continue;
+                    if (kept != entry) std::copy(entries.begin() + entry, entries.begin() + entry + entry_size_, entries.begin() + kept);
+                    kept += entry_size_;
+                }
+                size_t purged = (entries.size() - kept) / entry_size_;
+                entries.resize(kept);
+                return purged;
+            }
+            
+            /** Appends the entry of a feature to a bucket
+             */
+            void addEntry(Bucket& bucket, unsigned int value, const ElementType* feature)
+            {
+                bucket.push_back(value);
+                if (entry_size_ == 1) return;
+                
+                size_t entry = bucket.size() - 1;
+                bucket.resize(entry + entry_size_, 0);
+                memcpy(&bucket[entry + 2], feature, feature_size_ * sizeof(ElementType));
+            }
+            
+        public:
+            /** Optimize the table for speed/space, once it is full
              */
             void optimize()
             {
                 // If we are already using the fast storage, no need to do anything
                 if (speed_level_ == kArray) return;
                 
+                size_t buckets = 0;
+                for (size_t p = 0; p < pages_.size(); ++p) buckets += pages_[p]->space.size();
+                
                 // Use an array if it will be more than half full
-                if (buckets_space_.size() > (unsigned int)((1 << key_size_) / 2)) {
+                if (buckets > (unsigned int)((1 << key_size_) / 2)) {
                     speed_level_ = kArray;
-                    // Fill the array version of it
-                    buckets_speed_.resize(1 << key_size_);
-                    for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) buckets_speed_[key_bucket->first] = key_bucket->second;
-                    
-                    // Empty the hash table
-                    buckets_space_.clear();
+                    for (size_t p = 0; p < pages_.size(); ++p) {
+                        BucketPage& page = writablePage(p);
+                        // Fill the array version of it
+                        page.speed.resize(page_mask_ + size_t(1));
+                        for (BucketsSpace::iterator key_bucket = page.space.begin(); key_bucket != page.space.end(); ++key_bucket) page.speed[key_bucket->first & page_mask_] = key_bucket->second;
+                        
+                        // Empty the hash table
+                        page.space.clear();
+                        page.key_bitset.clear();
+                    }
                     return;
                 }
                 
                 // If the bitset is going to use less than 10% of the RAM of the hash map (at least 1 size_t for the key and two
                 // for the vector) or less than 512MB (key_size_ <= 30)
-                if (((std::max(buckets_space_.size(), buckets_speed_.size()) * CHAR_BIT * 3 * sizeof(BucketKey)) / 10
-                     >= size_t(1 << key_size_)) || (key_size_ <= 32)) {
+                if (((buckets * CHAR_BIT * 3 * sizeof(BucketKey)) / 10 >= size_t(1 << key_size_)) || (key_size_ <= 32)) {
                     speed_level_ = kBitsetHash;
-                    key_bitset_.resize(1 << key_size_);
-                    key_bitset_.reset();
-                    // Try with the BucketsSpace
-                    for (BucketsSpace::const_iterator key_bucket = buckets_space_.begin(); key_bucket != buckets_space_.end(); ++key_bucket) key_bitset_.set(key_bucket->first);
+                    for (size_t p = 0; p < pages_.size(); ++p) {
+                        BucketPage& page = writablePage(p);
+                        page.key_bitset.resize(page_mask_ + size_t(1));
+                        page.key_bitset.reset();
+                        // Try with the BucketsSpace
+                        for (BucketsSpace::const_iterator key_bucket = page.space.begin(); key_bucket != page.space.end(); ++key_bucket) page.key_bitset.set(key_bucket->first & page_mask_);
+                    }
                 }
                 else {
                     speed_level_ = kHash;
-                    key_bitset_.clear();
+                    for (size_t p = 0; p < pages_.size(); ++p) {
+                        if (!pages_[p]->key_bitset.empty()) writablePage(p).key_bitset.clear();
+                    }
                 }
             }
             
+        private:
             template<typename Archive>
             void serialize(Archive& ar)
             {
@@ -286,39 +806,164 @@ namespace LDFlann
                 
                 ar & key_size_;
                 ar & mask_;
+                if (ar.getVersion()>=2) {
+                    ar & feature_size_;
+                    ar & entry_size_;
+                }
+                else {
+                    // the tables of the older files store the indices only (the feature size
+                    // is only used by the inline tables)
+                    feature_size_ = 0;
+                    entry_size_ = 1;
+                }
+                if (ar.getVersion()>=4) {
+                    ar & frozen_;
+                    ar & packed_;
+                    if (frozen_) {
+                        ar & frozen_data_;
+                        ar & frozen_keys_;
+                        ar & frozen_offsets_;
+                    }
+                }
+                else {
+                    // the older tables have frozen buckets only if they were compressed, and
+                    // their offsets do not end with the end of the last bucket
+                    packed_ = false;
+                    if (ar.getVersion()>=3) {
+                        ar & packed_;
+                    }
+                    frozen_ = packed_;
+                    if (packed_) {
+                        FrozenBuckets frozen;
+                        std::vector<size_t> offsets;
+                        ar & frozen.data;
+                        ar & frozen.keys;
+                        ar & offsets;
+                        if (frozen.data.size() < bitpacking::PADDING) {
+                            throw FLANNException("Invalid index file, wrong compressed buckets");
+                        }
+                        frozen.offsets.assign(offsets.begin(), offsets.end());
+                        frozen.offsets.push_back(frozen.data.size() - bitpacking::PADDING);
+                        frozen_data_ = ConstArray<unsigned char>(frozen.data);
+                        frozen_keys_ = ConstArray<BucketKey>(frozen.keys);
+                        frozen_offsets_ = ConstArray<uint64_t>(frozen.offsets);
+                    }
+                }
                 
+                // the buckets are saved as one table, whatever the pages
+                if (Archive::is_loading::value) {
+                    clearPages();
+                }
                 if (speed_level_==kArray) {
-                    ar & buckets_speed_;
+                    size_t size = pages_[0]->speed.empty() ? 0 : size_t(1) << key_size_;
+                    ar & size;
+                    if (size != 0 && size != (size_t(1) << key_size_)) {
+                        throw FLANNException("Invalid index file, wrong number of buckets");
+                    }
+                    for (size_t p = 0; p < pages_.size() && size != 0; ++p) {
+                        BucketPage& page = Archive::is_loading::value ? writablePage(p) : *pages_[p];
+                        if (Archive::is_loading::value) page.speed.resize(page_mask_ + size_t(1));
+                        for (size_t key = 0; key < page.speed.size(); ++key) ar & page.speed[key];
+                    }
                 }
                 if (speed_level_==kBitsetHash || speed_level_==kHash) {
-                    ar & buckets_space_;
+                    size_t size = 0;
+                    for (size_t p = 0; p < pages_.size(); ++p) size += pages_[p]->space.size();
+                    ar & size;
+                    if (Archive::is_saving::value) {
+                        // the pages hold the keys in order of their high bits
+                        for (size_t p = 0; p < pages_.size(); ++p) {
+                            for (BucketsSpace::iterator it = pages_[p]->space.begin(); it != pages_[p]->space.end(); ++it) {
+                                BucketKey key = it->first;
+                                ar & key;
+                                ar & it->second;
+                            }
+                        }
+                    }
+                    else {
+                        for (size_t i = 0; i < size; ++i) {
+                            BucketKey key;
+                            ar & key;
+                            if ((size_t(key) >> page_shift_) >= pages_.size()) {
+                                throw FLANNException("Invalid index file, wrong bucket key");
+                            }
+                            BucketPage& page = writablePage(key >> page_shift_);
+                            ar & page.space.insert(page.space.end(), std::make_pair(key, Bucket()))->second;
+                        }
+                    }
                 }
                 if (speed_level_==kBitsetHash) {
-                    ar & key_bitset_;
+                    // the bits of the pages are set again from the keys of their buckets
+                    DynamicBitset key_bitset;
+                    if (Archive::is_saving::value) {
+                        key_bitset.resize(size_t(1) << key_size_);
+                        key_bitset.reset();
+                        for (size_t p = 0; p < pages_.size(); ++p) {
+                            for (BucketsSpace::const_iterator it = pages_[p]->space.begin(); it != pages_[p]->space.end(); ++it) key_bitset.set(it->first);
+                        }
+                    }
+                    ar & key_bitset;
+                    for (size_t p = 0; p < pages_.size() && Archive::is_loading::value; ++p) {
+                        BucketPage& page = writablePage(p);
+                        page.key_bitset.resize(page_mask_ + size_t(1));
+                        page.key_bitset.reset();
+                        for (BucketsSpace::const_iterator it = page.space.begin(); it != page.space.end(); ++it) page.key_bitset.set(it->first & page_mask_);
+                    }
                 }
             }
             friend struct serialization::access;
             
-            /** The vector of all the buckets if they are held for speed
+            /** The pages of the regular buckets, by the high bits of their keys (key >> page_shift_).
+             * A page holds its buckets in an array if they are held for speed, otherwise in a hash
+             * table. If the subkey is small enough, a bitset keeps track of which subkeys are set:
+             * that is just a speedup so that we don't look in the hash table (which can be mush
+             * slower that checking a bitset)
              */
-            BucketsSpeed buckets_speed_;
+            std::vector<std::shared_ptr<BucketPage> > pages_;
             
-            /** The hash table of all the buckets in case we cannot use the speed version
-             */
-            BucketsSpace buckets_space_;
+            /** Number of low bits of a key giving its bucket in its page */
+            unsigned int page_shift_;
+            
+            /** (1 << page_shift_) - 1 */
+            BucketKey page_mask_;
             
             /** What is used to store the data */
             SpeedLevel speed_level_;
             
-            /** If the subkey is small enough, it will keep track of which subkeys are set through that bitset
-             * That is just a speedup so that we don't look in the hash table (which can be mush slower that checking a bitset)
-             */
-            DynamicBitset key_bitset_;
-            
             /** The size of the sub-signature in bits
              */
             unsigned int key_size_;
             
+            /** The number of elements of a feature
+             */
+            unsigned int feature_size_;
+            
+            /** The number of values of a bucket entry: 1 (the index of the feature), or more if
+             * the features are stored inline
+             */
+            unsigned int entry_size_;
+            
+            /** Flag indicating if the table has frozen buckets
+             */
+            bool frozen_;
+            
+            /** Flag indicating if the frozen buckets are compressed
+             */
+            bool packed_;
+            
+            /** The frozen buckets: their entries, or their compressed lists followed by
+             * bitpacking::PADDING bytes if the table is packed (see FrozenBuckets)
+             */
+            ConstArray<unsigned char> frozen_data_;
+            
+            /** The sorted keys of the frozen buckets, empty if they are indexed by key directly
+             */
+            ConstArray<BucketKey> frozen_keys_;
+            
+            /** Where the frozen buckets start in frozen_data_, one more than the buckets
+             */
+            ConstArray<uint64_t> frozen_offsets_;
+            
             // Members only used for the unsigned char specialization
             /** The mask to apply to a feature to get the hash key
              * Only used in the unsigned char case
@@ -334,7 +979,7 @@ namespace LDFlann
         template<>
         inline LshTable<float>::LshTable(unsigned int feature_size,unsigned int subsignature_size)
         {
-            initialize(subsignature_size);
+            initialize(feature_size, subsignature_size);
             mask_ = std::vector<size_t>((size_t)ceil((float)(feature_size * sizeof(float)) / (float)sizeof(size_t)), 0);
             
             // A bit brutal but fast to code
@@ -416,7 +1061,7 @@ namespace LDFlann
         template<>
         inline LshTable<unsigned char>::LshTable(unsigned int feature_size, unsigned int subsignature_size)
         {
-            initialize(subsignature_size);
+            initialize(feature_size, subsignature_size);
             // Allocate the mask
             mask_ = std::vector<size_t>((size_t)ceil((float)(feature_size * sizeof(char)) / (float)sizeof(size_t)), 0);
             
@@ -486,6 +1131,89 @@ namespace LDFlann
             }
             return subsignature;
         }
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        
+        template<typename ElementType>
+        LshStats LshTable<ElementType>::getStats(const std::vector<BucketKey>& xor_masks) const
+        {
+            LshStats stats;
+            stats.n_buckets_ = 0;
+            stats.bucket_size_mean_ = 0;
+            stats.bucket_size_median_ = 0;
+            stats.bucket_size_min_ = 0;
+            stats.bucket_size_max_ = 0;
+            stats.bucket_size_std_dev = 0;
+            stats.expected_candidates_ = 0;
+            
+            std::vector<std::pair<BucketKey, size_t> > sizes;
+            getBucketSizes(sizes);
+            if (sizes.empty()) return stats;
+            
+            double total = 0;
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                stats.bucket_sizes_.push_back((unsigned int)sizes[i].second);
+                total += sizes[i].second;
+            }
+            stats.n_buckets_ = sizes.size();
+            stats.bucket_size_mean_ = float(total / sizes.size());
+            
+            double variance = 0;
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                double diff = sizes[i].second - stats.bucket_size_mean_;
+                variance += diff * diff;
+            }
+            stats.bucket_size_std_dev = float(sqrt(variance / sizes.size()));
+            
+            // A query drawn from the dataset falls in a bucket with a probability proportional to
+            // its size, and then scans that bucket and the neighboring ones given by the masks
+            double candidates = 0;
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                size_t probed = 0;
+                for (size_t m = 0; m < xor_masks.size(); ++m) {
+                    BucketKey key = sizes[i].first ^ xor_masks[m];
+                    if (xor_masks[m] == 0) {
+                        probed += sizes[i].second;
+                    }
+                    else {
+                        std::vector<std::pair<BucketKey, size_t> >::const_iterator it =
+                        std::lower_bound(sizes.begin(), sizes.end(), std::make_pair(key, size_t(0)));
+                        if (it != sizes.end() && it->first == key) probed += it->second;
+                    }
+                }
+                candidates += sizes[i].second * double(probed);
+            }
+            stats.expected_candidates_ = float(candidates / total);
+            
+            std::sort(stats.bucket_sizes_.begin(), stats.bucket_sizes_.end());
+            stats.bucket_size_median_ = stats.bucket_sizes_[stats.bucket_sizes_.size() / 2];
+            stats.bucket_size_min_ = stats.bucket_sizes_.front();
+            stats.bucket_size_max_ = stats.bucket_sizes_.back();
+            
+            // Include a histogram of the buckets
+            unsigned int bin_start = 0;
+            unsigned int bin_end = 20;
+            bool is_new_bin = true;
+            for (std::vector<unsigned int>::iterator iterator = stats.bucket_sizes_.begin(), end = stats.bucket_sizes_.end(); iterator != end; ) {
+                if (*iterator < bin_end) {
+                    if (is_new_bin) {
+                        stats.size_histogram_.push_back(std::vector<unsigned int>(3, 0));
+                        stats.size_histogram_.back()[0] = bin_start;
+                        stats.size_histogram_.back()[1] = bin_end - 1;
+                        is_new_bin = false;
+                    }
+                    ++stats.size_histogram_.back()[2];
+                    ++iterator;
+                }
+                else {
+                    bin_start += 20;
+                    bin_end += 20;
+                    is_new_bin = true;
+                }
+            }
+            
+            return stats;
+        }
+        
         // End the two namespaces
     }
 }
@@ -0,0 +1,140 @@
+//
+//  mapped_dataset.h
+//  LDFlann
+//
+
+#ifndef mapped_dataset_h
+#define mapped_dataset_h
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "general.h"
+#include "matrix.h"
+#include "mapped_file.h"
+
+namespace LDFlann
+{
+
+    /**
+     * A dataset viewing the rows of a file mapped in memory, without copying them: the
+     * file is read on first access to its pages, and the pages are shared by all the
+     * processes mapping it. Copies share the mapping, which stays valid while one of
+     * them exists.
+     *
+     * The mapping is read only, the rows must not be modified through matrix().
+     *
+     * Only the loading is without copy: an index built on the dataset (buildIndex,
+     * addPoints) copies the rows into its point arena, which pads them to its own stride
+     * (neither the raw files nor the vecs formats have this layout). To share the points
+     * between the processes querying an index, save it with its dataset ("save_dataset"
+     * parameter) instead: a loaded index uses the rows where they lie in the mapped file.
+     */
+    template<typename T>
+    class MappedDataset
+    {
+    public:
+        MappedDataset()
+        {
+        }
+
+        MappedDataset(const std::shared_ptr<MappedFile>& file, size_t offset, size_t rows, size_t cols, size_t stride) :
+        file_(file),
+        matrix_(rows>0 ? reinterpret_cast<T*>(const_cast<unsigned char*>(file->data()) + offset) : NULL, rows, cols, stride)
+        {
+        }
+
+        inline const Matrix<T>& matrix() const
+        {
+            return matrix_;
+        }
+
+        inline operator const Matrix<T>&() const
+        {
+            return matrix_;
+        }
+
+        inline size_t rows() const
+        {
+            return matrix_.rows;
+        }
+
+        inline size_t cols() const
+        {
+            return matrix_.cols;
+        }
+
+        /**
+         * Asks the kernel to start reading the whole file, for a dataset about to be
+         * scanned (by buildIndex for instance)
+         */
+        void willNeed() const
+        {
+            if (file_) file_->willNeed(0, file_->size());
+        }
+
+    private:
+        std::shared_ptr<MappedFile> file_;
+        Matrix<T> matrix_;
+    };
+
+
+    /**
+     * Maps a file of rows of cols values stored one after the other, with no header
+     * @param filename the file
+     * @param cols number of values of a row
+     * @param offset number of bytes skipped at the start of the file
+     */
+    template<typename T>
+    MappedDataset<T> map_from_file(const std::string& filename, size_t cols, size_t offset = 0)
+    {
+        if (cols==0) {
+            throw FLANNException("A dataset must have at least one column");
+        }
+        std::shared_ptr<MappedFile> file(new MappedFile(filename));
+        size_t row_size = cols*sizeof(T);
+        if (file->size()<offset || (file->size()-offset)%row_size!=0) {
+            throw FLANNException("The size of file " + filename + " is not a whole number of rows");
+        }
+        return MappedDataset<T>(file, offset, (file->size()-offset)/row_size, cols, row_size);
+    }
+
+    /**
+     * Maps a file in the .fvecs (float), .ivecs (int) or .bvecs (unsigned char) format:
+     * each row is its number of values as a 32 bit integer followed by the values, so
+     * the rows are viewed with a stride skipping these numbers. Only the first and last
+     * rows are checked to have the same number of values, to not read the whole file.
+     * @param filename the file
+     */
+    template<typename T>
+    MappedDataset<T> map_vecs_from_file(const std::string& filename)
+    {
+        std::shared_ptr<MappedFile> file(new MappedFile(filename));
+        if (file->size()==0) {
+            return MappedDataset<T>(file, 0, 0, 0, 0);
+        }
+        int32_t cols;
+        if (file->size()<sizeof(cols)) {
+            throw FLANNException("File " + filename + " is truncated");
+        }
+        memcpy(&cols, file->data(), sizeof(cols));
+        if (cols<=0) {
+            throw FLANNException("Invalid number of values in the first row of file " + filename);
+        }
+        size_t stride = sizeof(cols) + cols*sizeof(T);
+        if (file->size()%stride!=0) {
+            throw FLANNException("The size of file " + filename + " is not a whole number of rows");
+        }
+        size_t rows = file->size()/stride;
+        int32_t last_cols;
+        memcpy(&last_cols, file->data() + (rows-1)*stride, sizeof(last_cols));
+        if (last_cols!=cols) {
+            throw FLANNException("The rows of file " + filename + " do not all have the same number of values");
+        }
+        return MappedDataset<T>(file, sizeof(cols), rows, cols, stride);
+    }
+
+}
+
+#endif /* mapped_dataset_h */
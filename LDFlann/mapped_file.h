@@ -0,0 +1,1144 @@
+//
+//  mapped_file.h
+//  LDFlann
+//
+
+#ifndef mapped_file_h
+#define mapped_file_h
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "general.h"
+#include "params.h"
+#include "parallel.h"
+#include "serialization.h"
+#include "crc32c.h"
+#include "compression.h"
+
+namespace LDFlann
+{
+
+    /**
+     * A file mapped read-only in memory. The pages are shared with the other processes
+     * mapping the same file and are read from disk on first access.
+     */
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& filename) : data_(NULL), size_(0)
+        {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw FLANNException("Cannot open file " + filename);
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw FLANNException("Cannot read the size of file " + filename);
+            }
+            size_ = st.st_size;
+            if (size_ > 0) {
+                void* data = ::mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (data == MAP_FAILED) {
+                    ::close(fd);
+                    throw FLANNException("Cannot map file " + filename);
+                }
+                data_ = static_cast<const unsigned char*>(data);
+            }
+            // the mapping stays valid once the file is closed
+            ::close(fd);
+        }
+
+        ~MappedFile()
+        {
+            if (data_ != NULL) {
+                ::munmap(const_cast<unsigned char*>(data_), size_);
+            }
+        }
+
+        inline const unsigned char* data() const
+        {
+            return data_;
+        }
+
+        inline size_t size() const
+        {
+            return size_;
+        }
+
+        /**
+         * Asks the kernel to start reading a part of the file, to overlap the I/O with
+         * the work on the parts already read
+         */
+        void willNeed(size_t offset, size_t size) const
+        {
+            size_t page = ::sysconf(_SC_PAGESIZE);
+            size_t begin = offset / page * page;
+            if (data_ == NULL || begin >= size_) return;
+            ::madvise(const_cast<unsigned char*>(data_) + begin, std::min(size_, offset + size) - begin, MADV_WILLNEED);
+        }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        const unsigned char* data_;
+        size_t size_;
+    };
+
+
+    /**
+     * An immutable array, either owning its values or viewing memory owned by another
+     * object (e.g. a MappedFile), which it keeps alive. Copies share the values.
+     */
+    template<typename T>
+    class ConstArray
+    {
+    public:
+        ConstArray() : data_(NULL), size_(0)
+        {
+        }
+
+        /**
+         * Takes the values of a vector (the vector is left empty)
+         */
+        explicit ConstArray(std::vector<T>& values) : data_(NULL), size_(0)
+        {
+            if (!values.empty()) {
+                std::shared_ptr<std::vector<T> > owned(new std::vector<T>());
+                owned->swap(values);
+                data_ = &(*owned)[0];
+                size_ = owned->size();
+                owner_ = owned;
+            }
+        }
+
+        /**
+         * Views memory owned by another object
+         * @param owner keeps the memory alive
+         * @param data the values
+         * @param size the number of values
+         */
+        ConstArray(const std::shared_ptr<const void>& owner, const T* data, size_t size) :
+        owner_(owner), data_(data), size_(size)
+        {
+        }
+
+        inline const T& operator[](size_t index) const
+        {
+            return data_[index];
+        }
+
+        inline const T* data() const
+        {
+            return data_;
+        }
+
+        inline const T* begin() const
+        {
+            return data_;
+        }
+
+        inline const T* end() const
+        {
+            return data_ + size_;
+        }
+
+        inline size_t size() const
+        {
+            return size_;
+        }
+
+        inline bool empty() const
+        {
+            return size_ == 0;
+        }
+
+        void clear()
+        {
+            owner_.reset();
+            data_ = NULL;
+            size_ = 0;
+        }
+
+        /**
+         * @return The memory of the values, in bytes
+         */
+        inline size_t usedMemory() const
+        {
+            return size_ * sizeof(T);
+        }
+
+    private:
+        std::shared_ptr<const void> owner_;
+        const T* data_;
+        size_t size_;
+    };
+
+
+    namespace serialization
+    {
+        // a ConstArray is saved like a std::vector
+        template<typename T>
+        struct Serializer<ConstArray<T> >
+        {
+            template<typename InputArchive>
+            static inline void load(InputArchive& ar, ConstArray<T>& val)
+            {
+                std::vector<T> values;
+                ar & values;
+                val = ConstArray<T>(values);
+            }
+
+            template<typename OutputArchive>
+            static inline void save(OutputArchive& ar, const ConstArray<T>& val)
+            {
+                ar & val.size();
+                serialization::save_array(ar, val.data(), val.size());
+            }
+        };
+    }
+
+
+    /**
+     * The mapped index file format. All its parts are flat arrays stored in sections at
+     * aligned offsets, so an index can use them where they lie in the mapping instead
+     * of deserializing them:
+     *
+     *   FileHeader | section | section | ... | SectionEntry[section_count]
+     *
+     * A section is identified by its kind and a table number (0 for the sections that
+     * are not per table). The directory gives the offset, size and CRC-32C of every
+     * section, so a section can be verified, loaded and written independently of the others;
+     * the header and the directory have their own checksums. The integers are stored in
+     * the byte order of the machine that wrote the file, recorded in the header with the
+     * width of size_t, and a file is only loaded on a machine with the same ones.
+     *
+     * A section can be compressed (see compression.h), it is then stored as a
+     * CompressedHeader, the table of its blocks and the blocks, and decompressed when
+     * the file is opened. Its checksum is the one of the compressed bytes.
+     */
+    namespace mapped
+    {
+        const char SIGNATURE[] = "LDFLANN_MAPPED";
+        const uint32_t VERSION = 3;
+        /** Oldest version read, the sections of the version 2 are not compressed */
+        const uint32_t MIN_VERSION = 2;
+        /** Written as a native integer, gives the byte order of the file */
+        const uint32_t BYTE_ORDER_MARK = 0x01020304;
+        /** Alignment of the sections in the file */
+        const size_t ALIGNMENT = 64;
+
+        enum SectionKind
+        {
+            INDEX_META = 1,
+            DATASET,
+            IDS,
+            REMOVED_POINTS,
+            LSH_META,
+            TABLE_META,
+            TABLE_MASK,
+            TABLE_KEYS,
+            TABLE_OFFSETS,
+            TABLE_DATA,
+            DATASET_ORDER,
+            PARAMS,
+            JOURNAL
+        };
+
+        inline const char* section_name(uint32_t kind)
+        {
+            switch (kind) {
+                case INDEX_META: return "index";
+                case DATASET: return "dataset";
+                case IDS: return "ids";
+                case REMOVED_POINTS: return "removed points";
+                case LSH_META: return "lsh";
+                case TABLE_META: return "table";
+                case TABLE_MASK: return "table mask";
+                case TABLE_KEYS: return "table keys";
+                case TABLE_OFFSETS: return "table offsets";
+                case TABLE_DATA: return "table buckets";
+                case DATASET_ORDER: return "dataset order";
+                case PARAMS: return "parameters";
+                case JOURNAL: return "journal";
+            }
+            return "unknown";
+        }
+
+        struct FileHeader
+        {
+            char signature[16];
+            uint32_t version;
+            uint32_t byte_order;
+            /** sizeof(size_t) of the writer */
+            uint32_t size_width;
+            /** sizeof of an element of the dataset */
+            uint32_t element_size;
+            uint32_t data_type;
+            uint32_t index_type;
+            uint32_t distance_type;
+            uint32_t section_count;
+            uint64_t directory_offset;
+            /** total size of the file, to detect truncation */
+            uint64_t file_size;
+            uint32_t directory_crc;
+            /** checksum of the header, computed with this field set to 0 */
+            uint32_t header_crc;
+        };
+
+        struct SectionEntry
+        {
+            uint32_t kind;
+            uint32_t table;
+            uint64_t offset;
+            uint64_t size;
+            uint32_t crc;
+            /** compression::Codec of the section, CODEC_NONE if stored as is */
+            uint32_t codec;
+        };
+
+        /** Size of the blocks of the compressed sections, compressed independently */
+        const size_t COMPRESSED_BLOCK_SIZE = size_t(1) << 20;
+        /** Sections smaller than this are not compressed */
+        const size_t MIN_COMPRESSED_SIZE = 4096;
+
+        struct CompressedHeader
+        {
+            uint64_t raw_size;
+            uint64_t block_count;
+            uint32_t block_size;
+            /** size of the values, for the filters of the codec */
+            uint32_t width;
+        };
+
+        struct CompressedBlock
+        {
+            /** offset of the block from the start of the section */
+            uint64_t offset;
+            uint32_t size;
+            /** 1 if the block did not shrink and is stored as is */
+            uint32_t stored;
+        };
+
+        /**
+         * The codec used for a section by default: the filters follow the values of the
+         * section (MappedWriter::setCodec changes it)
+         * @param kind the kind of the section
+         * @param element_size size of the elements of the dataset
+         * @param width receives the size of the values of the section
+         */
+        inline compression::Codec section_codec(uint32_t kind, size_t element_size, size_t& width)
+        {
+            switch (kind) {
+                case DATASET:
+                    width = element_size;
+                    return element_size > 1 ? compression::CODEC_SHUFFLE_LZ : compression::CODEC_LZ;
+                case IDS:
+                case DATASET_ORDER:
+                    width = sizeof(size_t);
+                    return compression::CODEC_DELTA_LZ;
+                case TABLE_OFFSETS:
+                    width = sizeof(uint64_t);
+                    return compression::CODEC_DELTA_LZ;
+                case TABLE_KEYS:
+                    width = sizeof(uint32_t);
+                    return compression::CODEC_DELTA_LZ;
+                default:
+                    width = 1;
+                    return compression::CODEC_LZ;
+            }
+        }
+
+        /**
+         * @return true if the file starts with the signature of the mapped format
+         */
+        inline bool is_mapped_file(const std::string& filename)
+        {
+            FILE* fin = fopen(filename.c_str(), "rb");
+            if (fin == NULL) return false;
+            char signature[16];
+            bool mapped = fread(signature, sizeof(signature), 1, fin) == 1 && strncmp(signature, SIGNATURE, sizeof(signature)) == 0;
+            fclose(fin);
+            return mapped;
+        }
+
+        /** The types of the index parameters kept in the files */
+        enum ParamType
+        {
+            PARAM_INT = 1,
+            PARAM_UINT,
+            PARAM_FLOAT,
+            PARAM_DOUBLE,
+            PARAM_BOOL,
+            PARAM_STRING,
+            PARAM_ALGORITHM,
+            PARAM_CENTERS_INIT,
+            PARAM_LOG_LEVEL,
+            PARAM_DATATYPE
+        };
+
+        template<typename T>
+        inline void append(std::vector<unsigned char>& out, const T& value)
+        {
+            size_t offset = out.size();
+            out.resize(offset + sizeof(T));
+            memcpy(&out[offset], &value, sizeof(T));
+        }
+
+        template<typename T>
+        inline bool append_param(std::vector<unsigned char>& out, const std::string& name, const any& value, ParamType type)
+        {
+            if (value.type() != typeid(T)) return false;
+            append(out, (uint32_t)type);
+            append(out, (uint32_t)name.size());
+            out.insert(out.end(), name.begin(), name.end());
+            // the const cast() of any does not give a lasting reference to small values
+            any copy(value);
+            append(out, copy.cast<T>());
+            return true;
+        }
+
+        /**
+         * Encodes the parameters of an index, the parameters of other types are left out
+         */
+        inline void encode_params(const IndexParams& params, std::vector<unsigned char>& out)
+        {
+            for (IndexParams::const_iterator it = params.begin(); it != params.end(); ++it) {
+                const std::string& name = it->first;
+                const any& value = it->second;
+                if (value.type() == typeid(std::string)) {
+                    const std::string& text = value.cast<std::string>();
+                    append(out, (uint32_t)PARAM_STRING);
+                    append(out, (uint32_t)name.size());
+                    out.insert(out.end(), name.begin(), name.end());
+                    append(out, (uint32_t)text.size());
+                    out.insert(out.end(), text.begin(), text.end());
+                    continue;
+                }
+                append_param<int>(out, name, value, PARAM_INT) ||
+                append_param<unsigned int>(out, name, value, PARAM_UINT) ||
+                append_param<float>(out, name, value, PARAM_FLOAT) ||
+                append_param<double>(out, name, value, PARAM_DOUBLE) ||
+                append_param<bool>(out, name, value, PARAM_BOOL) ||
+                append_param<flann_algorithm_t>(out, name, value, PARAM_ALGORITHM) ||
+                append_param<flann_centers_init_t>(out, name, value, PARAM_CENTERS_INIT) ||
+                append_param<flann_log_level_t>(out, name, value, PARAM_LOG_LEVEL) ||
+                append_param<flann_datatype_t>(out, name, value, PARAM_DATATYPE);
+            }
+        }
+
+        /**
+         * Reads encoded parameters
+         * @param data the encoded parameters
+         * @param size their size in bytes
+         * @param params receives the parameters
+         */
+        inline void decode_params(const unsigned char* data, size_t size, IndexParams& params)
+        {
+            const unsigned char* end = data + size;
+            while (data < end) {
+                uint32_t type, length;
+                if (end - data < 8) throw FLANNException("Invalid index file, corrupted parameters");
+                memcpy(&type, data, 4);
+                memcpy(&length, data + 4, 4);
+                data += 8;
+                if ((size_t)(end - data) < length) throw FLANNException("Invalid index file, corrupted parameters");
+                std::string name(reinterpret_cast<const char*>(data), length);
+                data += length;
+
+                size_t value_size = 0;
+                switch (type) {
+                    case PARAM_INT: case PARAM_UINT: case PARAM_FLOAT: case PARAM_ALGORITHM:
+                    case PARAM_CENTERS_INIT: case PARAM_LOG_LEVEL: case PARAM_DATATYPE: case PARAM_STRING:
+                        value_size = 4;
+                        break;
+                    case PARAM_DOUBLE:
+                        value_size = sizeof(double);
+                        break;
+                    case PARAM_BOOL:
+                        value_size = sizeof(bool);
+                        break;
+                    default:
+                        throw FLANNException("Invalid index file, corrupted parameters");
+                }
+                if ((size_t)(end - data) < value_size) throw FLANNException("Invalid index file, corrupted parameters");
+
+                switch (type) {
+                    case PARAM_INT: { int32_t v; memcpy(&v, data, 4); params[name] = (int)v; break; }
+                    case PARAM_UINT: { uint32_t v; memcpy(&v, data, 4); params[name] = (unsigned int)v; break; }
+                    case PARAM_FLOAT: { float v; memcpy(&v, data, 4); params[name] = v; break; }
+                    case PARAM_DOUBLE: { double v; memcpy(&v, data, sizeof(v)); params[name] = v; break; }
+                    case PARAM_BOOL: { bool v; memcpy(&v, data, sizeof(v)); params[name] = v; break; }
+                    case PARAM_ALGORITHM: { int32_t v; memcpy(&v, data, 4); params[name] = (flann_algorithm_t)v; break; }
+                    case PARAM_CENTERS_INIT: { int32_t v; memcpy(&v, data, 4); params[name] = (flann_centers_init_t)v; break; }
+                    case PARAM_LOG_LEVEL: { int32_t v; memcpy(&v, data, 4); params[name] = (flann_log_level_t)v; break; }
+                    case PARAM_DATATYPE: { int32_t v; memcpy(&v, data, 4); params[name] = (flann_datatype_t)v; break; }
+                    case PARAM_STRING: {
+                        memcpy(&length, data, 4);
+                        data += 4;
+                        value_size = 0;
+                        if ((size_t)(end - data) < length) throw FLANNException("Invalid index file, corrupted parameters");
+                        params[name] = std::string(reinterpret_cast<const char*>(data), length);
+                        data += length;
+                        break;
+                    }
+                }
+                data += value_size;
+            }
+        }
+    }
+
+
+    /**
+     * Writes a mapped index file. The sections are only recorded when added, finish()
+     * lays them out, computes their checksums and writes them at their offsets with
+     * pwrite, in large chunks written by several threads. The data of a section added
+     * by reference must stay valid until finish() returns.
+     *
+     * Sections can be added from several threads, their order in the file does not
+     * depend on the order they were added in.
+     */
+    class MappedWriter
+    {
+    public:
+        MappedWriter(const std::string& filename, flann_datatype_t data_type, size_t element_size, flann_algorithm_t index_type, flann_distance_t distance_type) :
+        filename_(filename), compress_(false), sequence_(0)
+        {
+            fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd_ < 0) {
+                throw FLANNException("Cannot open file " + filename);
+            }
+            memset(&header_, 0, sizeof(header_));
+            strncpy(header_.signature, mapped::SIGNATURE, sizeof(header_.signature));
+            header_.version = mapped::VERSION;
+            header_.byte_order = mapped::BYTE_ORDER_MARK;
+            header_.size_width = sizeof(size_t);
+            header_.element_size = (uint32_t)element_size;
+            header_.data_type = data_type;
+            header_.index_type = index_type;
+            header_.distance_type = distance_type;
+        }
+
+        ~MappedWriter()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        /**
+         * Adds a section, referencing its data
+         * @param kind the kind of the section
+         * @param table the table of the section (0 if not per table)
+         * @param data the content of the section, valid until finish()
+         * @param size its size in bytes
+         */
+        void addSection(mapped::SectionKind kind, size_t table, const void* data, size_t size)
+        {
+            add(kind, table, data, size, std::shared_ptr<const void>());
+        }
+
+        template<typename T>
+        void addSection(mapped::SectionKind kind, size_t table, const std::vector<T>& values)
+        {
+            addSection(kind, table, values.empty() ? NULL : &values[0], values.size()*sizeof(T));
+        }
+
+        template<typename T>
+        void addSection(mapped::SectionKind kind, size_t table, const ConstArray<T>& values)
+        {
+            addSection(kind, table, values.data(), values.size()*sizeof(T));
+        }
+
+        /**
+         * Adds a section, taking its data
+         */
+        template<typename T>
+        void addSection(mapped::SectionKind kind, size_t table, std::vector<T>&& values)
+        {
+            std::shared_ptr<std::vector<T> > owned = std::make_shared<std::vector<T> >();
+            owned->swap(values);
+            add(kind, table, owned->empty() ? NULL : &(*owned)[0], owned->size()*sizeof(T), owned);
+        }
+
+        /**
+         * Adds a section holding a copy of some (small) data, e.g. a structure on the stack
+         */
+        void addCopy(mapped::SectionKind kind, size_t table, const void* data, size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            addSection(kind, table, std::vector<unsigned char>(bytes, bytes + size));
+        }
+
+        /**
+         * Compresses the sections when written, each one with the codec of its kind
+         */
+        void setCompression(bool compress)
+        {
+            compress_ = compress;
+        }
+
+        /**
+         * Sets the codec of a section, if the file is compressed
+         * @param width the size of the values of the section, for the filters of the codec
+         */
+        void setCodec(mapped::SectionKind kind, size_t table, compression::Codec codec, size_t width)
+        {
+            if (!compression::valid_width(codec, width) && codec != compression::CODEC_NONE) {
+                throw FLANNException("Invalid codec width");
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            codecs_[std::make_pair((uint32_t)kind, (uint32_t)table)] = std::make_pair(codec, width);
+        }
+
+        /**
+         * Writes the sections, the section directory and the header
+         * @param cores number of cores to use (0 for auto)
+         */
+        void finish(int cores = 0)
+        {
+            // the sections of the index first, then the tables
+            std::sort(pending_.begin(), pending_.end(), PendingOrder());
+            if (compress_) {
+                compress(cores);
+            }
+
+            uint64_t offset = align(sizeof(mapped::FileHeader));
+            std::vector<mapped::SectionEntry> directory(pending_.size());
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                mapped::SectionEntry& entry = directory[i];
+                memset(&entry, 0, sizeof(entry));
+                entry.kind = pending_[i].kind;
+                entry.table = pending_[i].table;
+                entry.offset = offset;
+                entry.size = pending_[i].size;
+                entry.codec = pending_[i].codec;
+                offset = align(offset + entry.size);
+            }
+            parallel_for(pending_.size(), cores, [&](size_t i) {
+                directory[i].crc = crc32c::value(pending_[i].data, pending_[i].size);
+            });
+
+            header_.section_count = (uint32_t)directory.size();
+            header_.directory_offset = offset;
+            size_t directory_size = directory.size()*sizeof(mapped::SectionEntry);
+            header_.directory_crc = crc32c::value(directory.empty() ? NULL : &directory[0], directory_size);
+            header_.file_size = offset + directory_size;
+            header_.header_crc = 0;
+            header_.header_crc = crc32c::value(&header_, sizeof(header_));
+
+            // the padding between the sections is left to the zeros of the extended file
+            if (::ftruncate(fd_, header_.file_size) != 0) {
+                throw FLANNException("Error writing the index file " + filename_);
+            }
+
+            // the large sections are written in several chunks, written in parallel
+            std::vector<Chunk> chunks;
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                for (uint64_t begin = 0; begin < pending_[i].size; begin += CHUNK_SIZE) {
+                    Chunk chunk;
+                    chunk.data = static_cast<const unsigned char*>(pending_[i].data) + begin;
+                    chunk.offset = directory[i].offset + begin;
+                    chunk.size = std::min<uint64_t>(CHUNK_SIZE, pending_[i].size - begin);
+                    chunks.push_back(chunk);
+                }
+            }
+            Chunk chunk;
+            chunk.data = &header_;
+            chunk.offset = 0;
+            chunk.size = sizeof(header_);
+            chunks.push_back(chunk);
+            if (!directory.empty()) {
+                chunk.data = &directory[0];
+                chunk.offset = header_.directory_offset;
+                chunk.size = directory_size;
+                chunks.push_back(chunk);
+            }
+
+            std::vector<char> written(chunks.size());
+            parallel_for(chunks.size(), cores, [&](size_t i) {
+                written[i] = write(chunks[i]);
+            });
+            if (std::find(written.begin(), written.end(), 0) != written.end()) {
+                throw FLANNException("Error writing the index file " + filename_);
+            }
+            if (::close(fd_) != 0) {
+                fd_ = -1;
+                throw FLANNException("Error writing the index file " + filename_);
+            }
+            fd_ = -1;
+        }
+
+    private:
+        /** Size of the blocks written by one call, 8MB (an enum: it needs no definition out of the class) */
+        enum { CHUNK_SIZE = 8 << 20 };
+
+        struct Pending
+        {
+            uint32_t kind;
+            uint32_t table;
+            const void* data;
+            uint64_t size;
+            uint32_t codec;
+            /** order of addition, among the sections with the same kind and table */
+            size_t sequence;
+            std::shared_ptr<const void> owner;
+        };
+
+        struct PendingOrder
+        {
+            bool operator()(const Pending& a, const Pending& b) const
+            {
+                bool a_table = a.kind >= mapped::TABLE_META && a.kind <= mapped::TABLE_DATA;
+                bool b_table = b.kind >= mapped::TABLE_META && b.kind <= mapped::TABLE_DATA;
+                if (a_table != b_table) return b_table;
+                if (a_table && a.table != b.table) return a.table < b.table;
+                if (a.kind != b.kind) return a.kind < b.kind;
+                if (a.table != b.table) return a.table < b.table;
+                return a.sequence < b.sequence;
+            }
+        };
+
+        struct Chunk
+        {
+            const void* data;
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        void add(mapped::SectionKind kind, size_t table, const void* data, size_t size, const std::shared_ptr<const void>& owner)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Pending pending;
+            pending.kind = kind;
+            pending.table = (uint32_t)table;
+            pending.data = data;
+            pending.size = size;
+            pending.codec = compression::CODEC_NONE;
+            pending.sequence = sequence_++;
+            pending.owner = owner;
+            pending_.push_back(pending);
+        }
+
+        compression::Codec codec(const Pending& pending, size_t& width) const
+        {
+            std::map<std::pair<uint32_t, uint32_t>, std::pair<compression::Codec, size_t> >::const_iterator it =
+            codecs_.find(std::make_pair(pending.kind, pending.table));
+            if (it == codecs_.end()) {
+                return mapped::section_codec(pending.kind, header_.element_size, width);
+            }
+            width = it->second.second;
+            return it->second.first;
+        }
+
+        /**
+         * Compresses the sections, the blocks of all the sections are compressed in parallel
+         */
+        void compress(int cores)
+        {
+            struct Job
+            {
+                size_t section;
+                size_t block;
+                bool compressed;
+                std::vector<unsigned char> data;
+            };
+            std::vector<Job> jobs;
+            std::vector<size_t> first_job(pending_.size() + 1);
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                first_job[i] = jobs.size();
+                size_t width;
+                if (pending_[i].size < mapped::MIN_COMPRESSED_SIZE || codec(pending_[i], width) == compression::CODEC_NONE) continue;
+                size_t blocks = (pending_[i].size + mapped::COMPRESSED_BLOCK_SIZE - 1) / mapped::COMPRESSED_BLOCK_SIZE;
+                for (size_t b = 0; b < blocks; ++b) {
+                    Job job;
+                    job.section = i;
+                    job.block = b;
+                    job.compressed = false;
+                    jobs.push_back(job);
+                }
+            }
+            first_job[pending_.size()] = jobs.size();
+
+            parallel_for(jobs.size(), cores, [&](size_t j) {
+                Job& job = jobs[j];
+                const Pending& pending = pending_[job.section];
+                size_t width;
+                compression::Codec codec = this->codec(pending, width);
+                size_t begin = job.block * mapped::COMPRESSED_BLOCK_SIZE;
+                size_t size = std::min<size_t>(mapped::COMPRESSED_BLOCK_SIZE, pending.size - begin);
+                job.compressed = compression::compress_block(codec, width, static_cast<const unsigned char*>(pending.data) + begin, size, job.data);
+            });
+
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                if (first_job[i] == first_job[i + 1]) continue;
+                Pending& pending = pending_[i];
+                size_t block_count = first_job[i + 1] - first_job[i];
+                mapped::CompressedHeader header;
+                memset(&header, 0, sizeof(header));
+                header.raw_size = pending.size;
+                header.block_count = block_count;
+                header.block_size = (uint32_t)mapped::COMPRESSED_BLOCK_SIZE;
+                size_t width;
+                compression::Codec codec = this->codec(pending, width);
+                header.width = (uint32_t)width;
+
+                size_t payload_size = sizeof(header) + block_count * sizeof(mapped::CompressedBlock);
+                std::vector<mapped::CompressedBlock> blocks(block_count);
+                for (size_t b = 0; b < block_count; ++b) {
+                    const Job& job = jobs[first_job[i] + b];
+                    size_t raw = std::min<size_t>(mapped::COMPRESSED_BLOCK_SIZE, pending.size - b * mapped::COMPRESSED_BLOCK_SIZE);
+                    blocks[b].offset = payload_size;
+                    blocks[b].size = (uint32_t)(job.compressed ? job.data.size() : raw);
+                    blocks[b].stored = !job.compressed;
+                    payload_size += blocks[b].size;
+                }
+                // the sections that do not shrink are stored as is
+                if (payload_size >= pending.size) continue;
+
+                std::vector<unsigned char> payload(payload_size);
+                memcpy(&payload[0], &header, sizeof(header));
+                memcpy(&payload[sizeof(header)], &blocks[0], block_count * sizeof(mapped::CompressedBlock));
+                for (size_t b = 0; b < block_count; ++b) {
+                    const Job& job = jobs[first_job[i] + b];
+                    const unsigned char* data = blocks[b].stored ? static_cast<const unsigned char*>(pending.data) + b * mapped::COMPRESSED_BLOCK_SIZE : &job.data[0];
+                    memcpy(&payload[blocks[b].offset], data, blocks[b].size);
+                }
+                std::shared_ptr<std::vector<unsigned char> > owned = std::make_shared<std::vector<unsigned char> >();
+                owned->swap(payload);
+                pending.data = &(*owned)[0];
+                pending.size = owned->size();
+                pending.owner = owned;
+                pending.codec = codec;
+            }
+        }
+
+        bool write(const Chunk& chunk) const
+        {
+            const unsigned char* data = static_cast<const unsigned char*>(chunk.data);
+            uint64_t offset = chunk.offset;
+            uint64_t size = chunk.size;
+            while (size > 0) {
+                ssize_t count = ::pwrite(fd_, data, size, offset);
+                if (count < 0 && errno == EINTR) continue;
+                if (count <= 0) return false;
+                data += count;
+                offset += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        static uint64_t align(uint64_t offset)
+        {
+            return (offset + mapped::ALIGNMENT - 1) / mapped::ALIGNMENT * mapped::ALIGNMENT;
+        }
+
+        MappedWriter(const MappedWriter&);
+        MappedWriter& operator=(const MappedWriter&);
+
+        std::string filename_;
+        int fd_;
+        bool compress_;
+        mapped::FileHeader header_;
+        std::mutex mutex_;
+        size_t sequence_;
+        std::vector<Pending> pending_;
+        std::map<std::pair<uint32_t, uint32_t>, std::pair<compression::Codec, size_t> > codecs_;
+    };
+
+
+    /**
+     * Maps a mapped index file and gives access to its sections. The header and the
+     * directory are checked when the file is opened, the sections by verify(). The
+     * compressed sections are decompressed when the file is opened, the others are
+     * used where they lie in the mapping.
+     */
+    class MappedReader
+    {
+    public:
+        /**
+         * @param filename the file
+         * @param verify check the checksums of the sections before using them
+         * @param cores number of cores used to check and decompress the sections (0 for auto)
+         */
+        explicit MappedReader(const std::string& filename, bool verify = false, int cores = 0) : file_(new MappedFile(filename))
+        {
+            const unsigned char* data = file_->data();
+            size_t size = file_->size();
+            if (size < sizeof(mapped::FileHeader)) {
+                throw FLANNException("Invalid index file, cannot read");
+            }
+            memcpy(&header_, data, sizeof(header_));
+            if (strncmp(header_.signature, mapped::SIGNATURE, sizeof(header_.signature)) != 0) {
+                throw FLANNException("Invalid index file, wrong signature");
+            }
+            if (header_.version < mapped::MIN_VERSION || header_.version > mapped::VERSION) {
+                throw FLANNException("Unsupported index file version");
+            }
+            mapped::FileHeader header = header_;
+            header.header_crc = 0;
+            if (crc32c::value(&header, sizeof(header)) != header_.header_crc) {
+                throw FLANNException("Invalid index file, corrupted header");
+            }
+            if (header_.byte_order != mapped::BYTE_ORDER_MARK || header_.size_width != sizeof(size_t)) {
+                throw FLANNException("Index file written on a machine with a different byte order or word size");
+            }
+            if (header_.file_size != size) {
+                throw FLANNException("Invalid index file, truncated");
+            }
+            if (header_.directory_offset > size ||
+                (size - header_.directory_offset) / sizeof(mapped::SectionEntry) < header_.section_count) {
+                throw FLANNException("Invalid index file, truncated section directory");
+            }
+            directory_.resize(header_.section_count);
+            if (!directory_.empty()) {
+                memcpy(&directory_[0], data + header_.directory_offset, directory_.size()*sizeof(mapped::SectionEntry));
+            }
+            if (crc32c::value(directory_.empty() ? NULL : &directory_[0], directory_.size()*sizeof(mapped::SectionEntry)) != header_.directory_crc) {
+                throw FLANNException("Invalid index file, corrupted section directory");
+            }
+            for (size_t i = 0; i < directory_.size(); ++i) {
+                if (directory_[i].offset > size || directory_[i].size > size - directory_[i].offset) {
+                    throw FLANNException("Invalid index file, truncated section");
+                }
+                if (header_.version < 3) {
+                    directory_[i].codec = compression::CODEC_NONE;
+                }
+            }
+
+            if (verify) {
+                this->verify(cores);
+            }
+            decompress(cores);
+        }
+
+        inline const mapped::FileHeader& header() const
+        {
+            return header_;
+        }
+
+        /**
+         * @return The section directory
+         */
+        inline const std::vector<mapped::SectionEntry>& sections() const
+        {
+            return directory_;
+        }
+
+        /**
+         * @return true if the checksum of a section (index in sections()) is right
+         */
+        bool verifySection(size_t index) const
+        {
+            const mapped::SectionEntry& entry = directory_[index];
+            return crc32c::value(file_->data() + entry.offset, entry.size) == entry.crc;
+        }
+
+        /**
+         * Checks the checksums of all the sections, in parallel
+         * @param cores number of cores to use (0 for auto)
+         */
+        void verify(int cores = 0) const
+        {
+            std::vector<char> valid(directory_.size());
+            parallel_for(directory_.size(), cores, [&](size_t i) {
+                valid[i] = verifySection(i);
+            });
+            for (size_t i = 0; i < directory_.size(); ++i) {
+                if (!valid[i]) {
+                    std::string name = mapped::section_name(directory_[i].kind);
+                    throw FLANNException("Invalid index file, checksum mismatch in section '" + name + "'");
+                }
+            }
+        }
+
+        bool hasSection(mapped::SectionKind kind, size_t table = 0) const
+        {
+            return find(kind, table) != NULL;
+        }
+
+        /**
+         * @return The content of a section (decompressed)
+         * @param size receives the size of the section in bytes
+         */
+        const void* section(mapped::SectionKind kind, size_t table, size_t& size) const
+        {
+            const mapped::SectionEntry* entry = find(kind, table);
+            if (entry == NULL) {
+                throw FLANNException(std::string("Invalid index file, missing section '") + mapped::section_name(kind) + "'");
+            }
+            const Content& content = contents_[entry - &directory_[0]];
+            size = content.size;
+            return content.data;
+        }
+
+        /**
+         * @return A section holding one structure
+         */
+        template<typename T>
+        const T& get(mapped::SectionKind kind, size_t table = 0) const
+        {
+            size_t size;
+            const void* data = section(kind, table, size);
+            if (size != sizeof(T)) {
+                throw FLANNException(std::string("Invalid index file, wrong size of section '") + mapped::section_name(kind) + "'");
+            }
+            return *static_cast<const T*>(data);
+        }
+
+        /**
+         * @return A section holding an array, viewed where it lies
+         */
+        template<typename T>
+        ConstArray<T> array(mapped::SectionKind kind, size_t table = 0) const
+        {
+            size_t size;
+            const void* data = section(kind, table, size);
+            if (size % sizeof(T) != 0) {
+                throw FLANNException(std::string("Invalid index file, wrong size of section '") + mapped::section_name(kind) + "'");
+            }
+            return ConstArray<T>(owner(kind, table), static_cast<const T*>(data), size / sizeof(T));
+        }
+
+        /**
+         * @return The owner of the content of a section (the mapping or the decompressed
+         * section), to keep it alive while the section is in use
+         */
+        std::shared_ptr<const void> owner(mapped::SectionKind kind, size_t table = 0) const
+        {
+            const mapped::SectionEntry* entry = find(kind, table);
+            if (entry == NULL) {
+                throw FLANNException(std::string("Invalid index file, missing section '") + mapped::section_name(kind) + "'");
+            }
+            const Content& content = contents_[entry - &directory_[0]];
+            return content.owner ? content.owner : std::shared_ptr<const void>(file_);
+        }
+
+    private:
+        /** Where the content of a section lies */
+        struct Content
+        {
+            const unsigned char* data;
+            size_t size;
+            /** the decompressed section, NULL for a section used in the mapping */
+            std::shared_ptr<const void> owner;
+        };
+
+        static void free_buffer(unsigned char* buffer)
+        {
+            free(buffer);
+        }
+
+        /**
+         * Decompresses the compressed sections. The blocks of all the sections are
+         * decompressed in parallel, while the kernel reads the next ones.
+         */
+        void decompress(int cores)
+        {
+            struct Job
+            {
+                size_t section;
+                mapped::CompressedBlock block;
+                size_t raw_offset;
+                size_t raw_size;
+            };
+            std::vector<Job> jobs;
+            contents_.resize(directory_.size());
+            for (size_t i = 0; i < directory_.size(); ++i) {
+                const mapped::SectionEntry& entry = directory_[i];
+                Content& content = contents_[i];
+                content.data = file_->data() + entry.offset;
+                content.size = entry.size;
+                if (entry.codec == compression::CODEC_NONE) continue;
+
+                std::string corrupted = std::string("Invalid index file, corrupted compressed section '") + mapped::section_name(entry.kind) + "'";
+                mapped::CompressedHeader header;
+                if (entry.size < sizeof(header)) throw FLANNException(corrupted);
+                memcpy(&header, content.data, sizeof(header));
+                if (!compression::valid_width((compression::Codec)entry.codec, header.width) || header.block_size == 0 ||
+                    header.block_count != (header.raw_size + header.block_size - 1) / header.block_size ||
+                    header.block_count > (entry.size - sizeof(header)) / sizeof(mapped::CompressedBlock)) {
+                    throw FLANNException(corrupted);
+                }
+                std::vector<mapped::CompressedBlock> blocks(header.block_count);
+                if (!blocks.empty()) {
+                    memcpy(&blocks[0], content.data + sizeof(header), blocks.size() * sizeof(mapped::CompressedBlock));
+                }
+
+                void* buffer = NULL;
+                if (header.raw_size > 0 && posix_memalign(&buffer, mapped::ALIGNMENT, header.raw_size) != 0) {
+                    throw FLANNException("Cannot allocate a decompressed section");
+                }
+                content.owner = std::shared_ptr<unsigned char>(static_cast<unsigned char*>(buffer), free_buffer);
+                for (size_t b = 0; b < blocks.size(); ++b) {
+                    Job job;
+                    job.section = i;
+                    job.block = blocks[b];
+                    job.raw_offset = b * header.block_size;
+                    job.raw_size = std::min<uint64_t>(header.block_size, header.raw_size - job.raw_offset);
+                    if (job.block.offset > entry.size || job.block.size > entry.size - job.block.offset ||
+                        (job.block.stored && job.block.size != job.raw_size)) {
+                        throw FLANNException(corrupted);
+                    }
+                    jobs.push_back(job);
+                }
+                content.data = static_cast<const unsigned char*>(buffer);
+                content.size = header.raw_size;
+                file_->willNeed(entry.offset, entry.size);
+            }
+
+            std::vector<char> valid(jobs.size());
+            parallel_for(jobs.size(), cores, [&](size_t j) {
+                const Job& job = jobs[j];
+                const mapped::SectionEntry& entry = directory_[job.section];
+                const unsigned char* src = file_->data() + entry.offset + job.block.offset;
+                unsigned char* dst = const_cast<unsigned char*>(contents_[job.section].data) + job.raw_offset;
+                if (job.block.stored) {
+                    memcpy(dst, src, job.raw_size);
+                    valid[j] = true;
+                }
+                else {
+                    size_t width = reinterpret_cast<const mapped::CompressedHeader*>(file_->data() + entry.offset)->width;
+                    valid[j] = compression::decompress_block((compression::Codec)entry.codec, width, src, job.block.size, dst, job.raw_size);
+                }
+            });
+            for (size_t j = 0; j < jobs.size(); ++j) {
+                if (!valid[j]) {
+                    throw FLANNException(std::string("Invalid index file, corrupted compressed section '") + mapped::section_name(directory_[jobs[j].section].kind) + "'");
+                }
+            }
+        }
+
+        const mapped::SectionEntry* find(mapped::SectionKind kind, size_t table) const
+        {
+            for (size_t i = 0; i < directory_.size(); ++i) {
+                if (directory_[i].kind == (uint32_t)kind && directory_[i].table == table) return &directory_[i];
+            }
+            return NULL;
+        }
+
+        std::shared_ptr<const MappedFile> file_;
+        mapped::FileHeader header_;
+        std::vector<mapped::SectionEntry> directory_;
+        std::vector<Content> contents_;
+    };
+
+}
+
+#endif /* mapped_file_h */
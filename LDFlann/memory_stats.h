@@ -0,0 +1,82 @@
+//
+//  memory_stats.h
+//  LDFlann
+//
+
+#ifndef memory_stats_h
+#define memory_stats_h
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace LDFlann
+{
+    
+    /**
+     * Memory used by an index, in bytes, broken down by component (e.g. "dataset",
+     * "table 3 buckets")
+     */
+    struct MemoryStats
+    {
+        MemoryStats() : total(0)
+        {
+        }
+        
+        void add(const std::string& component, size_t bytes)
+        {
+            components.push_back(std::make_pair(component, bytes));
+            total += bytes;
+        }
+        
+        /** Sum of all the components */
+        size_t total;
+        std::vector<std::pair<std::string, size_t> > components;
+    };
+    
+    inline std::ostream& operator <<(std::ostream& out, const MemoryStats& stats)
+    {
+        for (size_t i = 0; i < stats.components.size(); ++i) {
+            out << std::setw(28) << std::left << stats.components[i].first << " : " << stats.components[i].second << "\n";
+        }
+        out << std::setw(28) << std::left << "total" << " : " << stats.total;
+        return out;
+    }
+    
+    /**
+     * Estimates of the heap memory held by the standard containers (the size of the
+     * container object itself is counted by its owner)
+     */
+    namespace memory
+    {
+        
+        /** Per node bookkeeping of the tree based containers (links and color) */
+        const size_t TREE_NODE_OVERHEAD = 4 * sizeof(void*);
+        /** Per node bookkeeping of the hash based containers (link and cached hash) */
+        const size_t HASH_NODE_OVERHEAD = 2 * sizeof(void*);
+        
+        template<typename T>
+        size_t used(const std::vector<T>& v)
+        {
+            return v.capacity() * sizeof(T);
+        }
+        
+        template<typename K, typename V, typename C, typename A>
+        size_t used(const std::map<K,V,C,A>& m)
+        {
+            return m.size() * (sizeof(std::pair<const K,V>) + TREE_NODE_OVERHEAD);
+        }
+        
+        template<typename Container>
+        size_t used_hash(const Container& m)
+        {
+            return m.size() * (sizeof(typename Container::value_type) + HASH_NODE_OVERHEAD) + m.bucket_count() * sizeof(void*);
+        }
+        
+    }
+    
+}
+
+#endif /* memory_stats_h */
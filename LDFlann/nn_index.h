@@ -8,20 +8,71 @@
 
 #ifndef nn_index_h
 #define nn_index_h
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <utility>
 #include <vector>
 
 #include "general.h"
 #include "matrix.h"
 #include "params.h"
+#include "dist.h"
 #include "result_set.h"
 #include "dynamic_bitset.h"
 #include "saving.h"
+#include "parallel.h"
+#include "point_arena.h"
+#include "paged_array.h"
+#include "memory_stats.h"
+#include "mapped_file.h"
 
 namespace LDFlann
 {
     
 #define KNN_HEAP_THRESHOLD 250
     
+    /**
+     * Restricts a search to some of the points of the index (see SearchParams::filter).
+     * The points are checked by id before their distance is computed, so the search
+     * returns the nearest allowed points.
+     */
+    class SearchFilter
+    {
+    public:
+        typedef std::function<bool(size_t)> Predicate;
+        
+        /**
+         * @param bits a bit per id
+         * @param allow true if the set bits are the allowed points (the ids past the end
+         * are not allowed), false if they are the denied points (the ids past the end are
+         * allowed)
+         */
+        SearchFilter(const DynamicBitset& bits, bool allow = true) : bits_(&bits), allow_(allow)
+        {
+        }
+        
+        /**
+         * @param predicate called with the id of a point, returns true if it is allowed
+         */
+        SearchFilter(const Predicate& predicate) : bits_(NULL), allow_(true), predicate_(predicate)
+        {
+        }
+        
+        inline bool allows(size_t id) const
+        {
+            if (bits_ != NULL) {
+                return id < bits_->size() ? bits_->test(id) == allow_ : !allow_;
+            }
+            return predicate_(id);
+        }
+        
+    private:
+        const DynamicBitset* bits_;
+        bool allow_;
+        Predicate predicate_;
+    };
+    
     
     class IndexBase
     {
@@ -34,7 +85,7 @@ namespace LDFlann
         
         virtual flann_algorithm_t getType() const = 0;
         
-        virtual int usedMemory() const = 0;
+        virtual size_t usedMemory() const = 0;
         
         virtual IndexParams getParameters() const = 0;
         
@@ -54,12 +105,12 @@ namespace LDFlann
         typedef typename Distance::ResultType DistanceType;
         
         NNIndex(Distance d) : distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-        removed_(false), removed_count_(0), data_ptr_(NULL)
+        removed_(false), removed_count_(0), sparse_ids_(false)
         {
         }
         
         NNIndex(const IndexParams& params, Distance d) : distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-        index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+        index_params_(params), removed_(false), removed_count_(0), sparse_ids_(false)
         {
         }
         
@@ -74,23 +125,16 @@ namespace LDFlann
         removed_points_(other.removed_points_),
         removed_count_(other.removed_count_),
         ids_(other.ids_),
-        points_(other.points_),
-        data_ptr_(NULL)
+        id_index_(other.id_index_),
+        id_map_(other.id_map_),
+        sparse_ids_(other.sparse_ids_),
+        dataset_order_(other.dataset_order_),
+        points_(other.points_)
         {
-            if (other.data_ptr_) {
-                data_ptr_ = new ElementType[size_*veclen_];
-                std::copy(other.data_ptr_, other.data_ptr_+size_*veclen_, data_ptr_);
-                for (size_t i=0;i<size_;++i) {
-                    points_[i] = data_ptr_ + i*veclen_;
-                }
-            }
         }
         
         virtual ~NNIndex()
         {
-            if (data_ptr_) {
-                delete[] data_ptr_;
-            }
         }
         
         
@@ -121,32 +165,65 @@ namespace LDFlann
             this->buildIndex();
         }
         
+        /**
+         * Builds the index using the specified dataset, with ids chosen by the caller
+         * @param dataset the dataset to use
+         * @param ids the ids of the points, returned by the searches instead of their
+         * positions (any distinct values but size_t(-1))
+         */
+        virtual void buildIndex(const Matrix<ElementType>& dataset, const std::vector<size_t>& ids)
+        {
+            setDataset(dataset, ids);
+            this->buildIndex();
+        }
+        
         /**
          * @brief Incrementally add points to the index.
          * @param points Matrix with points to be added
          * @param rebuild_threshold
          */
-        virtual void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
+        void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
+        {
+            addPoints(points, std::vector<size_t>(), rebuild_threshold);
+        }
+        
+        /**
+         * @brief Incrementally add points to the index.
+         * @param points Matrix with points to be added
+         * @param ids the ids of the points (not in the index yet), empty to number them
+         * after the largest id of the index
+         * @param rebuild_threshold
+         */
+        virtual void addPoints(const Matrix<ElementType>& /*points*/, const std::vector<size_t>& /*ids*/, float /*rebuild_threshold*/ = 2)
         {
             throw FLANNException("Functionality not supported by this index");
         }
         
+        /**
+         * Checks if the index has grown enough since it was built to be rebuilt
+         * @param rebuild_threshold see addPoints
+         */
+        bool needsRebuild(float rebuild_threshold) const
+        {
+            return rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_;
+        }
+        
+        /**
+         * @return true if addPoints rebuilds the index itself, by bounded slices, once it
+         * has grown past rebuild_threshold (otherwise the caller has to call buildIndex)
+         */
+        virtual bool rebuildsIncrementally() const
+        {
+            return false;
+        }
+        
         /**
          * Remove point from the index
          * @param index Index of point to be removed
          */
         virtual void removePoint(size_t id)
         {
-            if (!removed_) {
-                ids_.resize(size_);
-                for (size_t i=0;i<size_;++i) {
-                    ids_[i] = i;
-                }
-                removed_points_.resize(size_);
-                removed_points_.reset();
-                last_id_ = size_;
-                removed_ = true;
-            }
+            trackIds();
             
             size_t point_index = id_to_index(id);
             if (point_index!=size_t(-1) && !removed_points_.test(point_index)) {
@@ -155,6 +232,33 @@ namespace LDFlann
             }
         }
         
+        /**
+         * Removes several points from the index, the ids are looked up and the points
+         * marked as removed in parallel
+         * @param ids ids of the points to remove (unknown or already removed ids are ignored)
+         * @param cores number of cores to use (0 for auto)
+         */
+        virtual void removePoints(const std::vector<size_t>& ids, int cores = 0)
+        {
+            if (ids.empty()) return;
+            trackIds();
+            
+            const size_t chunk_size = 65536;
+            size_t chunks = (ids.size()+chunk_size-1)/chunk_size;
+            std::vector<size_t> removed(chunks, 0);
+            parallel_for(chunks, cores, [&](size_t chunk) {
+                size_t end = std::min(ids.size(), (chunk+1)*chunk_size);
+                for (size_t i=chunk*chunk_size;i<end;++i) {
+                    size_t point_index = id_to_index(ids[i]);
+                    // the same id can be given twice, only the thread setting the bit counts it
+                    if (point_index!=size_t(-1) && removed_points_.atomic_set(point_index)) {
+                        removed[chunk]++;
+                    }
+                }
+            });
+            removed_count_ += std::accumulate(removed.begin(), removed.end(), size_t(0));
+        }
+        
         
         /**
          * Get point with specific id
@@ -188,6 +292,27 @@ namespace LDFlann
             return veclen_;
         }
         
+        /**
+         * @return The memory used by the index, in bytes
+         */
+        size_t usedMemory() const
+        {
+            return memoryStats().total;
+        }
+        
+        /**
+         * @return The memory used by the index, by component. The indices add their own
+         * structures to the components of the dataset.
+         */
+        virtual MemoryStats memoryStats() const
+        {
+            MemoryStats stats;
+            stats.add(points_.isMapped() ? "dataset (mapped)" : "dataset", points_.usedMemory());
+            stats.add("ids", ids_.usedMemory() + id_index_.usedMemory() + id_map_.usedMemory() + dataset_order_.usedMemory());
+            stats.add("removed points", removed_points_.usedMemory());
+            return stats;
+        }
+        
         /**
          * Returns the parameters used by the index.
          *
@@ -211,12 +336,11 @@ namespace LDFlann
                 header.cols = veclen_;
             }
             ar & header;
+            ar.setVersion(header.format());
             
             // sanity checks
             if (Archive::is_loading::value) {
-                if (strcmp(header.signature,FLANN_SIGNATURE_)!=0) {
-                    throw FLANNException("Invalid index file, wrong signature");
-                }
+                check_format(header);
                 if (header.data_type != flann_datatype_value<ElementType>::value) {
                     throw FLANNException("Datatype of saved index is different than of the one to be created.");
                 }
@@ -239,31 +363,128 @@ namespace LDFlann
             
             if (save_dataset) {
                 if (Archive::is_loading::value) {
-                    if (data_ptr_) {
-                        delete[] data_ptr_;
-                    }
-                    data_ptr_ = new ElementType[size_*veclen_];
+                    points_.setCols(veclen_);
                     points_.resize(size_);
-                    for (size_t i=0;i<size_;++i) {
-                        points_[i] = data_ptr_ + i*veclen_;
-                    }
                 }
                 for (size_t i=0;i<size_;++i) {
                     ar & serialization::make_binary_object (points_[i], veclen_*sizeof(ElementType));
                 }
-            } else {
-                if (points_.size()!=size_) {
-                    throw FLANNException("Saved index does not contain the dataset and no dataset was provided.");
-                }
             }
             
             ar & last_id_;
             ar & ids_;
+            if (ar.getVersion()>=1) {
+                ar & dataset_order_;
+            }
+            else {
+                // the points of the older files are in the caller's order
+                dataset_order_.clear();
+            }
             ar & removed_;
             if (removed_) {
                 ar & removed_points_;
             }
             ar & removed_count_;
+            
+            if (Archive::is_loading::value) {
+                finishLoading(save_dataset);
+            }
+        }
+        
+        /**
+         * Writes the index to a mapped index file. The indices add their own sections to
+         * the ones of the dataset.
+         */
+        virtual void saveMapped(MappedWriter& writer) const
+        {
+            MappedMeta meta;
+            meta.size = size_;
+            meta.veclen = veclen_;
+            meta.size_at_build = size_at_build_;
+            meta.last_id = last_id_;
+            meta.removed_count = removed_count_;
+            meta.stride = points_.stride();
+            meta.removed = removed_;
+            meta.has_dataset = get_param(index_params_,"save_dataset", false);
+            writer.addCopy(mapped::INDEX_META, 0, &meta, sizeof(meta));
+            
+            std::vector<unsigned char> params;
+            mapped::encode_params(index_params_, params);
+            writer.addSection(mapped::PARAMS, 0, std::move(params));
+            
+            if (meta.has_dataset) {
+                // the rows are written with their padding, so they can be used from the mapping
+                writer.addSection(mapped::DATASET, 0, size_>0 ? points_[0] : NULL, size_*points_.stride()*sizeof(ElementType));
+            }
+            writer.addSection(mapped::IDS, 0, ids_.vector());
+            if (!dataset_order_.empty()) {
+                writer.addSection(mapped::DATASET_ORDER, 0, dataset_order_.vector());
+            }
+            if (removed_) {
+                writer.addSection(mapped::REMOVED_POINTS, 0, removed_points_.blocks());
+            }
+        }
+        
+        /**
+         * Loads an index from a mapped index file, the dataset (if saved) and the
+         * structures of the index are used where they lie in the mapping.
+         */
+        virtual void loadMapped(const MappedReader& reader)
+        {
+            if (reader.header().data_type != flann_datatype_value<ElementType>::value) {
+                throw FLANNException("Datatype of saved index is different than of the one to be created.");
+            }
+            if (reader.header().index_type != (uint32_t)getType()) {
+                throw FLANNException("Saved index type is different then the current index type.");
+            }
+            if (reader.header().element_size != sizeof(ElementType)) {
+                throw FLANNException("Invalid index file, wrong element size");
+            }
+            if (!compatible_distances((flann_distance_t)reader.header().distance_type, flann_distance_value<Distance>::value)) {
+                throw FLANNException("Saved index was built with a different distance than the one to be created.");
+            }
+            
+            size_t params_size;
+            const unsigned char* params = static_cast<const unsigned char*>(reader.section(mapped::PARAMS, 0, params_size));
+            IndexParams saved_params;
+            mapped::decode_params(params, params_size, saved_params);
+            saved_params["algorithm"] = getType();
+            index_params_ = saved_params;
+            
+            const MappedMeta& meta = reader.get<MappedMeta>(mapped::INDEX_META);
+            size_ = meta.size;
+            veclen_ = meta.veclen;
+            size_at_build_ = meta.size_at_build;
+            last_id_ = meta.last_id;
+            removed_count_ = meta.removed_count;
+            removed_ = (meta.removed != 0);
+            
+            if (meta.has_dataset) {
+                size_t bytes;
+                const void* rows = reader.section(mapped::DATASET, 0, bytes);
+                points_.setCols(veclen_);
+                if (meta.stride!=points_.stride() || bytes!=size_*points_.stride()*sizeof(ElementType)) {
+                    throw FLANNException("Invalid index file, wrong dataset size");
+                }
+                points_.map(static_cast<const ElementType*>(rows), size_, veclen_, reader.owner(mapped::DATASET));
+            }
+            
+            ConstArray<size_t> ids = reader.array<size_t>(mapped::IDS);
+            ids_.assign(ids.begin(), ids.end());
+            dataset_order_.clear();
+            if (reader.hasSection(mapped::DATASET_ORDER)) {
+                ConstArray<size_t> order = reader.array<size_t>(mapped::DATASET_ORDER);
+                dataset_order_.assign(order.begin(), order.end());
+            }
+            if (removed_) {
+                ConstArray<size_t> blocks = reader.array<size_t>(mapped::REMOVED_POINTS);
+                if (ids_.size()!=size_ || blocks.size()!=size_/(CHAR_BIT*sizeof(size_t))+1) {
+                    throw FLANNException("Invalid index file, wrong removed points size");
+                }
+                removed_points_.assign(size_, blocks.data());
+            }
+            
+            finishLoading(meta.has_dataset!=0);
         }
         
         
@@ -297,34 +518,40 @@ namespace LDFlann
             int count = 0;
             
             if (use_heap) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNResultSet2<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        resultSet.copy(indices[i], dists[i], n, params.sorted);
-                        indices_to_ids(indices[i], indices[i], n);
-                        count += n;
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                            indices_to_ids(indices[i], indices[i], n);
+                            found += n;
+                        }
                     }
-                }
+                    return found;
+                });
             }
             else {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNSimpleResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        resultSet.copy(indices[i], dists[i], n, params.sorted);
-                        indices_to_ids(indices[i], indices[i], n);
-                        count += n;
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                            indices_to_ids(indices[i], indices[i], n);
+                            found += n;
+                        }
                     }
-                }
+                    return found;
+                });
             }
             return count;
         }
@@ -365,11 +592,11 @@ namespace LDFlann
          * @param[in] knn Number of nearest neighbors to return
          * @param[in] params Search parameters
          */
-        int knnSearch(const Matrix<ElementType>& queries,
-                      std::vector< std::vector<size_t> >& indices,
-                      std::vector<std::vector<DistanceType> >& dists,
-                      size_t knn,
-                      const SearchParams& params) const
+        virtual int knnSearch(const Matrix<ElementType>& queries,
+                              std::vector< std::vector<size_t> >& indices,
+                              std::vector<std::vector<DistanceType> >& dists,
+                              size_t knn,
+                              const SearchParams& params) const
         {
             assert(queries.cols == veclen());
             bool use_heap;
@@ -385,42 +612,48 @@ namespace LDFlann
             
             int count = 0;
             if (use_heap) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNResultSet2<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        indices[i].resize(n);
-                        dists[i].resize(n);
-                        if (n>0) {
-                            resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                            indices_to_ids(&indices[i][0], &indices[i][0], n);
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            indices[i].resize(n);
+                            dists[i].resize(n);
+                            if (n>0) {
+                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                            }
+                            found += n;
                         }
-                        count += n;
                     }
-                }
+                    return found;
+                });
             }
             else {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     KNNSimpleResultSet<DistanceType> resultSet(knn);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        size_t n = std::min(resultSet.size(), knn);
-                        indices[i].resize(n);
-                        dists[i].resize(n);
-                        if (n>0) {
-                            resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                            indices_to_ids(&indices[i][0], &indices[i][0], n);
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            size_t n = std::min(resultSet.size(), knn);
+                            indices[i].resize(n);
+                            dists[i].resize(n);
+                            if (n>0) {
+                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                            }
+                            found += n;
                         }
-                        count += n;
                     }
-                }
+                    return found;
+                });
             }
             
             return count;
@@ -475,60 +708,69 @@ namespace LDFlann
             else max_neighbors = std::min(max_neighbors,(int)num_neighbors);
             
             if (max_neighbors==0) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     CountRadiusResultSet<DistanceType> resultSet(radius);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        count += resultSet.size();
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            found += resultSet.size();
+                        }
                     }
-                }
+                    return found;
+                });
             }
             else {
                 // explicitly indicated to use unbounded radius result set
                 // and we know there'll be enough room for resulting indices and dists
                 if (params.max_neighbors<0 && (num_neighbors>=size())) {
-#pragma omp parallel num_threads(params.cores)
-                    {
+                    count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                         RadiusResultSet<DistanceType> resultSet(radius);
-#pragma omp for schedule(static) reduction(+:count)
-                        for (int i = 0; i < (int)queries.rows; i++) {
-                            resultSet.clear();
-                            findNeighbors(resultSet, queries[i], params);
-                            size_t n = resultSet.size();
-                            count += n;
-                            if (n>num_neighbors) n = num_neighbors;
-                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                        int found = 0;
+                        size_t begin, end;
+                        while (range.next(begin, end)) {
+                            for (size_t i = begin; i < end; i++) {
+                                resultSet.clear();
+                                findNeighbors(resultSet, queries[i], params);
+                                size_t n = resultSet.size();
+                                found += n;
+                                if (n>num_neighbors) n = num_neighbors;
+                                resultSet.copy(indices[i], dists[i], n, params.sorted);
                             
-                            // mark the next element in the output buffers as unused
-                            if (n<indices.cols) indices[i][n] = size_t(-1);
-                            if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
-                            indices_to_ids(indices[i], indices[i], n);
+                                // mark the next element in the output buffers as unused
+                                if (n<indices.cols) indices[i][n] = size_t(-1);
+                                if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
+                                indices_to_ids(indices[i], indices[i], n);
+                            }
                         }
-                    }
+                        return found;
+                    });
                 }
                 else {
                     // number of neighbors limited to max_neighbors
-#pragma omp parallel num_threads(params.cores)
-                    {
+                    count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                         KNNRadiusResultSet<DistanceType> resultSet(radius, max_neighbors);
-#pragma omp for schedule(static) reduction(+:count)
-                        for (int i = 0; i < (int)queries.rows; i++) {
-                            resultSet.clear();
-                            findNeighbors(resultSet, queries[i], params);
-                            size_t n = resultSet.size();
-                            count += n;
-                            if ((int)n>max_neighbors) n = max_neighbors;
-                            resultSet.copy(indices[i], dists[i], n, params.sorted);
+                        int found = 0;
+                        size_t begin, end;
+                        while (range.next(begin, end)) {
+                            for (size_t i = begin; i < end; i++) {
+                                resultSet.clear();
+                                findNeighbors(resultSet, queries[i], params);
+                                size_t n = resultSet.size();
+                                found += n;
+                                if ((int)n>max_neighbors) n = max_neighbors;
+                                resultSet.copy(indices[i], dists[i], n, params.sorted);
                             
-                            // mark the next element in the output buffers as unused
-                            if (n<indices.cols) indices[i][n] = size_t(-1);
-                            if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
-                            indices_to_ids(indices[i], indices[i], n);
+                                // mark the next element in the output buffers as unused
+                                if (n<indices.cols) indices[i][n] = size_t(-1);
+                                if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
+                                indices_to_ids(indices[i], indices[i], n);
+                            }
                         }
-                    }
+                        return found;
+                    });
                 }
             }
             return count;
@@ -581,16 +823,19 @@ namespace LDFlann
             int count = 0;
             // just count neighbors
             if (params.max_neighbors==0) {
-#pragma omp parallel num_threads(params.cores)
-                {
+                count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                     CountRadiusResultSet<DistanceType> resultSet(radius);
-#pragma omp for schedule(static) reduction(+:count)
-                    for (int i = 0; i < (int)queries.rows; i++) {
-                        resultSet.clear();
-                        findNeighbors(resultSet, queries[i], params);
-                        count += resultSet.size();
+                    int found = 0;
+                    size_t begin, end;
+                    while (range.next(begin, end)) {
+                        for (size_t i = begin; i < end; i++) {
+                            resultSet.clear();
+                            findNeighbors(resultSet, queries[i], params);
+                            found += resultSet.size();
+                        }
                     }
-                }
+                    return found;
+                });
             }
             else {
                 if (indices.size() < queries.rows ) indices.resize(queries.rows);
@@ -598,44 +843,50 @@ namespace LDFlann
                 
                 if (params.max_neighbors<0) {
                     // search for all neighbors
-#pragma omp parallel num_threads(params.cores)
-                    {
+                    count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                         RadiusResultSet<DistanceType> resultSet(radius);
-#pragma omp for schedule(static) reduction(+:count)
-                        for (int i = 0; i < (int)queries.rows; i++) {
-                            resultSet.clear();
-                            findNeighbors(resultSet, queries[i], params);
-                            size_t n = resultSet.size();
-                            count += n;
-                            indices[i].resize(n);
-                            dists[i].resize(n);
-                            if (n > 0) {
-                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                        int found = 0;
+                        size_t begin, end;
+                        while (range.next(begin, end)) {
+                            for (size_t i = begin; i < end; i++) {
+                                resultSet.clear();
+                                findNeighbors(resultSet, queries[i], params);
+                                size_t n = resultSet.size();
+                                found += n;
+                                indices[i].resize(n);
+                                dists[i].resize(n);
+                                if (n > 0) {
+                                    resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                    indices_to_ids(&indices[i][0], &indices[i][0], n);
+                                }
                             }
                         }
-                    }
+                        return found;
+                    });
                 }
                 else {
                     // number of neighbors limited to max_neighbors
-#pragma omp parallel num_threads(params.cores)
-                    {
+                    count = parallel_batch(queries.rows, params, [&](WorkRange& range) {
                         KNNRadiusResultSet<DistanceType> resultSet(radius, params.max_neighbors);
-#pragma omp for schedule(static) reduction(+:count)
-                        for (int i = 0; i < (int)queries.rows; i++) {
-                            resultSet.clear();
-                            findNeighbors(resultSet, queries[i], params);
-                            size_t n = resultSet.size();
-                            count += n;
-                            if ((int)n>params.max_neighbors) n = params.max_neighbors;
-                            indices[i].resize(n);
-                            dists[i].resize(n);
-                            if (n > 0) {
-                                resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
-                                indices_to_ids(&indices[i][0], &indices[i][0], n);
+                        int found = 0;
+                        size_t begin, end;
+                        while (range.next(begin, end)) {
+                            for (size_t i = begin; i < end; i++) {
+                                resultSet.clear();
+                                findNeighbors(resultSet, queries[i], params);
+                                size_t n = resultSet.size();
+                                found += n;
+                                if ((int)n>params.max_neighbors) n = params.max_neighbors;
+                                indices[i].resize(n);
+                                dists[i].resize(n);
+                                if (n > 0) {
+                                    resultSet.copy(&indices[i][0], &dists[i][0], n, params.sorted);
+                                    indices_to_ids(&indices[i][0], &indices[i][0], n);
+                                }
                             }
                         }
-                    }
+                        return found;
+                    });
                 }
             }
             return count;
@@ -675,35 +926,98 @@ namespace LDFlann
         
         virtual void buildIndexImpl() = 0;
         
-        size_t id_to_index(size_t id)
+        /**
+         * @return The position of the point with the given id, -1 if there is none
+         */
+        size_t id_to_index(size_t id) const
         {
-            if (ids_.size()==0) {
-                return id;
+            if (!removed_) {
+                // the ids are the positions until a point is removed
+                return id<size_ ? id : size_t(-1);
             }
-            size_t point_index = size_t(-1);
-            if (ids_[id]==id) {
-                return id;
+            if (sparse_ids_) {
+                const size_t* index = id_map_.find(id);
+                return index!=NULL ? *index : size_t(-1);
             }
-            else {
-                // binary search
-                size_t start = 0;
-                size_t end = ids_.size();
-                
-                while (start<end) {
-                    size_t mid = (start+end)/2;
-                    if (ids_[mid]==id) {
-                        point_index = mid;
-                        break;
-                    }
-                    else if (ids_[mid]<id) {
-                        start = mid + 1;
-                    }
-                    else {
-                        end = mid;
+            return id<id_index_.size() ? id_index_[id] : size_t(-1);
+        }
+        
+        /**
+         * Starts keeping the ids of the points apart from their positions, as the first
+         * point is removed or the dataset reordered
+         */
+        void trackIds()
+        {
+            if (removed_) return;
+            std::vector<size_t> positions(size_);
+            for (size_t i=0;i<size_;++i) positions[i] = i;
+            ids_.assign(positions.begin(), positions.end());
+            id_index_.assign(positions.begin(), positions.end());
+            id_map_.clear();
+            sparse_ids_ = false;
+            removed_points_.resize(size_);
+            removed_points_.reset();
+            last_id_ = size_;
+            removed_ = true;
+        }
+        
+        /**
+         * The table from the ids to the positions is dense (a position per id up to the
+         * largest one) while it is not much larger than a hash map would be
+         */
+        static bool denseIds(size_t last_id, size_t size)
+        {
+            return last_id <= 4*size + 1024;
+        }
+        
+        void setIdIndex(size_t id, size_t index)
+        {
+            if (!sparse_ids_ && id>=id_index_.size()) {
+                if (denseIds(id+1, size_)) {
+                    id_index_.resize(id+1, size_t(-1));
+                }
+                else {
+                    // the ids are too far apart, switch to a hash map
+                    for (size_t i=0;i<id_index_.size();++i) {
+                        if (id_index_[i]!=size_t(-1)) id_map_.set(i, id_index_[i]);
                     }
+                    id_index_.clear();
+                    sparse_ids_ = true;
+                }
+            }
+            if (sparse_ids_) {
+                id_map_.set(id, index);
+            }
+            else {
+                id_index_.set(id, index);
+            }
+        }
+        
+        /**
+         * Checks the ids given to new points
+         * @param ids the ids
+         * @param rows the number of points
+         * @param replace true if the points replace the dataset
+         */
+        void checkNewIds(const std::vector<size_t>& ids, size_t rows, bool replace) const
+        {
+            if (ids.size()!=rows) {
+                throw FLANNException("The number of ids is not the number of points");
+            }
+            std::vector<size_t> sorted(ids);
+            std::sort(sorted.begin(), sorted.end());
+            if (std::adjacent_find(sorted.begin(), sorted.end())!=sorted.end()) {
+                throw FLANNException("The ids of the points are not distinct");
+            }
+            if (!sorted.empty() && sorted.back()==size_t(-1)) {
+                throw FLANNException("Invalid point id");
+            }
+            for (size_t i=0;i<ids.size() && !replace;++i) {
+                size_t point_index = id_to_index(ids[i]);
+                if (point_index!=size_t(-1) && !(removed_ && removed_points_.test(point_index))) {
+                    throw FLANNException("A point with this id is already in the index");
                 }
             }
-            return point_index;
         }
         
         
@@ -716,39 +1030,69 @@ namespace LDFlann
             }
         }
         
-        void setDataset(const Matrix<ElementType>& dataset)
+        /**
+         * @param dataset the points
+         * @param ids the ids of the points, empty for their positions
+         */
+        void setDataset(const Matrix<ElementType>& dataset, const std::vector<size_t>& ids = std::vector<size_t>())
         {
+            if (!ids.empty()) {
+                checkNewIds(ids, dataset.rows, true);
+            }
             size_ = dataset.rows;
             veclen_ = dataset.cols;
             last_id_ = 0;
             
             ids_.clear();
+            id_index_.clear();
+            id_map_.clear();
+            sparse_ids_ = false;
             removed_points_.clear();
             removed_ = false;
             removed_count_ = 0;
+            dataset_order_.clear();
             
-            points_.resize(size_);
-            for (size_t i=0;i<size_;++i) {
-                points_[i] = dataset[i];
+            points_.assign(dataset);
+            
+            if (!ids.empty()) {
+                trackIds();
+                ids_.assign(ids.begin(), ids.end());
+                last_id_ = *std::max_element(ids.begin(), ids.end()) + 1;
+                buildIdIndex();
             }
         }
         
-        void extendDataset(const Matrix<ElementType>& new_points)
+        /**
+         * @param new_points the points
+         * @param ids the ids of the points, empty to number them from last_id_
+         */
+        void extendDataset(const Matrix<ElementType>& new_points, const std::vector<size_t>& ids = std::vector<size_t>())
         {
+            if (!ids.empty()) {
+                checkNewIds(ids, new_points.rows, false);
+                trackIds();
+            }
             size_t new_size = size_ + new_points.rows;
             if (removed_) {
                 removed_points_.resize(new_size);
                 ids_.resize(new_size);
             }
-            points_.resize(new_size);
-            for (size_t i=size_;i<new_size;++i) {
-                points_[i] = new_points[i-size_];
-                if (removed_) {
-                    ids_[i] = last_id_++;
+            points_.append(new_points);
+            size_t old_size = size_;
+            size_ = new_size;
+            // the points added are appended to the caller's dataset too
+            for (size_t i=old_size;i<new_size && !dataset_order_.empty();++i) {
+                dataset_order_.push_back(i);
+            }
+            if (removed_) {
+                for (size_t i=old_size;i<new_size;++i) {
+                    size_t id = ids.empty() ? last_id_ : ids[i-old_size];
+                    last_id_ = std::max(last_id_, id+1);
+                    ids_.set(i, id);
                     removed_points_.reset(i);
+                    setIdIndex(id, i);
                 }
             }
-            size_ = new_size;
         }
         
         
@@ -756,22 +1100,138 @@ namespace LDFlann
         {
             if (!removed_) return;
             
+            // the rows of the caller's dataset are renumbered without the removed points
+            std::vector<size_t> dataset_rows;
+            if (!dataset_order_.empty()) {
+                dataset_rows.assign(size_, 0);
+                for (size_t i=0;i<size_;++i) {
+                    if (!removed_points_.test(i)) dataset_rows[dataset_order_[i]] = 1;
+                }
+                size_t kept = 0;
+                for (size_t row=0;row<size_;++row) {
+                    size_t is_kept = dataset_rows[row];
+                    dataset_rows[row] = kept;
+                    kept += is_kept;
+                }
+            }
+            
             size_t last_idx = 0;
             for (size_t i=0;i<size_;++i) {
                 if (!removed_points_.test(i)) {
-                    points_[last_idx] = points_[i];
-                    ids_[last_idx] = ids_[i];
+                    points_.moveRow(last_idx, i);
+                    ids_.set(last_idx, ids_[i]);
+                    if (!dataset_order_.empty()) dataset_order_.set(last_idx, dataset_rows[dataset_order_[i]]);
                     removed_points_.reset(last_idx);
                     ++last_idx;
                 }
             }
             points_.resize(last_idx);
             ids_.resize(last_idx);
+            if (!dataset_order_.empty()) dataset_order_.resize(last_idx);
             removed_points_.resize(last_idx);
             size_ = last_idx;
             removed_count_ = 0;
+            buildIdIndex();
+        }
+        
+        /**
+         * Physically reorders the points of the dataset, the ids of the points are kept
+         * (and used from then on to translate the positions returned by the searches), and
+         * so is the row of the caller's dataset of every point (see dataset_order_)
+         * @param order row i of the reordered dataset is the row order[i]
+         */
+        void permuteDataset(const std::vector<size_t>& order)
+        {
+            assert(order.size()==size_);
+            trackIds();
+            
+            points_.gather(order);
+            std::vector<size_t> ids(size_);
+            std::vector<size_t> dataset_order(size_);
+            DynamicBitset removed_points(size_);
+            for (size_t i=0;i<size_;++i) {
+                ids[i] = ids_[order[i]];
+                dataset_order[i] = dataset_order_.empty() ? order[i] : dataset_order_[order[i]];
+                if (removed_points_.test(order[i])) removed_points.set(i);
+            }
+            ids_.assign(ids.begin(), ids.end());
+            dataset_order_.assign(dataset_order.begin(), dataset_order.end());
+            removed_points_ = removed_points;
+            
+            buildIdIndex();
+        }
+        
+        void buildIdIndex()
+        {
+            sparse_ids_ = !denseIds(last_id_, size_);
+            id_map_.clear();
+            if (sparse_ids_) {
+                id_index_.clear();
+                id_map_.reserve(size_);
+            }
+            else {
+                id_index_.clear();
+                id_index_.resize(last_id_, size_t(-1));
+            }
+            // an id given again after its point was removed is the one of the new point
+            for (int removed=1;removed>=0;--removed) {
+                for (size_t i=0;i<size_;++i) {
+                    if (removed_points_.test(i)==(removed!=0)) setIdIndex(ids_[i], i);
+                }
+            }
         }
         
+        /**
+         * Completes the loading of an index: puts the dataset given to the constructor in
+         * place if the file did not contain it (in the caller's order, see dataset_order_),
+         * and indexes the ids
+         * @param has_dataset true if the dataset was loaded from the file
+         */
+        void finishLoading(bool has_dataset)
+        {
+            // saved again the way it was saved
+            index_params_["save_dataset"] = has_dataset;
+            if (!dataset_order_.empty()) {
+                bool valid = dataset_order_.size()==size_;
+                for (size_t i=0;i<dataset_order_.size() && valid;++i) {
+                    valid = dataset_order_[i]<size_;
+                }
+                if (!valid) {
+                    throw FLANNException("Invalid index file, wrong dataset order");
+                }
+            }
+            if (!has_dataset) {
+                if (points_.size()!=size_) {
+                    throw FLANNException("Saved index does not contain the dataset and no dataset was provided.");
+                }
+                if (!dataset_order_.empty()) {
+                    // put the rows of the caller's dataset where the index expects them
+                    points_.gather(dataset_order_.vector());
+                }
+            }
+            
+            id_index_.clear();
+            if (removed_) {
+                buildIdIndex();
+            }
+        }
+        
+        /**
+         * The state of an index in a mapped index file
+         */
+        struct MappedMeta
+        {
+            uint64_t size;
+            uint64_t veclen;
+            uint64_t size_at_build;
+            uint64_t last_id;
+            uint64_t removed_count;
+            /** distance between two rows of the dataset, in elements */
+            uint64_t stride;
+            uint32_t removed;
+            uint32_t has_dataset;
+        };
+        
         void swap(NNIndex& other)
         {
             std::swap(distance_, other.distance_);
@@ -783,9 +1243,12 @@ namespace LDFlann
             std::swap(removed_, other.removed_);
             std::swap(removed_points_, other.removed_points_);
             std::swap(removed_count_, other.removed_count_);
-            std::swap(ids_, other.ids_);
-            std::swap(points_, other.points_);
-            std::swap(data_ptr_, other.data_ptr_);
+            ids_.swap(other.ids_);
+            id_index_.swap(other.id_index_);
+            id_map_.swap(other.id_map_);
+            std::swap(sparse_ids_, other.sparse_ids_);
+            dataset_order_.swap(other.dataset_order_);
+            points_.swap(other.points_);
         }
         
     protected:
@@ -839,19 +1302,38 @@ namespace LDFlann
         size_t removed_count_;
         
         /**
-         * Array of point IDs, returned by nearest-neighbour operations
+         * Array of point IDs, returned by nearest-neighbour operations. The id containers
+         * are paged, the copies of the index share their unchanged pages.
+         */
+        PagedArray<size_t> ids_;
+        
+        /**
+         * Position of the point of every id (-1 for the removed ones), kept along with
+         * ids_ for the lookups by id
+         */
+        PagedArray<size_t> id_index_;
+        
+        /**
+         * Position of the point of every id when the ids are too sparse for id_index_
+         */
+        PagedMap<size_t,size_t> id_map_;
+        
+        /**
+         * True if the positions of the ids are in id_map_ rather than in id_index_
          */
-        std::vector<size_t> ids_;
+        bool sparse_ids_;
         
         /**
-         * Point data
+         * Row of the caller's dataset (the points in the order they were given) of every
+         * point, once the dataset was reordered (see permuteDataset), empty otherwise. An
+         * index saved without its dataset is loaded with the caller's dataset.
          */
-        std::vector<ElementType*> points_;
+        PagedArray<size_t> dataset_order_;
         
         /**
-         * Pointer to dataset memory if allocated by this index, otherwise NULL
+         * Point data, owned by the index (row i at points_[i])
          */
-        ElementType* data_ptr_;
+        PointArena<ElementType> points_;
         
         
     };
@@ -866,10 +1348,12 @@ using NNIndex<Distance>::index_params_;\
 using NNIndex<Distance>::removed_points_;\
 using NNIndex<Distance>::ids_;\
 using NNIndex<Distance>::removed_;\
+using NNIndex<Distance>::removed_count_;\
 using NNIndex<Distance>::points_;\
 using NNIndex<Distance>::extendDataset;\
 using NNIndex<Distance>::setDataset;\
 using NNIndex<Distance>::cleanRemovedPoints;\
+using NNIndex<Distance>::permuteDataset;\
 using NNIndex<Distance>::indices_to_ids;
     
     
@@ -0,0 +1,301 @@
+//
+//  paged_array.h
+//  LDFlann
+//
+
+#ifndef paged_array_h
+#define paged_array_h
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_stats.h"
+#include "serialization.h"
+
+namespace LDFlann
+{
+
+    /**
+     * Makes a page of a copy-on-write container writable: the page is copied first if
+     * another container (e.g. a snapshot of the index still being searched) uses it too.
+     * Only the owner of the container may call it, a page used by this container only
+     * cannot be shared again in the meantime.
+     * @return The page, used by this container only
+     */
+    template<typename Page>
+    inline Page& detach_page(std::shared_ptr<Page>& page)
+    {
+        if (page.use_count()>1) {
+            page = std::make_shared<Page>(*page);
+        }
+        else {
+            // the former users of the page are done reading it
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *page;
+    }
+
+
+    /**
+     * An array stored in pages of PAGE_SIZE values. Copies of an array share the pages, a
+     * change copies the page it touches first: copying an index to update it (see
+     * Index::addPoints) thus costs a pointer per page and a page per value changed.
+     *
+     * The values are read with operator[] and written with set(), there is no reference
+     * to a value that could be written by mistake without copying its page.
+     */
+    template<typename T>
+    class PagedArray
+    {
+    public:
+        PagedArray() : size_(0)
+        {
+        }
+
+        inline const T& operator[](size_t index) const
+        {
+            return (*pages_[index >> PAGE_BITS])[index & PAGE_MASK];
+        }
+
+        void set(size_t index, const T& value)
+        {
+            detach_page(pages_[index >> PAGE_BITS])[index & PAGE_MASK] = value;
+        }
+
+        inline size_t size() const
+        {
+            return size_;
+        }
+
+        inline bool empty() const
+        {
+            return size_ == 0;
+        }
+
+        void clear()
+        {
+            pages_.clear();
+            size_ = 0;
+        }
+
+        /**
+         * Changes the number of values, the new ones are set to value
+         */
+        void resize(size_t size, const T& value = T())
+        {
+            size_t pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
+            if (size < size_) {
+                pages_.resize(pages);
+                if ((size & PAGE_MASK) != 0) {
+                    detach_page(pages_.back()).resize(size & PAGE_MASK);
+                }
+            }
+            else if (size > size_) {
+                // fills the last page, then adds new ones
+                if (!pages_.empty() && pages_.back()->size() < PAGE_SIZE) {
+                    Page& last = detach_page(pages_.back());
+                    last.resize(std::min<size_t>(PAGE_SIZE, last.size() + (size - size_)), value);
+                }
+                while (pages_.size() < pages) {
+                    size_t begin = pages_.size() << PAGE_BITS;
+                    pages_.push_back(std::make_shared<Page>(std::min<size_t>(PAGE_SIZE, size - begin), value));
+                }
+            }
+            size_ = size;
+        }
+
+        void push_back(const T& value)
+        {
+            resize(size_ + 1, value);
+        }
+
+        template<typename Iterator>
+        void assign(Iterator begin, Iterator end)
+        {
+            clear();
+            while (begin != end) {
+                std::shared_ptr<Page> page = std::make_shared<Page>();
+                page->reserve(PAGE_SIZE);
+                for (; begin != end && page->size() < PAGE_SIZE; ++begin) {
+                    page->push_back(*begin);
+                }
+                size_ += page->size();
+                pages_.push_back(page);
+            }
+        }
+
+        /**
+         * @return A copy of the values in one vector
+         */
+        std::vector<T> vector() const
+        {
+            std::vector<T> values;
+            values.reserve(size_);
+            for (size_t i = 0; i < pages_.size(); ++i) {
+                values.insert(values.end(), pages_[i]->begin(), pages_[i]->end());
+            }
+            return values;
+        }
+
+        /**
+         * @return The memory of the values (and of the pages), in bytes
+         */
+        size_t usedMemory() const
+        {
+            size_t used = pages_.capacity() * sizeof(std::shared_ptr<Page>);
+            for (size_t i = 0; i < pages_.size(); ++i) {
+                used += sizeof(Page) + pages_[i]->capacity() * sizeof(T);
+            }
+            return used;
+        }
+
+        void swap(PagedArray& other)
+        {
+            pages_.swap(other.pages_);
+            std::swap(size_, other.size_);
+        }
+
+    private:
+        enum { PAGE_BITS = 12, PAGE_SIZE = 1 << PAGE_BITS, PAGE_MASK = PAGE_SIZE - 1 };
+
+        typedef std::vector<T> Page;
+
+        template<typename U> friend struct serialization::Serializer;
+
+        std::vector<std::shared_ptr<Page> > pages_;
+        size_t size_;
+    };
+
+
+    /**
+     * A hash map split by the hash of its keys into PAGES maps, shared by the copies of
+     * the map and copied on write like the pages of PagedArray
+     */
+    template<typename Key, typename Value>
+    class PagedMap
+    {
+    public:
+        PagedMap() : size_(0)
+        {
+        }
+
+        /**
+         * @return The value of a key, NULL if the key is not in the map
+         */
+        inline const Value* find(const Key& key) const
+        {
+            if (pages_.empty()) return NULL;
+            const Page& page = *pages_[pageOf(key)];
+            typename Page::const_iterator it = page.find(key);
+            return it != page.end() ? &it->second : NULL;
+        }
+
+        void set(const Key& key, const Value& value)
+        {
+            if (pages_.empty()) allocate();
+            Page& page = detach_page(pages_[pageOf(key)]);
+            size_t size = page.size();
+            page[key] = value;
+            size_ += page.size() - size;
+        }
+
+        inline size_t size() const
+        {
+            return size_;
+        }
+
+        void clear()
+        {
+            pages_.clear();
+            size_ = 0;
+        }
+
+        /**
+         * Prepares the map for a number of keys
+         */
+        void reserve(size_t size)
+        {
+            if (pages_.empty()) allocate();
+            for (size_t i = 0; i < PAGES; ++i) {
+                detach_page(pages_[i]).reserve(size / PAGES + 1);
+            }
+        }
+
+        /**
+         * @return The memory of the map, in bytes (see memory::used_hash)
+         */
+        size_t usedMemory() const
+        {
+            size_t used = pages_.capacity() * sizeof(std::shared_ptr<Page>);
+            for (size_t i = 0; i < pages_.size(); ++i) {
+                used += sizeof(Page) + memory::used_hash(*pages_[i]);
+            }
+            return used;
+        }
+
+        void swap(PagedMap& other)
+        {
+            pages_.swap(other.pages_);
+            std::swap(size_, other.size_);
+        }
+
+    private:
+        enum { PAGE_BITS = 10, PAGES = 1 << PAGE_BITS };
+
+        typedef std::unordered_map<Key, Value> Page;
+
+        /** The page of a key, from the high bits of a multiplicative hash (the keys are
+         * often multiples of a common step, their low bits would fill a few pages only) */
+        static inline size_t pageOf(const Key& key)
+        {
+            return size_t((uint64_t(std::hash<Key>()(key)) * 0x9E3779B97F4A7C15ull) >> (64 - PAGE_BITS));
+        }
+
+        void allocate()
+        {
+            // the empty pages are shared until something is added to them
+            pages_.assign(PAGES, std::make_shared<Page>());
+        }
+
+        std::vector<std::shared_ptr<Page> > pages_;
+        size_t size_;
+    };
+
+
+    namespace serialization
+    {
+        // a PagedArray is saved like a std::vector
+        template<typename T>
+        struct Serializer<PagedArray<T> >
+        {
+            template<typename InputArchive>
+            static inline void load(InputArchive& ar, PagedArray<T>& val)
+            {
+                size_t size;
+                ar & size;
+                val.clear();
+                val.resize(size);
+                for (size_t i = 0; i < val.pages_.size(); ++i) {
+                    std::vector<T>& page = *val.pages_[i];
+                    load_array(ar, page.data(), page.size());
+                }
+            }
+
+            template<typename OutputArchive>
+            static inline void save(OutputArchive& ar, const PagedArray<T>& val)
+            {
+                ar & val.size();
+                for (size_t i = 0; i < val.pages_.size(); ++i) {
+                    const std::vector<T>& page = *val.pages_[i];
+                    save_array(ar, page.data(), page.size());
+                }
+            }
+        };
+    }
+
+}
+
+#endif /* paged_array_h */
@@ -0,0 +1,245 @@
+//
+//  parallel.h
+//  LDFlann
+//
+
+#ifndef parallel_h
+#define parallel_h
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <numeric>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "general.h"
+#include "params.h"
+#include "thread_pool.h"
+
+namespace LDFlann
+{
+
+    /**
+     * Number of threads a job of the given size is run with.
+     * @param cores the requested number of cores (0 for auto)
+     * @param size number of work items in the job
+     */
+    inline int get_batch_threads(int cores, size_t size)
+    {
+        if (cores<=0) cores = std::max((int)std::thread::hardware_concurrency(), 1);
+        if ((size_t)cores>size) cores = (int)std::max(size, size_t(1));
+        return cores;
+    }
+
+    /**
+     * Splits the queries [0,size) of a batch among the threads searching it.
+     *
+     * With FLANN_SCHEDULE_STATIC every thread searches one contiguous block of the batch.
+     * With FLANN_SCHEDULE_DYNAMIC the threads keep taking chunks of chunk_size queries
+     * until the batch is exhausted, so a thread that got stuck on a few expensive
+     * queries (e.g. queries hashing into hot LSH buckets) does not hold back the others.
+     * FLANN_SCHEDULE_WORK_STEALING starts like the static schedule but the threads work
+     * through their block chunk by chunk, and a thread done with its block steals half
+     * of what is left in the block of another one.
+     */
+    class BatchSchedule
+    {
+    public:
+        BatchSchedule(size_t size, int threads, flann_schedule_t schedule, int chunk_size) :
+        size_(size), threads_(threads), schedule_(schedule), next_(0), ranges_(NULL)
+        {
+            // the blocks of the static and work stealing schedules are packed in 64 bits
+            if (schedule_!=FLANN_SCHEDULE_DYNAMIC && size_>=(uint64_t(1)<<32)) {
+                schedule_ = FLANN_SCHEDULE_DYNAMIC;
+            }
+
+            if (chunk_size>0) {
+                chunk_size_ = chunk_size;
+            }
+            else {
+                // a few chunks per thread is enough to even out the tail
+                chunk_size_ = std::max(size_/(threads_*16), size_t(1));
+            }
+
+            if (schedule_!=FLANN_SCHEDULE_DYNAMIC) {
+                ranges_ = new std::atomic<uint64_t>[threads_];
+                for (int t=0;t<threads_;++t) {
+                    ranges_[t].store(pack(size_*t/threads_, size_*(t+1)/threads_));
+                }
+            }
+        }
+
+        ~BatchSchedule()
+        {
+            delete[] ranges_;
+        }
+
+        /**
+         * Gets the next range of queries to be searched by a thread
+         * @param thread index of the calling thread
+         * @param begin first query of the range
+         * @param end one past the last query of the range
+         * @return false once the thread has nothing left to search
+         */
+        bool next(int thread, size_t& begin, size_t& end)
+        {
+            switch (schedule_) {
+                case FLANN_SCHEDULE_DYNAMIC:
+                    begin = next_.fetch_add(chunk_size_);
+                    if (begin>=size_) return false;
+                    end = std::min(begin+chunk_size_, size_);
+                    return true;
+                case FLANN_SCHEDULE_WORK_STEALING:
+                    if (take(thread, chunk_size_, begin, end)) return true;
+                    return steal(thread) && take(thread, chunk_size_, begin, end);
+                default:
+                    return take(thread, size_, begin, end);
+            }
+        }
+
+    private:
+        static uint64_t pack(uint64_t begin, uint64_t end)
+        {
+            return (begin<<32) | end;
+        }
+
+        static void unpack(uint64_t range, size_t& begin, size_t& end)
+        {
+            begin = size_t(range>>32);
+            end = size_t(range & 0xffffffff);
+        }
+
+        /**
+         * Takes up to count queries from the front of the block of a thread
+         */
+        bool take(int thread, size_t count, size_t& begin, size_t& end)
+        {
+            uint64_t range = ranges_[thread].load();
+            for (;;) {
+                size_t b, e;
+                unpack(range, b, e);
+                if (b>=e) return false;
+                size_t nb = std::min(b+count, e);
+                if (ranges_[thread].compare_exchange_weak(range, pack(nb, e))) {
+                    begin = b;
+                    end = nb;
+                    return true;
+                }
+            }
+        }
+
+        /**
+         * Moves the back half of the block of another thread to the (empty) block of
+         * the calling thread
+         */
+        bool steal(int thread)
+        {
+            for (int i=1;i<threads_;++i) {
+                int victim = (thread+i) % threads_;
+                uint64_t range = ranges_[victim].load();
+                for (;;) {
+                    size_t b, e;
+                    unpack(range, b, e);
+                    if (b>=e) break;
+                    size_t mid = b + (e-b)/2;
+                    if (ranges_[victim].compare_exchange_weak(range, pack(b, mid))) {
+                        ranges_[thread].store(pack(mid, e));
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+    private:
+        BatchSchedule(const BatchSchedule&);
+        BatchSchedule& operator=(const BatchSchedule&);
+
+        size_t size_;
+        int threads_;
+        flann_schedule_t schedule_;
+        size_t chunk_size_;
+        /** Shared counter of the dynamic schedule */
+        std::atomic<size_t> next_;
+        /** Remaining [begin,end) block of every thread (static and work stealing schedules) */
+        std::atomic<uint64_t>* ranges_;
+    };
+
+    /**
+     * The queries of a batch assigned to one thread
+     */
+    class WorkRange
+    {
+    public:
+        WorkRange(BatchSchedule& schedule, int thread) :
+        schedule_(schedule), thread_(thread)
+        {
+        }
+
+        /**
+         * Gets the next range of queries to search
+         * @return false once the batch is exhausted
+         */
+        bool next(size_t& begin, size_t& end)
+        {
+            return schedule_.next(thread_, begin, end);
+        }
+
+    private:
+        BatchSchedule& schedule_;
+        int thread_;
+    };
+
+    /**
+     * Runs a search job on every thread assigned to a batch of queries. The job is called
+     * once per thread (so it can set up its result set once) and pulls the queries it
+     * has to search from the WorkRange it receives.
+     * @param size number of queries in the batch
+     * @param params search parameters (cores, schedule and chunk_size are used)
+     * @param job functor int(WorkRange&), returns the number of neighbors it found
+     * @return sum of the values returned by the jobs
+     */
+    template<typename Job>
+    int parallel_batch(size_t size, const SearchParams& params, Job job)
+    {
+        int threads = get_batch_threads(params.cores, size);
+        BatchSchedule schedule(size, threads, params.schedule, params.chunk_size);
+
+        std::vector<int> counts(threads, 0);
+        ThreadPool::instance().run(threads, [&](int thread) {
+            WorkRange range(schedule, thread);
+            counts[thread] = job(range);
+        });
+        return std::accumulate(counts.begin(), counts.end(), 0);
+    }
+
+    /**
+     * Calls body(i) for every i in [0,size), spread over the given number of cores.
+     * Used for the coarse grained work of the index construction (e.g. one LSH table
+     * per call).
+     * @param size number of calls
+     * @param cores number of cores to use (0 for auto)
+     * @param body functor void(size_t)
+     */
+    template<typename Body>
+    void parallel_for(size_t size, int cores, Body body)
+    {
+        SearchParams params;
+        params.cores = cores;
+        params.schedule = FLANN_SCHEDULE_DYNAMIC;
+        params.chunk_size = 1;
+        parallel_batch(size, params, [&](WorkRange& range) {
+            size_t begin, end;
+            while (range.next(begin, end)) {
+                for (size_t i = begin; i < end; i++) {
+                    body(i);
+                }
+            }
+            return 0;
+        });
+    }
+
+}
+
+#endif /* parallel_h */
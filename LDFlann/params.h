@@ -27,6 +27,8 @@ namespace LDFlann
     
     typedef std::map<std::string, any> IndexParams;
     
+    class SearchFilter;
+    
     
     typedef enum {
         FLANN_False = 0,
@@ -43,7 +45,10 @@ namespace LDFlann
             max_neighbors = -1;
             use_heap = FLANN_Undefined;
             cores = 1;
+            schedule = FLANN_SCHEDULE_STATIC;
+            chunk_size = 0;
             matrices_in_gpu_ram = false;
+            filter = NULL;
         }
         
         // how many leafs to visit when searching for neighbours (-1 for unlimited)
@@ -56,10 +61,16 @@ namespace LDFlann
         int max_neighbors;
         // use a heap to manage the result set (default: FLANN_Undefined)
         tri_type use_heap;
-        // how many cores to assign to the search (used only if compiled with OpenMP capable compiler) (0 for auto)
+        // how many cores to assign to the search (0 for auto)
         int cores;
+        // how the queries are distributed among the cores (default: FLANN_SCHEDULE_STATIC)
+        flann_schedule_t schedule;
+        // number of queries a core takes at a time with dynamic and work stealing scheduling (0 for auto)
+        int chunk_size;
         // for GPU search indicates if matrices are already in GPU ram
         bool matrices_in_gpu_ram;
+        // the points the search may return (default: NULL for all), must outlive the search
+        const SearchFilter* filter;
     };
     
     
@@ -107,6 +118,9 @@ namespace LDFlann
         std::cout << "eps : " << params.eps << std::endl;
         std::cout << "sorted : " << params.sorted << std::endl;
         std::cout << "max_neighbors : " << params.max_neighbors << std::endl;
+        std::cout << "cores : " << params.cores << std::endl;
+        std::cout << "schedule : " << params.schedule << std::endl;
+        std::cout << "chunk_size : " << params.chunk_size << std::endl;
     }
     
     
@@ -0,0 +1,303 @@
+//
+//  point_arena.h
+//  LDFlann
+//
+
+#ifndef point_arena_h
+#define point_arena_h
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "general.h"
+#include "matrix.h"
+
+namespace LDFlann
+{
+
+    /**
+     * Contiguous storage of the points of an index.
+     *
+     * The rows live in one 64-byte aligned buffer and are addressed as base + index*stride.
+     * A row is padded to the next power of two when it is smaller than a cache line
+     * (so it never straddles two lines) and to a multiple of 64 bytes otherwise, the
+     * padding is zeroed. The buffer grows geometrically when points are appended.
+     *
+     * Copies of an arena share the buffer: a copy can append in place as long as it
+     * owns the end of the buffer (the rows of the other copies are left untouched), any
+     * other modification of a shared buffer copies it first. Copying an index to
+     * update it (see Index::addPoints) thus does not copy the dataset.
+     */
+    template<typename T>
+    class PointArena
+    {
+    public:
+        PointArena() : rows_(0), cols_(0), stride_(0)
+        {
+        }
+
+        PointArena(const PointArena& other) : buffer_(other.buffer_), rows_(other.rows_), cols_(other.cols_), stride_(other.stride_)
+        {
+        }
+
+        PointArena& operator=(PointArena other)
+        {
+            swap(other);
+            return *this;
+        }
+
+        /**
+         * Removes all the rows and sets the row length
+         * @param cols number of elements in a row
+         */
+        void setCols(size_t cols)
+        {
+            buffer_.reset();
+            rows_ = 0;
+            cols_ = cols;
+            size_t row_bytes = cols*sizeof(T);
+            size_t padded = sizeof(size_t);
+            if (row_bytes>ALIGNMENT) {
+                padded = (row_bytes+ALIGNMENT-1)/ALIGNMENT*ALIGNMENT;
+            }
+            else {
+                while (padded<row_bytes) padded <<= 1;
+            }
+            stride_ = (padded+sizeof(T)-1)/sizeof(T);
+        }
+
+        /**
+         * Replaces the content of the arena with a copy of a matrix
+         */
+        void assign(const Matrix<T>& points)
+        {
+            setCols(points.cols);
+            append(points);
+        }
+
+        /**
+         * Appends a copy of the rows of a matrix (with the same number of columns)
+         */
+        void append(const Matrix<T>& points)
+        {
+            assert(points.rows==0 || points.cols==cols_);
+            size_t begin = grow(rows_+points.rows);
+            size_t row_bytes = cols_*sizeof(T);
+            for (size_t i=0;i<points.rows;++i) {
+                T* row = (*this)[begin+i];
+                std::memcpy(row, points[i], row_bytes);
+                std::memset(reinterpret_cast<char*>(row)+row_bytes, 0, stride_*sizeof(T)-row_bytes);
+            }
+        }
+
+        /**
+         * Makes the arena use rows stored elsewhere (e.g. in a mapped file), laid out with
+         * the stride of an arena of cols elements. The rows are never written: any change
+         * but an append copies them first.
+         * @param data the first row, aligned on 64 bytes
+         * @param rows number of rows
+         * @param cols number of elements in a row
+         * @param owner keeps the rows alive
+         */
+        void map(const T* data, size_t rows, size_t cols, const std::shared_ptr<const void>& owner)
+        {
+            setCols(cols);
+            if (rows==0) return;
+            buffer_.reset(new Buffer(const_cast<T*>(data), rows, owner));
+            rows_ = rows;
+        }
+
+        /**
+         * @return true if the rows are stored outside of the arena (see map())
+         */
+        inline bool isMapped() const
+        {
+            return buffer_ && buffer_->raw==NULL;
+        }
+
+        /**
+         * Changes the number of rows, the new rows are zeroed
+         */
+        void resize(size_t rows)
+        {
+            if (rows<=rows_) {
+                rows_ = rows;
+                // the rows cut off can be reused if no other copy sees them
+                if (buffer_ && buffer_.use_count()==1 && buffer_->raw!=NULL) buffer_->end = rows_;
+            }
+            else {
+                size_t begin = grow(rows);
+                std::memset((*this)[begin], 0, (rows-begin)*stride_*sizeof(T));
+            }
+        }
+
+        /**
+         * Copies the row from over the row to (compaction of the dataset)
+         */
+        void moveRow(size_t to, size_t from)
+        {
+            if (to==from) return;
+            detach();
+            std::memcpy((*this)[to], (*this)[from], stride_*sizeof(T));
+        }
+
+        /**
+         * Reorders (or selects) the rows, row i of the result is the row order[i] of the arena
+         */
+        void gather(const std::vector<size_t>& order)
+        {
+            if (rows_==0) return;
+            std::shared_ptr<Buffer> buffer(new Buffer(std::max(order.size(), size_t(1)), stride_));
+            for (size_t i=0;i<order.size();++i) {
+                assert(order[i]<rows_);
+                std::memcpy(buffer->data + i*stride_, (*this)[order[i]], stride_*sizeof(T));
+            }
+            rows_ = order.size();
+            buffer->end = rows_;
+            buffer_ = buffer;
+        }
+
+        /**
+         * Returns a pointer to a row. The rows must not be written through it unless the
+         * arena was just filled by resize() (e.g. when loading an index).
+         */
+        inline T* operator[](size_t index) const
+        {
+            return buffer_->data + index*stride_;
+        }
+
+        /**
+         * @return The points as a matrix (using the padded stride)
+         */
+        Matrix<T> matrix() const
+        {
+            return Matrix<T>(rows_>0 ? buffer_->data : NULL, rows_, cols_, stride_*sizeof(T));
+        }
+
+        inline size_t size() const
+        {
+            return rows_;
+        }
+
+        inline size_t cols() const
+        {
+            return cols_;
+        }
+
+        /**
+         * @return The distance between two rows, in elements
+         */
+        inline size_t stride() const
+        {
+            return stride_;
+        }
+
+        /**
+         * @return The memory allocated for the rows, in bytes
+         */
+        size_t usedMemory() const
+        {
+            return buffer_ ? buffer_->capacity*stride_*sizeof(T) : 0;
+        }
+
+        void swap(PointArena& other)
+        {
+            std::swap(buffer_, other.buffer_);
+            std::swap(rows_, other.rows_);
+            std::swap(cols_, other.cols_);
+            std::swap(stride_, other.stride_);
+        }
+
+    private:
+        enum { ALIGNMENT = 64 };
+
+        struct Buffer
+        {
+            Buffer(size_t capacity_, size_t stride) : capacity(capacity_), end(0)
+            {
+                raw = ::malloc(capacity*stride*sizeof(T)+ALIGNMENT);
+                if (raw==NULL) {
+                    throw FLANNException("Cannot allocate the memory of the dataset");
+                }
+                data = reinterpret_cast<T*>((reinterpret_cast<uintptr_t>(raw)+ALIGNMENT) & ~uintptr_t(ALIGNMENT-1));
+            }
+
+            /** A full buffer using external memory */
+            Buffer(T* data_, size_t rows, const std::shared_ptr<const void>& owner_) :
+            raw(NULL), data(data_), capacity(rows), end(rows), owner(owner_)
+            {
+            }
+
+            ~Buffer()
+            {
+                ::free(raw);
+            }
+
+            /** The allocated memory, NULL if the rows are external */
+            void* raw;
+            T* data;
+            size_t capacity;
+            /** Number of rows used by the copy of the arena owning the end of the buffer */
+            std::atomic<size_t> end;
+            /** Keeps external rows alive */
+            std::shared_ptr<const void> owner;
+        };
+
+        /**
+         * Grows the arena to the given number of rows, reallocating the buffer (with
+         * geometric growth) when it is full or when its end belongs to another copy
+         * @return The index of the first new row
+         */
+        size_t grow(size_t rows)
+        {
+            size_t begin = rows_;
+            if (rows==begin) return begin;
+
+            size_t end = begin;
+            if (buffer_ && buffer_->raw!=NULL && rows<=buffer_->capacity && buffer_->end.compare_exchange_strong(end, rows)) {
+                rows_ = rows;
+                return begin;
+            }
+
+            size_t capacity = std::max(rows, buffer_ ? buffer_->capacity*2 : size_t(0));
+            reallocate(capacity);
+            buffer_->end = rows;
+            rows_ = rows;
+            return begin;
+        }
+
+        /**
+         * Makes sure the buffer is not shared with another copy of the arena (nor external)
+         */
+        void detach()
+        {
+            if (buffer_ && (buffer_.use_count()>1 || buffer_->raw==NULL)) {
+                reallocate(buffer_->capacity);
+                buffer_->end = rows_;
+            }
+        }
+
+        void reallocate(size_t capacity)
+        {
+            std::shared_ptr<Buffer> buffer(new Buffer(capacity, stride_));
+            if (rows_>0) {
+                std::memcpy(buffer->data, buffer_->data, rows_*stride_*sizeof(T));
+            }
+            buffer_ = buffer;
+        }
+
+    private:
+        std::shared_ptr<Buffer> buffer_;
+        size_t rows_;
+        size_t cols_;
+        size_t stride_;
+    };
+
+}
+
+#endif /* point_arena_h */
@@ -22,6 +22,18 @@
 #endif
 #define FLANN_SIGNATURE_ "FLANN_INDEX"
 
+/* Version of the layout of the saved indices, appended to the signature ("FLANN_INDEX_v1").
+ * The files with the bare signature have the original layout, version 0.
+ *  1: the row of the caller's dataset of every point (NNIndex::dataset_order_)
+ *  2: the size of the features and of the bucket entries of the LSH tables
+ *  3: the bit-packed buckets of the frozen LSH tables
+ *  4: the frozen buckets of the LSH tables, packed or not, with the end of the last one
+ */
+#ifdef FLANN_FORMAT_VERSION_
+#undef FLANN_FORMAT_VERSION_
+#endif
+#define FLANN_FORMAT_VERSION_ 4
+
 namespace LDFlann
 {
     
@@ -42,11 +54,30 @@ namespace LDFlann
         IndexHeader()
         {
             memset(signature, 0, sizeof(signature));
-            strcpy(signature, FLANN_SIGNATURE_);
+            snprintf(signature, sizeof(signature), "%s_v%d", FLANN_SIGNATURE_, FLANN_FORMAT_VERSION_);
             memset(version, 0, sizeof(version));
             strcpy(version, FLANN_VERSION_);
         }
         
+        /**
+         * @return The version of the layout of the file (see FLANN_FORMAT_VERSION_), -1 if
+         * the signature is not the one of an index file
+         */
+        int format() const
+        {
+            size_t length = strlen(FLANN_SIGNATURE_);
+            if (strncmp(signature, FLANN_SIGNATURE_, length)!=0) return -1;
+            if (signature[length]=='\0') return 0;
+            if (signature[length]!='_' || signature[length+1]!='v') return -1;
+            int version = 0;
+            size_t i = length+2;
+            for (;i<sizeof(signature) && signature[i]>='0' && signature[i]<='9';++i) {
+                version = version*10 + (signature[i]-'0');
+            }
+            if (i==length+2 || i==sizeof(signature) || signature[i]!='\0') return -1;
+            return version;
+        }
+        
     private:
         template<typename Archive>
         void serialize(Archive& ar)
@@ -61,6 +92,20 @@ namespace LDFlann
         friend struct serialization::access;
     };
     
+    /**
+     * Checks that an index file can be read
+     * @param header the header of the file
+     */
+    inline void check_format(const IndexHeader& header)
+    {
+        if (header.format()<0) {
+            throw FLANNException("Invalid index file, wrong signature");
+        }
+        if (header.format()>FLANN_FORMAT_VERSION_) {
+            throw FLANNException("Index file saved by a newer version, its format is not supported");
+        }
+    }
+    
     /**
      * Saves index header to stream
      *
@@ -94,9 +139,7 @@ namespace LDFlann
             throw FLANNException("Invalid index file, cannot read");
         }
         
-        if (strcmp(header.signature,FLANN_SIGNATURE_)!=0) {
-            throw FLANNException("Invalid index file, wrong signature");
-        }
+        check_format(header);
         
         return header;
     }
@@ -4,6 +4,15 @@
 #include <vector>
 #include <map>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 namespace LDFlann
 {
@@ -92,32 +101,114 @@ ar & int_val;\
         
         
         
+        /**
+         * The types saved as their bytes (see BASIC_TYPE_SERIALIZER), so arrays of them are
+         * saved and loaded with one call, in the same format as value by value. bool is left
+         * out as std::vector<bool> does not store its values as bools.
+         */
+        template<typename T>
+        struct is_binary_serializable : std::integral_constant<bool, std::is_arithmetic<T>::value && !std::is_same<T,bool>::value>
+        {
+        };
+        
+        template<typename OutputArchive, typename T>
+        inline void save_array(OutputArchive& ar, const T* values, size_t size, std::true_type)
+        {
+            if (size>0) {
+                ar.save_binary(values, size*sizeof(T));
+            }
+        }
+        
+        template<typename OutputArchive, typename T>
+        inline void save_array(OutputArchive& ar, const T* values, size_t size, std::false_type)
+        {
+            for (size_t i=0;i<size;++i) {
+                ar & values[i];
+            }
+        }
+        
+        template<typename InputArchive, typename T>
+        inline void load_array(InputArchive& ar, T* values, size_t size, std::true_type)
+        {
+            if (size>0) {
+                ar.load_binary(values, size*sizeof(T));
+            }
+        }
+        
+        template<typename InputArchive, typename T>
+        inline void load_array(InputArchive& ar, T* values, size_t size, std::false_type)
+        {
+            for (size_t i=0;i<size;++i) {
+                ar & values[i];
+            }
+        }
+        
+        /**
+         * Saves an array of values, at once if they are saved as their bytes
+         */
+        template<typename OutputArchive, typename T>
+        inline void save_array(OutputArchive& ar, const T* values, size_t size)
+        {
+            save_array(ar, values, size, is_binary_serializable<T>());
+        }
+        
+        template<typename InputArchive, typename T>
+        inline void load_array(InputArchive& ar, T* values, size_t size)
+        {
+            load_array(ar, values, size, is_binary_serializable<T>());
+        }
+        
+        
         // serializer for std::vector
         template<typename T>
         struct Serializer<std::vector<T> >
         {
             template<typename InputArchive>
             static inline void load(InputArchive& ar, std::vector<T>& val)
+            {
+                size_t size;
+                ar & size;
+                val.resize(size);
+                load_array(ar, val.data(), size);
+            }
+            
+            template<typename OutputArchive>
+            static inline void save(OutputArchive& ar, const std::vector<T>& val)
+            {
+                ar & val.size();
+                save_array(ar, val.data(), val.size());
+            }
+        };
+        
+        // std::vector<bool> has no array of bools
+        template<>
+        struct Serializer<std::vector<bool> >
+        {
+            template<typename InputArchive>
+            static inline void load(InputArchive& ar, std::vector<bool>& val)
             {
                 size_t size;
                 ar & size;
                 val.resize(size);
                 for (size_t i=0;i<size;++i) {
-                    ar & val[i];
+                    bool value;
+                    ar & value;
+                    val[i] = value;
                 }
             }
             
             template<typename OutputArchive>
-            static inline void save(OutputArchive& ar, const std::vector<T>& val)
+            static inline void save(OutputArchive& ar, const std::vector<bool>& val)
             {
                 ar & val.size();
                 for (size_t i=0;i<val.size();++i) {
-                    ar & val[i];
+                    bool value = val[i];
+                    ar & value;
                 }
             }
         };
         
-        // serializer for std::vector
+        // serializer for std::map
         template<typename K, typename V>
         struct Serializer<std::map<K,V> >
         {
@@ -130,9 +221,10 @@ ar & int_val;\
                 {
                     K key;
                     ar & key;
-                    V value;
-                    ar & value;
-                    map_val[key] = value;
+                    // the keys were saved in order, each one goes at the end of the map
+                    // and its value is loaded where it lies
+                    typename std::map<K,V>::iterator it = map_val.insert(map_val.end(), std::make_pair(key, V()));
+                    ar & it->second;
                 }
             }
             
@@ -251,13 +343,21 @@ ar & int_val;\
         class ArchiveBase
         {
         public:
+            ArchiveBase() : object_(NULL), version_(0) {}
             
             void* getObject() { return object_; }
             
             void setObject(void* object) { object_ = object; }
             
+            /** The version of the layout of the data being read or written, for the
+             * objects whose layout changed (see IndexHeader::format) */
+            int getVersion() const { return version_; }
+            
+            void setVersion(int version) { version_ = version; }
+            
         private:
             void* object_;
+            int version_;
         };
         
         
@@ -313,6 +413,12 @@ ar & int_val;\
                 size_ += sizeof(val);
             }
             
+            template<typename T>
+            void save(T* const& val)
+            {
+                // pointers are not saved
+            }
+            
             template<typename T>
             void save_binary(T* ptr, size_t size)
             {
@@ -444,6 +550,426 @@ ar & int_val;\
             
         };
         
+        
+        /**
+         * Hints of the buffered archives
+         */
+        enum ArchiveHints
+        {
+            /** bypass the page cache (O_DIRECT), when opening a file that supports it */
+            ARCHIVE_DIRECT = 1,
+            /** tell the kernel the file is read sequentially, it reads ahead more */
+            ARCHIVE_SEQUENTIAL = 2,
+            /** drop the pages of the file from the page cache once done */
+            ARCHIVE_DONTNEED = 4
+        };
+        
+        /**
+         * The file and the aligned buffer shared by the buffered archives. The file is
+         * accessed with pread/pwrite at explicit offsets, in blocks of the buffer size.
+         */
+        class BufferedFile
+        {
+        public:
+            /** Size of the buffers by default, 4MB */
+            static const size_t DEFAULT_BUFFER_SIZE = size_t(4) << 20;
+            /** Alignment of the buffer and of the blocks for O_DIRECT */
+            enum { BLOCK_SIZE = 4096 };
+            
+            BufferedFile(size_t buffer_size, int hints) : fd_(-1), own_fd_(false), stream_(NULL), hints_(hints), direct_(false), base_(0), buffer_(NULL)
+            {
+                buffer_size_ = std::max<size_t>(BLOCK_SIZE, (buffer_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+                void* buffer;
+                if (posix_memalign(&buffer, BLOCK_SIZE, buffer_size_) != 0) {
+                    throw FLANNException("Cannot allocate the archive buffer");
+                }
+                buffer_ = static_cast<unsigned char*>(buffer);
+            }
+            
+            ~BufferedFile()
+            {
+                if (own_fd_ && fd_ >= 0) {
+                    ::close(fd_);
+                }
+                free(buffer_);
+            }
+            
+        protected:
+            void open(const char* filename, int flags)
+            {
+#ifdef O_DIRECT
+                if (hints_ & ARCHIVE_DIRECT) {
+                    fd_ = ::open(filename, flags | O_DIRECT, 0644);
+                    direct_ = (fd_ >= 0);
+                }
+#endif
+                // not every file system supports O_DIRECT
+                if (fd_ < 0) {
+                    fd_ = ::open(filename, flags, 0644);
+                }
+                if (fd_ < 0) {
+                    throw FLANNException(std::string("Cannot open file ") + filename);
+                }
+                own_fd_ = true;
+            }
+            
+            /**
+             * Uses a stream from its current position, its own buffer is flushed first
+             */
+            void attach(FILE* stream)
+            {
+                fflush(stream);
+                stream_ = stream;
+                fd_ = fileno(stream);
+                off_t position = ftello(stream);
+                if (fd_ < 0 || position < 0) {
+                    throw FLANNException("Cannot use the stream of the archive");
+                }
+                base_ = position;
+            }
+            
+            void advise(off_t length, int advice)
+            {
+#if defined(POSIX_FADV_SEQUENTIAL)
+                posix_fadvise(fd_, base_, length, advice);
+#endif
+            }
+            
+            /**
+             * Leaves the stream after the bytes used by the archive and closes the file
+             * @param size number of bytes used
+             */
+            void release(off_t size)
+            {
+#if defined(POSIX_FADV_DONTNEED)
+                if (hints_ & ARCHIVE_DONTNEED) {
+                    advise(size, POSIX_FADV_DONTNEED);
+                }
+#endif
+                if (stream_ != NULL) {
+                    fseeko(stream_, base_ + size, SEEK_SET);
+                    stream_ = NULL;
+                }
+                if (own_fd_ && fd_ >= 0) {
+                    int ret = ::close(fd_);
+                    fd_ = -1;
+                    if (ret != 0) {
+                        throw FLANNException("Error closing the archive file");
+                    }
+                }
+                fd_ = -1;
+            }
+            
+            int fd_;
+            bool own_fd_;
+            FILE* stream_;
+            int hints_;
+            bool direct_;
+            /** offset in the file of the start of the archive */
+            off_t base_;
+            unsigned char* buffer_;
+            size_t buffer_size_;
+            
+        private:
+            BufferedFile(const BufferedFile&);
+            BufferedFile& operator=(const BufferedFile&);
+        };
+        
+        
+        /**
+         * Output archive writing through a large buffer: the values are copied in the
+         * buffer, which is written when full with one pwrite. It writes the same format
+         * as SaveArchive.
+         *
+         * close() writes what is left in the buffer and reports the errors, the
+         * destructor closes the archive too but ignores them.
+         */
+        class BufferedSaveArchive : public OutputArchive<BufferedSaveArchive>, private BufferedFile
+        {
+        public:
+            /**
+             * @param filename the file to write
+             * @param buffer_size size of the buffer
+             * @param hints ArchiveHints
+             */
+            BufferedSaveArchive(const char* filename, size_t buffer_size = DEFAULT_BUFFER_SIZE, int hints = 0) :
+            BufferedFile(buffer_size, hints), used_(0), written_(0), open_(true)
+            {
+                open(filename, O_WRONLY | O_CREAT | O_TRUNC);
+            }
+            
+            /**
+             * Writes at the current position of a stream, left after the archive when closed
+             */
+            BufferedSaveArchive(FILE* stream, size_t buffer_size = DEFAULT_BUFFER_SIZE, int hints = 0) :
+            BufferedFile(buffer_size, hints & ~ARCHIVE_DIRECT), used_(0), written_(0), open_(true)
+            {
+                attach(stream);
+            }
+            
+            ~BufferedSaveArchive()
+            {
+                try {
+                    close();
+                }
+                catch (...) {
+                }
+            }
+            
+            /**
+             * Reserves the space of the archive in the file, in one call. The size can be
+             * computed by saving the same objects to a SizeArchive.
+             * @param size the size of the archive
+             */
+            void preallocate(size_t size)
+            {
+#if defined(__linux__) || defined(__FreeBSD__)
+                if (size > 0) {
+                    posix_fallocate(fd_, base_, size);
+                }
+#endif
+            }
+            
+            template<typename T>
+            void save(const T& val)
+            {
+                if (used_ + sizeof(val) <= buffer_size_) {
+                    memcpy(buffer_ + used_, &val, sizeof(val));
+                    used_ += sizeof(val);
+                }
+                else {
+                    save_binary(&val, sizeof(val));
+                }
+            }
+            
+            template<typename T>
+            void save(T* const& val)
+            {
+                // don't save pointers
+            }
+            
+            template<typename T>
+            void save_binary(T* ptr, size_t size)
+            {
+                const unsigned char* data = reinterpret_cast<const unsigned char*>(ptr);
+                if (!direct_ && size >= buffer_size_) {
+                    // large blocks go straight to the file
+                    flush();
+                    write(data, size);
+                    return;
+                }
+                while (size > 0) {
+                    size_t count = std::min(size, buffer_size_ - used_);
+                    memcpy(buffer_ + used_, data, count);
+                    used_ += count;
+                    data += count;
+                    size -= count;
+                    if (used_ == buffer_size_) {
+                        flush();
+                    }
+                }
+            }
+            
+            /**
+             * Writes the end of the archive and closes the file
+             */
+            void close()
+            {
+                if (!open_) return;
+                open_ = false;
+                flush();
+                if (own_fd_ && ::ftruncate(fd_, written_) != 0) {
+                    // the file may be longer, padded for O_DIRECT or preallocated
+                    release(written_);
+                    throw FLANNException("Error writing to file");
+                }
+                release(written_);
+            }
+            
+        private:
+            /**
+             * Writes the buffer, which is full except at the end of the archive (O_DIRECT
+             * writes the end padded to a block)
+             */
+            void flush()
+            {
+                if (used_ == 0) return;
+                size_t size = used_;
+                if (direct_) {
+                    size = (used_ + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+                    memset(buffer_ + used_, 0, size - used_);
+                }
+                size_t used = used_;
+                used_ = 0;
+                write(buffer_, size);
+                // the padding is overwritten by the next block, then truncated
+                written_ -= size - used;
+            }
+            
+            void write(const unsigned char* data, size_t size)
+            {
+                off_t offset = base_ + written_;
+                while (size > 0) {
+                    ssize_t count = ::pwrite(fd_, data, size, offset);
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count <= 0) {
+                        throw FLANNException("Error writing to file");
+                    }
+                    data += count;
+                    offset += count;
+                    size -= count;
+                    written_ += count;
+                }
+            }
+            
+            size_t used_;
+            off_t written_;
+            bool open_;
+        };
+        
+        
+        /**
+         * Input archive reading through a large buffer, filled with one pread. It reads
+         * the format of SaveArchive, and throws when the file ends before a value.
+         */
+        class BufferedLoadArchive : public InputArchive<BufferedLoadArchive>, private BufferedFile
+        {
+        public:
+            /**
+             * @param filename the file to read
+             * @param buffer_size size of the buffer
+             * @param hints ArchiveHints
+             */
+            BufferedLoadArchive(const char* filename, size_t buffer_size = DEFAULT_BUFFER_SIZE, int hints = ARCHIVE_SEQUENTIAL) :
+            BufferedFile(buffer_size, hints), position_(0), filled_(0), read_(0), open_(true)
+            {
+                open(filename, O_RDONLY);
+                start();
+            }
+            
+            /**
+             * Reads from the current position of a stream, left after the archive when closed
+             */
+            BufferedLoadArchive(FILE* stream, size_t buffer_size = DEFAULT_BUFFER_SIZE, int hints = ARCHIVE_SEQUENTIAL) :
+            BufferedFile(buffer_size, hints & ~ARCHIVE_DIRECT), position_(0), filled_(0), read_(0), open_(true)
+            {
+                attach(stream);
+                start();
+            }
+            
+            ~BufferedLoadArchive()
+            {
+                try {
+                    close();
+                }
+                catch (...) {
+                }
+            }
+            
+            template<typename T>
+            void load(T& val)
+            {
+                if (position_ + sizeof(val) <= filled_) {
+                    memcpy(&val, buffer_ + position_, sizeof(val));
+                    position_ += sizeof(val);
+                }
+                else {
+                    load_binary(&val, sizeof(val));
+                }
+            }
+            
+            template<typename T>
+            void load(T*& val)
+            {
+                // don't load pointers
+            }
+            
+            template<typename T>
+            void load_binary(T* ptr, size_t size)
+            {
+                unsigned char* data = reinterpret_cast<unsigned char*>(ptr);
+                size_t count = std::min(size, filled_ - position_);
+                memcpy(data, buffer_ + position_, count);
+                position_ += count;
+                data += count;
+                size -= count;
+                if (size == 0) return;
+                
+                if (!direct_ && size >= buffer_size_) {
+                    // large blocks are read straight from the file
+                    read(data, size, size);
+                    position_ = filled_ = 0;
+                    return;
+                }
+                while (size > 0) {
+                    position_ = 0;
+                    filled_ = 0;
+                    filled_ = read(buffer_, buffer_size_, 1);
+                    count = std::min(size, filled_);
+                    memcpy(data, buffer_, count);
+                    position_ = count;
+                    data += count;
+                    size -= count;
+                }
+            }
+            
+            /**
+             * Closes the archive, a stream is left after the values read
+             */
+            void close()
+            {
+                if (!open_) return;
+                open_ = false;
+                release(read_ - (filled_ - position_));
+            }
+            
+        private:
+            void start()
+            {
+#if defined(POSIX_FADV_SEQUENTIAL)
+                if (hints_ & ARCHIVE_SEQUENTIAL) {
+                    advise(0, POSIX_FADV_SEQUENTIAL);
+                }
+#endif
+            }
+            
+            /**
+             * Reads from the file
+             * @param data where to read
+             * @param size maximum number of bytes to read
+             * @param needed minimum number of bytes, less is an error
+             * @return number of bytes read
+             */
+            size_t read(unsigned char* data, size_t size, size_t needed)
+            {
+                size_t total = 0;
+                while (total < size) {
+                    ssize_t count = ::pread(fd_, data + total, size - total, base_ + read_);
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count < 0) {
+                        throw FLANNException("Error loading from file");
+                    }
+                    if (count == 0) break;
+                    total += count;
+                    read_ += count;
+                    // O_DIRECT reads whole blocks, a shorter read is the end of the file
+                    if (direct_ && count % BLOCK_SIZE != 0) break;
+                }
+                if (total < needed) {
+                    throw FLANNException("Error loading from file");
+                }
+                return total;
+            }
+            
+            /** position of the next value in the buffer */
+            size_t position_;
+            /** number of bytes in the buffer */
+            size_t filled_;
+            /** number of bytes read from the file */
+            off_t read_;
+            bool open_;
+        };
+        
     } // namespace serialization
 } // namespace flann
 #endif // SERIALIZATION_H_
@@ -0,0 +1,292 @@
+//
+//  thread_pool.h
+//  LDFlann
+//
+
+#ifndef thread_pool_h
+#define thread_pool_h
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "general.h"
+
+namespace LDFlann
+{
+
+    /**
+     * Pool of persistent worker threads.
+     *
+     * Every worker owns a task queue. A worker runs the tasks of its own queue
+     * newest first and, once it is empty, steals the oldest tasks from the queues
+     * of the other workers. The workers are started once and sleep while there is
+     * nothing to do, so a search over a small batch does not pay for starting threads.
+     *
+     * The pool only relies on std::thread, it does not need an OpenMP capable compiler.
+     */
+    class ThreadPool
+    {
+    public:
+        typedef std::function<void()> Task;
+
+        /**
+         * Constructor
+         * @param threads number of worker threads (0 for one less than the number of cores,
+         * the thread waiting for a job to complete takes part in it)
+         */
+        ThreadPool(size_t threads = 0) : queued_(0), next_queue_(0), stop_(false)
+        {
+            if (threads==0) {
+                size_t cores = std::thread::hardware_concurrency();
+                threads = cores>1 ? cores-1 : 1;
+            }
+            queues_.reserve(threads);
+            for (size_t i=0;i<threads;++i) {
+                queues_.push_back(new TaskQueue());
+            }
+            workers_.reserve(threads);
+            for (size_t i=0;i<threads;++i) {
+                workers_.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (size_t i=0;i<workers_.size();++i) {
+                workers_[i].join();
+            }
+            for (size_t i=0;i<queues_.size();++i) {
+                delete queues_[i];
+            }
+        }
+
+        /**
+         * The pool shared by all the indices, created on first use.
+         */
+        static ThreadPool& instance()
+        {
+            static ThreadPool pool;
+            return pool;
+        }
+
+        /**
+         * @return number of worker threads
+         */
+        size_t size() const
+        {
+            return workers_.size();
+        }
+
+        /**
+         * Queues a task to be run by one of the workers
+         * @param task the task
+         */
+        void submit(const Task& task)
+        {
+            size_t queue = next_queue_.fetch_add(1) % queues_.size();
+            {
+                std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+                queues_[queue]->tasks.push_back(task);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++queued_;
+            }
+            wake_.notify_one();
+        }
+
+        /**
+         * Runs job(thread) for every thread in [0,threads) and waits for all of them
+         * to complete. Thread 0 runs on the calling thread, which then runs the jobs no
+         * worker has started yet itself, so run() completes even if all the workers are
+         * busy (and can safely be called from a task or with a lock held). The caller
+         * never runs the other queued tasks, e.g. a long background task.
+         * The first exception thrown by a job is rethrown here.
+         * @param threads number of concurrent jobs
+         * @param job functor void(int thread)
+         */
+        template<typename Job>
+        void run(int threads, Job job)
+        {
+            if (threads<=1) {
+                job(0);
+                return;
+            }
+
+            // a task may be run after run() returned (once all the jobs were taken), it
+            // then finds no job left and only releases its reference to the group
+            std::shared_ptr<TaskGroup> group(new TaskGroup(threads));
+            Job* shared_job = &job;
+            for (int t=1;t<threads;++t) {
+                submit([group, shared_job]() {
+                    group->runJobs(shared_job, false);
+                });
+            }
+
+            group->runJobs(&job, true);
+            group->wait();
+            if (group->error) {
+                std::rethrow_exception(group->error);
+            }
+        }
+
+    private:
+        struct TaskQueue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        /**
+         * The jobs started by run(), taken by the caller and the workers in turn
+         */
+        struct TaskGroup
+        {
+            TaskGroup(int count) : next(0), pending(count), size(count)
+            {
+            }
+
+            /**
+             * Runs the jobs not taken yet: all of them for the caller of run(), one for
+             * a worker
+             */
+            template<typename Job>
+            void runJobs(Job* job, bool all)
+            {
+                for (;;) {
+                    int thread = next.fetch_add(1);
+                    if (thread>=size) return;
+                    try {
+                        (*job)(thread);
+                    }
+                    catch (...) {
+                        fail(std::current_exception());
+                    }
+                    done();
+                    if (!all) return;
+                }
+            }
+
+            void done()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --pending;
+                finished_cv.notify_all();
+            }
+
+            void fail(std::exception_ptr e)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = e;
+            }
+
+            /**
+             * Waits for the jobs taken by the workers
+             */
+            void wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (pending>0) {
+                    finished_cv.wait(lock);
+                }
+            }
+
+            /** Next job to take */
+            std::atomic<int> next;
+            std::mutex mutex;
+            std::condition_variable finished_cv;
+            /** Number of jobs not completed */
+            int pending;
+            int size;
+            std::exception_ptr error;
+        };
+
+        /**
+         * Takes a task from the queue of the given worker (newest first), or steals
+         * one from the other queues (oldest first) and runs it.
+         * @param own index of the worker queue of the calling thread
+         * @return true if a task was run
+         */
+        bool runQueuedTask(size_t own)
+        {
+            Task task;
+            if (pop(*queues_[own], false, task)) {
+                finishedPop();
+                task();
+                return true;
+            }
+            for (size_t i=1;i<queues_.size();++i) {
+                size_t victim = (own+i) % queues_.size();
+                if (pop(*queues_[victim], true, task)) {
+                    finishedPop();
+                    task();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static bool pop(TaskQueue& queue, bool oldest, Task& task)
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) return false;
+            if (oldest) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+
+        void finishedPop()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --queued_;
+        }
+
+        void workerLoop(size_t index)
+        {
+            for (;;) {
+                if (runQueuedTask(index)) continue;
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (queued_==0 && !stop_) {
+                    wake_.wait(lock);
+                }
+                if (stop_) return;
+            }
+        }
+
+    private:
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+        std::vector<std::thread> workers_;
+        std::vector<TaskQueue*> queues_;
+
+        /** Protects queued_ and stop_, used with wake_ to put idle workers to sleep */
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        size_t queued_;
+
+        std::atomic<size_t> next_queue_;
+        bool stop_;
+    };
+
+}
+
+#endif /* thread_pool_h */
@@ -0,0 +1,117 @@
+//
+//  skewed_batch.cpp
+//  LDFlann
+//
+//  Batch latency of LshIndex::knnSearch on a skewed query set, for every
+//  SearchParams::schedule. A part of the dataset is made of copies of a few
+//  seed descriptors, which all fall in the same buckets; the queries hitting
+//  those hot buckets are grouped at the end of each batch, which is the worst
+//  case for a static split of the batch among the cores.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann benchmark/skewed_batch.cpp -o skewed_batch
+//  Usage:
+//      ./skewed_batch [cores] [batches]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    const size_t kDatasetSize = 100000;
+    const size_t kHotPoints = 20000;
+    const size_t kSeeds = 4;
+    const size_t kVeclen = 32;
+    const size_t kBatchSize = 2048;
+    const size_t kHotQueries = 64;
+    const size_t kKnn = 5;
+
+    struct Schedule
+    {
+        const char* name;
+        flann_schedule_t schedule;
+        int chunk_size;
+    };
+
+    void fill_random(unsigned char* row)
+    {
+        for (size_t j=0;j<kVeclen;++j) row[j] = (unsigned char)rand_int(256);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    int cores = argc>1 ? atoi(argv[1]) : 0;
+    size_t batches = argc>2 ? atoi(argv[2]) : 20;
+
+    seed_random(42);
+    std::vector<unsigned char> seeds(kSeeds*kVeclen);
+    for (size_t i=0;i<kSeeds;++i) fill_random(&seeds[i*kVeclen]);
+
+    // dataset: random points, plus kHotPoints copies of the seeds
+    std::vector<unsigned char> data(kDatasetSize*kVeclen);
+    for (size_t i=0;i<kDatasetSize;++i) {
+        if (i<kHotPoints) std::copy(&seeds[(i%kSeeds)*kVeclen], &seeds[(i%kSeeds)*kVeclen]+kVeclen, &data[i*kVeclen]);
+        else fill_random(&data[i*kVeclen]);
+    }
+
+    // queries: random points, the hot ones are at the tail of the batch
+    std::vector<unsigned char> query_data(kBatchSize*kVeclen);
+    for (size_t i=0;i<kBatchSize;++i) {
+        if (i>=kBatchSize-kHotQueries) std::copy(&seeds[(i%kSeeds)*kVeclen], &seeds[(i%kSeeds)*kVeclen]+kVeclen, &query_data[i*kVeclen]);
+        else fill_random(&query_data[i*kVeclen]);
+    }
+
+    Matrix<unsigned char> dataset(&data[0], kDatasetSize, kVeclen);
+    Matrix<unsigned char> queries(&query_data[0], kBatchSize, kVeclen);
+    std::vector<size_t> indices_data(kBatchSize*kKnn);
+    std::vector<int> dists_data(kBatchSize*kKnn);
+    Matrix<size_t> indices(&indices_data[0], kBatchSize, kKnn);
+    Matrix<int> dists(&dists_data[0], kBatchSize, kKnn);
+
+    Index<HammingPopcnt<unsigned char> > index(dataset, LshIndexParams(8, 16, 1));
+    index.buildIndex();
+
+    const Schedule schedules[] = {
+        { "static", FLANN_SCHEDULE_STATIC, 0 },
+        { "dynamic", FLANN_SCHEDULE_DYNAMIC, 0 },
+        { "dynamic,1", FLANN_SCHEDULE_DYNAMIC, 1 },
+        { "dynamic,16", FLANN_SCHEDULE_DYNAMIC, 16 },
+        { "stealing", FLANN_SCHEDULE_WORK_STEALING, 0 },
+        { "stealing,1", FLANN_SCHEDULE_WORK_STEALING, 1 },
+    };
+
+    printf("%-12s %12s %12s %12s %12s\n", "schedule", "mean (ms)", "p50 (ms)", "p99 (ms)", "max (ms)");
+    for (size_t s=0;s<FLANN_ARRAY_LEN(schedules);++s) {
+        SearchParams params(-1);
+        params.cores = cores;
+        params.schedule = schedules[s].schedule;
+        params.chunk_size = schedules[s].chunk_size;
+
+        std::vector<double> latencies;
+        for (size_t b=0;b<batches;++b) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            index.knnSearch(queries, indices, dists, kKnn, params);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now()-start;
+            latencies.push_back(elapsed.count());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        double mean = 0;
+        for (size_t b=0;b<latencies.size();++b) mean += latencies[b];
+        mean /= latencies.size();
+
+        printf("%-12s %12.2f %12.2f %12.2f %12.2f\n", schedules[s].name, mean,
+               latencies[latencies.size()/2], latencies[(latencies.size()*99)/100], latencies.back());
+    }
+
+    return 0;
+}
@@ -0,0 +1,243 @@
+//
+//  archive_format.cpp
+//  LDFlann
+//
+//  Checks the bytes written by the archives: vectors of basic types, saved
+//  with one call, must be written byte for byte as value by value (their size
+//  then each value), by SaveArchive and BufferedSaveArchive alike, SizeArchive
+//  must give their exact size, and both input archives must load them back.
+//  Also checks that an LSH index saved by LshIndex::saveIndex (buffered and
+//  preallocated) is the file SaveArchive writes, and loads to the same results.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/archive_format.cpp -o archive_format
+//  Usage:
+//      ./archive_format [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kQueries = 100;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    std::vector<unsigned char> readFile(const std::string& filename)
+    {
+        std::vector<unsigned char> content;
+        FILE* in = fopen(filename.c_str(), "rb");
+        if (in==NULL) return content;
+        fseek(in, 0, SEEK_END);
+        content.resize(ftell(in));
+        fseek(in, 0, SEEK_SET);
+        if (!content.empty() && fread(&content[0], content.size(), 1, in)!=1) content.clear();
+        fclose(in);
+        return content;
+    }
+
+    /**
+     * The values saved, of every kind of array
+     */
+    struct Values
+    {
+        std::vector<unsigned char> bytes;
+        std::vector<int> ints;
+        std::vector<unsigned int> empty;
+        std::vector<size_t> sizes;
+        std::vector<float> floats;
+        std::vector<double> doubles;
+        std::vector<bool> flags;
+        std::vector<std::vector<unsigned int> > buckets;
+        std::map<unsigned int, std::vector<unsigned int> > map;
+        ConstArray<unsigned int> array;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & bytes & ints & empty & sizes & floats & doubles & flags & buckets & map & array;
+        }
+
+        bool operator==(const Values& other) const
+        {
+            return bytes==other.bytes && ints==other.ints && empty==other.empty && sizes==other.sizes &&
+                floats==other.floats && doubles==other.doubles && flags==other.flags &&
+                buckets==other.buckets && map==other.map && array.size()==other.array.size() &&
+                std::equal(array.begin(), array.end(), other.array.begin());
+        }
+    };
+
+    template<typename T>
+    void writeValue(FILE* out, const T& value)
+    {
+        fwrite(&value, sizeof(value), 1, out);
+    }
+
+    /**
+     * Writes a vector value by value, the format of the archives
+     */
+    template<typename T>
+    void writeVector(FILE* out, const std::vector<T>& values)
+    {
+        writeValue(out, values.size());
+        for (size_t i=0;i<values.size();++i) writeValue(out, (T)values[i]);
+    }
+
+    void writeReference(const std::string& filename, const Values& values)
+    {
+        FILE* out = fopen(filename.c_str(), "wb");
+        writeVector(out, values.bytes);
+        writeVector(out, values.ints);
+        writeVector(out, values.empty);
+        writeVector(out, values.sizes);
+        writeVector(out, values.floats);
+        writeVector(out, values.doubles);
+        writeVector(out, values.flags);
+        writeValue(out, values.buckets.size());
+        for (size_t i=0;i<values.buckets.size();++i) writeVector(out, values.buckets[i]);
+        writeValue(out, values.map.size());
+        for (std::map<unsigned int, std::vector<unsigned int> >::const_iterator it=values.map.begin();it!=values.map.end();++it) {
+            writeValue(out, it->first);
+            writeVector(out, it->second);
+        }
+        writeVector(out, std::vector<unsigned int>(values.array.begin(), values.array.end()));
+        fclose(out);
+    }
+
+    template<typename IndexType>
+    std::vector<size_t> search(IndexType& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string reference = directory + "/archive_format.ref";
+    std::string filename = directory + "/archive_format.bin";
+
+    seed_random(42);
+    Values values;
+    for (size_t i=0;i<5000;++i) values.bytes.push_back((unsigned char)rand_int(256));
+    for (size_t i=0;i<777;++i) values.ints.push_back(rand_int(1000000)-500000);
+    for (size_t i=0;i<333;++i) values.sizes.push_back((size_t)rand_int(1000000) << 20);
+    for (size_t i=0;i<100;++i) values.floats.push_back(rand_double(100.0)-50.0);
+    for (size_t i=0;i<100;++i) values.doubles.push_back(rand_double(1e9));
+    for (size_t i=0;i<61;++i) values.flags.push_back(rand_int(2)==1);
+    values.buckets.resize(500);
+    for (size_t i=0;i<values.buckets.size();++i) {
+        // mostly empty or small buckets, as the tables of an index
+        size_t size = rand_int(4)==0 ? rand_int(50) : 0;
+        for (size_t j=0;j<size;++j) values.buckets[i].push_back(rand_int(100000));
+    }
+    for (size_t i=0;i<300;++i) values.map[rand_int(1u << 30)].assign(rand_int(5), (unsigned int)i);
+    std::vector<unsigned int> array_values(1000);
+    for (size_t i=0;i<array_values.size();++i) array_values[i] = rand_int(1000000);
+    values.array = ConstArray<unsigned int>(array_values);
+    writeReference(reference, values);
+    std::vector<unsigned char> expected = readFile(reference);
+
+    // the file archives write the values as value by value
+    {
+        serialization::SaveArchive sa(filename.c_str());
+        sa & values;
+    }
+    check(readFile(filename)==expected, "SaveArchive differs from the values saved one by one");
+    // buffers smaller than the arrays, so they go through the buffer and straight to the file
+    size_t buffer_sizes[] = { 4096, 8192, serialization::BufferedFile::DEFAULT_BUFFER_SIZE };
+    for (size_t i=0;i<sizeof(buffer_sizes)/sizeof(buffer_sizes[0]);++i) {
+        serialization::BufferedSaveArchive sa(filename.c_str(), buffer_sizes[i]);
+        sa & values;
+        sa.close();
+        check(readFile(filename)==expected, "BufferedSaveArchive differs from the values saved one by one");
+    }
+    serialization::SizeArchive size;
+    size & values;
+    check(size.size()==expected.size(), "SizeArchive gives another size than the bytes written");
+
+    // and the input archives load them back
+    {
+        Values loaded;
+        serialization::LoadArchive la(reference.c_str());
+        la & loaded;
+        check(loaded==values, "LoadArchive loaded other values");
+    }
+    for (size_t i=0;i<sizeof(buffer_sizes)/sizeof(buffer_sizes[0]);++i) {
+        Values loaded;
+        serialization::BufferedLoadArchive la(reference.c_str(), buffer_sizes[i]);
+        la & loaded;
+        la.close();
+        check(loaded==values, "BufferedLoadArchive loaded other values");
+    }
+
+    // an LSH index, saved after some bytes of a stream
+    {
+        std::vector<unsigned char> data(kSize*kVeclen);
+        for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+        std::vector<unsigned char> query_data(data.begin(), data.begin()+kQueries*kVeclen);
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = true;
+        LshIndex<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        index.buildIndex();
+        index.removePoint(3);
+
+        const char prefix[] = "prefix";
+        FILE* out = fopen(reference.c_str(), "wb");
+        fwrite(prefix, sizeof(prefix), 1, out);
+        {
+            serialization::SaveArchive sa(out);
+            sa & index;
+        }
+        fclose(out);
+        out = fopen(filename.c_str(), "wb");
+        fwrite(prefix, sizeof(prefix), 1, out);
+        index.saveIndex(out);
+        check(ftell(out)==(long)readFile(reference).size(), "stream not left after the saved index");
+        fclose(out);
+        check(readFile(filename)==readFile(reference), "LshIndex::saveIndex differs from SaveArchive");
+
+        FILE* in = fopen(filename.c_str(), "rb");
+        char read_prefix[sizeof(prefix)];
+        check(fread(read_prefix, sizeof(prefix), 1, in)==1, "prefix not read");
+        LshIndex<Distance> loaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        loaded.loadIndex(in);
+        fclose(in);
+        check(search(loaded, query_data)==search(index, query_data), "loaded index gives other results than the saved one");
+    }
+
+    remove(reference.c_str());
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+//
+//  async_batching.cpp
+//  LDFlann
+//
+//  Checks the asynchronous search (Index::knnSearchAsync): many small
+//  submissions, coalesced into batches, must get the results of the same
+//  queries searched synchronously, whatever their knn, their callbacks must
+//  be called with the number of neighbors found, and a submission must be
+//  completed once it waited max_batch_latency, without a flush. Also checks
+//  that assigning an index (Index::swap) passes on its batching parameters.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/async_batching.cpp -o async_batching
+//  Usage:
+//      ./async_batching (exits with 1 on the first failure)
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 4000;
+    const size_t kVeclen = 32;
+    const size_t kSubmissions = 60;
+    const size_t kRowsPerSubmission = 5;
+    const size_t kMaxKnn = 4;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * The buffers of a submission, the neighbors not found are left at -1
+     */
+    struct Submission
+    {
+        Submission(unsigned char* query_data, size_t knn) :
+        queries(query_data, kRowsPerSubmission, kVeclen), knn(knn),
+        indices(kRowsPerSubmission*knn, size_t(-1)), dists(kRowsPerSubmission*knn, DistanceType(-1)),
+        indices_mat(&indices[0], kRowsPerSubmission, knn), dists_mat(&dists[0], kRowsPerSubmission, knn)
+        {
+        }
+
+        Matrix<unsigned char> queries;
+        size_t knn;
+        std::vector<size_t> indices;
+        std::vector<DistanceType> dists;
+        Matrix<size_t> indices_mat;
+        Matrix<DistanceType> dists_mat;
+    };
+
+    /**
+     * Checks the results of a submission against the same queries searched synchronously
+     */
+    bool sameAsSync(Index<Distance>& index, Submission& submission)
+    {
+        Submission expected(submission.queries.ptr(), submission.knn);
+        index.knnSearch(expected.queries, expected.indices_mat, expected.dists_mat, expected.knn, SearchParams());
+        return submission.indices==expected.indices && submission.dists==expected.dists;
+    }
+}
+
+int main()
+{
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    // queries near the points of the dataset, so they have neighbors
+    std::vector<unsigned char> query_data(kSubmissions*kRowsPerSubmission*kVeclen);
+    for (size_t q=0;q<kSubmissions*kRowsPerSubmission;++q) {
+        size_t row = rand_int(kSize);
+        for (size_t j=0;j<kVeclen;++j) query_data[q*kVeclen+j] = data[row*kVeclen+j];
+        query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+
+    LshIndexParams params(8, 16, 1);
+    params["random_seed"] = 7u;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+
+    // submissions with several knn, queued until the flush: coalesced into batches of
+    // the submissions with the same knn
+    {
+        index.setAsyncParams(AsyncSearchParams(64, 10000000));
+        std::vector<Submission*> submissions;
+        std::vector<std::future<int> > done;
+        std::atomic<int> callbacks(0), found(0);
+        for (size_t s=0;s<kSubmissions;++s) {
+            Submission* submission = new Submission(&query_data[s*kRowsPerSubmission*kVeclen], 1+s%kMaxKnn);
+            submissions.push_back(submission);
+            done.push_back(index.knnSearchAsync(submission->queries, submission->indices_mat, submission->dists_mat,
+                                                submission->knn, SearchParams(), [&](int count) { ++callbacks; found += count; }));
+        }
+        index.flushAsync();
+        int total = 0;
+        for (size_t s=0;s<kSubmissions;++s) {
+            total += done[s].get();
+            check(sameAsSync(index, *submissions[s]), "asynchronous results differ from the synchronous search");
+            delete submissions[s];
+        }
+        check(callbacks==(int)kSubmissions, "a callback was not called");
+        check(found==total, "the callbacks got another number of neighbors than the futures");
+    }
+
+    // without a flush, a submission is started once it waited max_batch_latency
+    {
+        index.setAsyncParams(AsyncSearchParams(1024, 1000));
+        Submission submission(&query_data[0], 2);
+        std::future<int> done = index.knnSearchAsync(submission.queries, submission.indices_mat, submission.dists_mat,
+                                                     submission.knn, SearchParams());
+        check(done.wait_for(std::chrono::seconds(5))==std::future_status::ready, "submission not started after its latency");
+        done.get();
+        check(sameAsSync(index, submission), "asynchronous results differ from the synchronous search");
+    }
+
+    // assignment (copy and swap): the index gets the batching parameters of the other one
+    {
+        Index<Distance> other(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        other.buildIndex();
+        other.setAsyncParams(AsyncSearchParams(1024, 10000000));
+        index.setAsyncParams(AsyncSearchParams(1024, 1000));
+        // the batcher of the assigned index exists before the assignment
+        Submission before(&query_data[0], 1);
+        std::future<int> done_before = other.knnSearchAsync(before.queries, before.indices_mat, before.dists_mat,
+                                                            before.knn, SearchParams());
+        other = index;
+        check(done_before.wait_for(std::chrono::seconds(0))==std::future_status::ready, "pending submission not completed by the assignment");
+        Submission submission(&query_data[0], 2);
+        std::future<int> done = other.knnSearchAsync(submission.queries, submission.indices_mat, submission.dists_mat,
+                                                     submission.knn, SearchParams());
+        check(done.wait_for(std::chrono::seconds(5))==std::future_status::ready, "the batching parameters were not assigned");
+        other.flushAsync();
+    }
+
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
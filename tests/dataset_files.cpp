@@ -0,0 +1,188 @@
+//
+//  dataset_files.cpp
+//  LDFlann
+//
+//  Checks the datasets mapped from files (mapped_dataset.h): raw files, with or
+//  without a header, and the .bvecs/.fvecs/.ivecs formats must be viewed with
+//  the values written, an index built on a mapped dataset must give the results
+//  of the same index built on the values in memory, and files that are not a
+//  whole number of rows, or whose rows differ in size, must throw a FLANNException.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/dataset_files.cpp -o dataset_files
+//  Usage:
+//      ./dataset_files [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "flann.cpp"
+#include "mapped_dataset.h"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Writes rows in the vecs format, each one after its number of values
+     * @param cols the number of values written before each row
+     */
+    template<typename T>
+    void writeVecs(const std::string& filename, const std::vector<T>& values, size_t rows, const std::vector<int32_t>& cols)
+    {
+        FILE* out = fopen(filename.c_str(), "wb");
+        size_t veclen = values.size()/rows;
+        for (size_t i=0;i<rows;++i) {
+            fwrite(&cols[i], sizeof(int32_t), 1, out);
+            fwrite(&values[i*veclen], sizeof(T), veclen, out);
+        }
+        fclose(out);
+    }
+
+    template<typename T>
+    void writeVecs(const std::string& filename, const std::vector<T>& values, size_t rows)
+    {
+        writeVecs(filename, values, rows, std::vector<int32_t>(rows, (int32_t)(values.size()/rows)));
+    }
+
+    void writeRaw(const std::string& filename, const std::vector<unsigned char>& header, const std::vector<unsigned char>& values)
+    {
+        FILE* out = fopen(filename.c_str(), "wb");
+        if (!header.empty()) fwrite(&header[0], 1, header.size(), out);
+        fwrite(&values[0], 1, values.size(), out);
+        fclose(out);
+    }
+
+    /**
+     * Checks that a dataset views the values written
+     */
+    template<typename T>
+    bool sameRows(const Matrix<T>& dataset, const std::vector<T>& values, size_t rows, size_t cols)
+    {
+        if (dataset.rows!=rows || dataset.cols!=cols) return false;
+        for (size_t i=0;i<rows;++i) {
+            for (size_t j=0;j<cols;++j) {
+                if (dataset[i][j]!=values[i*cols+j]) return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename Function>
+    bool throws(Function function)
+    {
+        try {
+            function();
+        }
+        catch (const FLANNException&) {
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    std::vector<size_t> search(Index<Distance>& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/dataset_files.vecs";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    std::vector<unsigned char> query_data(data.begin(), data.begin()+kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    std::vector<float> floats(500*12);
+    for (size_t i=0;i<floats.size();++i) floats[i] = (float)rand_double(10.0, -10.0);
+    std::vector<int> ints(300*7);
+    for (size_t i=0;i<ints.size();++i) ints[i] = rand_int(1000000)-500000;
+
+    // the vecs formats
+    writeVecs(filename, floats, 500);
+    check(sameRows<float>(map_vecs_from_file<float>(filename), floats, 500, 12), ".fvecs file viewed with other values");
+    writeVecs(filename, ints, 300);
+    check(sameRows<int>(map_vecs_from_file<int>(filename), ints, 300, 7), ".ivecs file viewed with other values");
+    writeVecs(filename, data, kSize);
+    MappedDataset<unsigned char> bvecs = map_vecs_from_file<unsigned char>(filename);
+    check(sameRows<unsigned char>(bvecs, data, kSize, kVeclen), ".bvecs file viewed with other values");
+
+    // an index built on the mapped rows, the mapping kept by a copy of the dataset
+    LshIndexParams params(6, 14, 1);
+    params["random_seed"] = 7u;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+    MappedDataset<unsigned char> copy(bvecs);
+    bvecs = MappedDataset<unsigned char>();
+    copy.willNeed();
+    Index<Distance> mapped_index(copy.matrix(), params);
+    mapped_index.buildIndex();
+    check(search(mapped_index, query_data)==search(index, query_data), "index built on a mapped dataset gives other results");
+
+    // raw files, with a header
+    std::vector<unsigned char> header(100, 0xab);
+    writeRaw(filename, std::vector<unsigned char>(), data);
+    check(sameRows<unsigned char>(map_from_file<unsigned char>(filename, kVeclen), data, kSize, kVeclen), "raw file viewed with other values");
+    writeRaw(filename, header, data);
+    check(sameRows<unsigned char>(map_from_file<unsigned char>(filename, kVeclen, header.size()), data, kSize, kVeclen), "raw file with a header viewed with other values");
+    check(sameRows<unsigned short>(map_from_file<unsigned short>(filename, kVeclen/2, header.size()),
+                                   std::vector<unsigned short>((const unsigned short*)&data[0], (const unsigned short*)&data[0]+data.size()/2), kSize, kVeclen/2),
+          "raw file of 16 bits values viewed with other values");
+
+    // invalid files
+    check(throws([&]() { map_from_file<unsigned char>(filename, kVeclen); }), "raw file of part of a row mapped");
+    check(throws([&]() { map_from_file<unsigned char>(filename, 0); }), "raw file with rows of no value mapped");
+    check(throws([&]() { map_from_file<unsigned char>(filename, kVeclen, header.size()+data.size()+1); }), "raw file shorter than its header mapped");
+    check(throws([&]() { map_vecs_from_file<float>(directory + "/dataset_files_missing.fvecs"); }), "missing file mapped");
+    std::vector<int32_t> cols(500, 12);
+    cols[499] = 11;
+    writeVecs(filename, floats, 500, cols);
+    check(throws([&]() { map_vecs_from_file<float>(filename); }), ".fvecs file with rows of different sizes mapped");
+    cols.assign(500, 0);
+    writeVecs(filename, floats, 500, cols);
+    check(throws([&]() { map_vecs_from_file<float>(filename); }), ".fvecs file with rows of no value mapped");
+    writeVecs(filename, floats, 500);
+    check(throws([&]() { map_vecs_from_file<int>(filename + ".missing"); }), "missing .ivecs file mapped");
+    check(throws([&]() { map_vecs_from_file<double>(filename); }), ".fvecs file mapped as a file of doubles");
+    writeRaw(filename, std::vector<unsigned char>(), std::vector<unsigned char>(1, 0));
+    check(throws([&]() { map_vecs_from_file<float>(filename); }), "truncated .fvecs file mapped");
+
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+//
+//  file_checksums.cpp
+//  LDFlann
+//
+//  Checks the validation of the index files: CRC32C must give the values of
+//  the standard (portable and SSE 4.2 code alike), a byte changed in any
+//  section must be reported, with the name of the section, when the file is
+//  loaded with its checksums verified, for stored and compressed sections, and
+//  a changed header, a truncated file or a file of a newer version must be
+//  rejected even without the verification.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/file_checksums.cpp -o file_checksums
+//  Usage:
+//      ./file_checksums [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+
+    const size_t kSize = 2000;
+    const size_t kVeclen = 32;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    std::vector<unsigned char> readFile(const std::string& filename)
+    {
+        std::vector<unsigned char> content;
+        FILE* in = fopen(filename.c_str(), "rb");
+        if (in==NULL) return content;
+        fseek(in, 0, SEEK_END);
+        content.resize(ftell(in));
+        fseek(in, 0, SEEK_SET);
+        if (!content.empty() && fread(&content[0], content.size(), 1, in)!=1) content.clear();
+        fclose(in);
+        return content;
+    }
+
+    void writeFile(const std::string& filename, const std::vector<unsigned char>& content)
+    {
+        FILE* out = fopen(filename.c_str(), "wb");
+        if (!content.empty()) fwrite(&content[0], content.size(), 1, out);
+        fclose(out);
+    }
+
+    /**
+     * Loads a file
+     * @return the message of the FLANNException thrown, empty if the file was loaded
+     */
+    std::string loadError(const std::string& filename, std::vector<unsigned char>& data, bool verify)
+    {
+        try {
+            Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename, verify));
+        }
+        catch (const FLANNException& e) {
+            std::string message = e.what();
+            return message.empty() ? "?" : message;
+        }
+        return "";
+    }
+
+    /**
+     * Changes a byte in the middle of every section of a file in turn, the file must
+     * then be rejected when its checksums are verified
+     */
+    void checkSections(const std::string& filename, std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> original = readFile(filename);
+        std::vector<mapped::SectionEntry> sections = MappedReader(filename).sections();
+        check(sections.size()>3, "too few sections in the file");
+        for (size_t i=0;i<sections.size();++i) {
+            if (sections[i].size==0) continue;
+            std::vector<unsigned char> corrupted(original);
+            corrupted[sections[i].offset + sections[i].size/2] ^= 0x10;
+            writeFile(filename, corrupted);
+            std::string error = loadError(filename, data, true);
+            std::string name = mapped::section_name(sections[i].kind);
+            check(error.find("'" + name + "'")!=std::string::npos, "changed section not reported");
+        }
+        writeFile(filename, original);
+        check(loadError(filename, data, true).empty(), "file rejected once restored");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/file_checksums.idx";
+
+    // check values of CRC32C (RFC 3720)
+    const char* digits = "123456789";
+    check(crc32c::value(digits, strlen(digits))==0xE3069283u, "wrong CRC32C of 123456789");
+    std::vector<unsigned char> zeros(32, 0), ones(32, 0xff);
+    check(crc32c::value(&zeros[0], zeros.size())==0x8A9136AAu, "wrong CRC32C of 32 zeros");
+    check(crc32c::value(&ones[0], ones.size())==0x62A8AB43u, "wrong CRC32C of 32 0xff");
+    std::vector<unsigned char> buffer(1000);
+    for (size_t i=0;i<buffer.size();++i) buffer[i] = (unsigned char)(i*7+3);
+    check(crc32c::extend_portable(0, &buffer[1], buffer.size()-1)==crc32c::value(&buffer[1], buffer.size()-1),
+          "portable and dispatched CRC32C differ");
+    check(crc32c::extend(crc32c::extend(0, &buffer[0], 333), &buffer[333], buffer.size()-333)==crc32c::value(&buffer[0], buffer.size()),
+          "CRC32C of the parts differs from the CRC32C of the whole");
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    LshIndexParams params(4, 14, 1);
+    params["save_dataset"] = true;
+    params["compress_tables"] = true;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+    index.removePoint(5);
+
+    // sections stored as is, then compressed
+    index.save(filename);
+    checkSections(filename, data);
+    index.save(filename, true);
+    checkSections(filename, data);
+
+    // without the verification a changed section is not read, a changed header is
+    index.save(filename);
+    std::vector<unsigned char> original = readFile(filename);
+    std::vector<mapped::SectionEntry> sections = MappedReader(filename).sections();
+    std::vector<unsigned char> corrupted(original);
+    for (size_t i=0;i<sections.size();++i) {
+        if (sections[i].kind==mapped::DATASET) corrupted[sections[i].offset] ^= 1;
+    }
+    writeFile(filename, corrupted);
+    check(loadError(filename, data, false).empty(), "file with a changed dataset rejected without the verification");
+    corrupted = original;
+    corrupted[offsetof(mapped::FileHeader, index_type)] ^= 1;
+    writeFile(filename, corrupted);
+    check(!loadError(filename, data, false).empty(), "file with a changed header loaded");
+
+    // truncated file
+    corrupted.assign(original.begin(), original.end()-1);
+    writeFile(filename, corrupted);
+    check(!loadError(filename, data, false).empty(), "truncated file loaded");
+
+    // a file of a newer version, with a valid header checksum
+    corrupted = original;
+    mapped::FileHeader header;
+    memcpy(&header, &corrupted[0], sizeof(header));
+    header.version = mapped::VERSION+1;
+    header.header_crc = 0;
+    header.header_crc = crc32c::value(&header, sizeof(header));
+    memcpy(&corrupted[0], &header, sizeof(header));
+    writeFile(filename, corrupted);
+    check(!loadError(filename, data, false).empty(), "file of a newer version loaded");
+
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+//
+//  hdf5_streaming.cpp
+//  LDFlann
+//
+//  Checks the reading of the HDF5 datasets by ranges of rows: stream_from_file
+//  must give every row once, in order, in ranges of the size asked, and an
+//  index built by build_index_from_file must give the results of the same
+//  index built on the whole dataset. A missing file or dataset must throw a
+//  FLANNException.
+//
+//  Build (from the repository root, needs the HDF5 library; -iquote so that the
+//  <hdf5.h> included by LDFlann/hdf5.h is the header of the library):
+//      c++ -O2 -std=c++11 -pthread -iquote LDFlann tests/hdf5_streaming.cpp -o hdf5_streaming -lhdf5
+//  Usage:
+//      ./hdf5_streaming [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "hdf5.h"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 5000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+    /** size of the ranges read, not a whole number of rows */
+    const size_t kChunkBytes = 1000;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    std::vector<size_t> search(Index<Distance>& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+
+    /**
+     * @return true if streaming the dataset throws a FLANNException
+     */
+    bool streamThrows(const std::string& filename, const std::string& name)
+    {
+        try {
+            stream_from_file<unsigned char>(filename, name, [](const Matrix<unsigned char>&, size_t) {});
+        }
+        catch (const FLANNException&) {
+            return true;
+        }
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/hdf5_streaming.h5";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    std::vector<unsigned char> query_data(data.begin(), data.begin()+kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    remove(filename.c_str());
+    save_to_file(Matrix<unsigned char>(&data[0], kSize, kVeclen), filename, "dataset");
+
+    // every row once, in order, by ranges of about kChunkBytes
+    std::vector<unsigned char> streamed;
+    size_t ranges = 0;
+    bool in_order = true, bounded = true;
+    size_t rows = stream_from_file<unsigned char>(filename, "dataset", [&](const Matrix<unsigned char>& points, size_t first) {
+        in_order = in_order && first*kVeclen==streamed.size() && points.cols==kVeclen;
+        bounded = bounded && points.rows>0 && points.rows*kVeclen<=kChunkBytes;
+        for (size_t i=0;i<points.rows;++i) streamed.insert(streamed.end(), points[i], points[i]+kVeclen);
+        ++ranges;
+    }, kChunkBytes);
+    check(rows==kSize, "wrong number of rows");
+    check(in_order, "ranges not given in order");
+    check(bounded, "range larger than asked");
+    check(ranges==(kSize+kChunkBytes/kVeclen-1)/(kChunkBytes/kVeclen), "wrong number of ranges");
+    check(streamed==data, "rows streamed differ from the dataset");
+
+    // an index built by ranges, against the same index built on the whole dataset
+    LshIndexParams params(6, 14, 1);
+    params["random_seed"] = 7u;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+    Index<Distance> streamed_index(Matrix<unsigned char>(), params);
+    build_index_from_file(streamed_index, filename, "dataset", 0, kChunkBytes);
+    check(streamed_index.size()==kSize, "index built by ranges has another size");
+    check(search(streamed_index, query_data)==search(index, query_data), "index built by ranges gives other results");
+
+    check(streamThrows(filename, "missing"), "missing dataset streamed");
+    check(streamThrows(directory + "/hdf5_streaming_missing.h5", "dataset"), "missing file streamed");
+
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
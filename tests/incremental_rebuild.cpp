@@ -0,0 +1,137 @@
+//
+//  incremental_rebuild.cpp
+//  LDFlann
+//
+//  Checks the incremental rebuild of LshIndex::addPoints: once the index has
+//  grown past the rebuild threshold, the new tables must be filled by slices
+//  over several calls, every point must stay findable before, during and after
+//  the swap, and Index::addPoints must take the same path. Also checks that
+//  addPoints builds an index that was never built.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/incremental_rebuild.cpp -o incremental_rebuild
+//  Usage:
+//      ./incremental_rebuild (exits with 1 on the first failure)
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kBuildSize = 2000;
+    const size_t kBatchSize = 100;
+    const size_t kBatches = 40;
+    const size_t kVeclen = 32;
+    const int kRebuildStep = 500;
+    const float kRebuildThreshold = 2;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    LshIndexParams params()
+    {
+        LshIndexParams params(8, 16, 0);
+        params["rebuild_step"] = kRebuildStep;
+        params["random_seed"] = 7u;
+        return params;
+    }
+
+    /**
+     * Searches the first rows points of the dataset and counts the ones not found
+     * (as their own nearest neighbor, at distance 0)
+     */
+    template<typename IndexType>
+    size_t missing(IndexType& index, unsigned char* data, size_t rows)
+    {
+        Matrix<unsigned char> queries(data, rows, kVeclen);
+        // the searches leave the results of the queries with no neighbor untouched
+        std::vector<size_t> indices(rows, size_t(-1));
+        std::vector<DistanceType> dists(rows);
+        Matrix<size_t> indices_mat(&indices[0], rows, 1);
+        Matrix<DistanceType> dists_mat(&dists[0], rows, 1);
+        index.knnSearch(queries, indices_mat, dists_mat, 1, SearchParams());
+        size_t count = 0;
+        for (size_t i=0;i<rows;++i) {
+            if (indices[i]!=i || dists[i]!=0) ++count;
+        }
+        return count;
+    }
+}
+
+int main()
+{
+    seed_random(42);
+    size_t total = kBuildSize + kBatches*kBatchSize;
+    std::vector<unsigned char> data(total*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+
+    // LshIndex: the rebuild starts past the threshold and is spread over several calls
+    {
+        LshIndex<Distance> index(Matrix<unsigned char>(&data[0], kBuildSize, kVeclen), params());
+        index.buildIndex();
+        size_t size = kBuildSize;
+        size_t started = 0, finished = 0, rebuilding_calls = 0;
+        for (size_t b=0;b<kBatches;++b) {
+            bool was_rebuilding = index.rebuilding();
+            index.addPoints(Matrix<unsigned char>(&data[size*kVeclen], kBatchSize, kVeclen), kRebuildThreshold);
+            size += kBatchSize;
+            if (!was_rebuilding && index.rebuilding()) ++started;
+            if (was_rebuilding && !index.rebuilding()) ++finished;
+            if (index.rebuilding()) ++rebuilding_calls;
+            check(missing(index, &data[0], size)==0, "point missing after addPoints");
+        }
+        check(started>0, "the rebuild never started");
+        check(finished==started, "the rebuild never completed");
+        // 2*kBuildSize points rehashed kRebuildStep at a time
+        check(rebuilding_calls>=size_t(2*kBuildSize/kRebuildStep)-1, "the rebuild was not spread over several calls");
+        check(!index.needsRebuild(kRebuildThreshold), "the rebuilt tables do not cover the dataset");
+    }
+
+    // Index: the threshold reaches the incremental rebuild, with removals in between
+    {
+        Index<Distance> index(Matrix<unsigned char>(&data[0], kBuildSize, kVeclen), params());
+        index.buildIndex();
+        size_t size = kBuildSize;
+        for (size_t b=0;b<kBatches;++b) {
+            index.addPoints(Matrix<unsigned char>(&data[size*kVeclen], kBatchSize, kVeclen), kRebuildThreshold);
+            size += kBatchSize;
+            check(missing(index, &data[0], size)==0, "point missing after Index::addPoints");
+        }
+        std::vector<size_t> removed;
+        for (size_t i=0;i<size;i+=3) removed.push_back(i);
+        index.removePoints(removed);
+        check(missing(index, &data[0], size)==removed.size(), "removed points still found");
+    }
+
+    // addPoints on an index that was never built builds it
+    {
+        LshIndex<Distance> index(params());
+        index.addPoints(Matrix<unsigned char>(&data[0], kBuildSize, kVeclen));
+        check(index.size()==kBuildSize, "wrong size after addPoints on an empty index");
+        check(missing(index, &data[0], kBuildSize)==0, "point missing after addPoints on an empty index");
+
+        LshIndex<Distance> unbuilt(Matrix<unsigned char>(&data[0], kBuildSize, kVeclen), params());
+        unbuilt.addPoints(Matrix<unsigned char>(&data[kBuildSize*kVeclen], kBatchSize, kVeclen));
+        check(missing(unbuilt, &data[0], kBuildSize+kBatchSize)==0, "point missing after addPoints on an unbuilt index");
+    }
+
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+//
+//  index_journal.cpp
+//  LDFlann
+//
+//  Checks the journal of the updates (Index::startJournal): the index file
+//  loaded with its journal must give the results of the updated index, before
+//  and after compactJournal and with the automatic compaction, the file of the
+//  index must not change until it is compacted, a record cut at the end of the
+//  journal must be dropped, and a journal must only be replayed on its own base.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/index_journal.cpp -o index_journal
+//  Usage:
+//      ./index_journal [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+    const size_t kAdded = 20;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    off_t fileSize(const std::string& filename)
+    {
+        struct stat st;
+        return ::stat(filename.c_str(), &st)==0 ? st.st_size : -1;
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    std::vector<size_t> search(Index<Distance>& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+
+    /**
+     * Searches the index file loaded with a journal
+     * @return the results, empty if loading it threw a FLANNException
+     */
+    std::vector<size_t> searchLoaded(const std::string& filename, const std::string& journal,
+                                     std::vector<unsigned char>& data, std::vector<unsigned char>& query_data)
+    {
+        try {
+            Index<Distance> loaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename, true, journal));
+            return search(loaded, query_data);
+        }
+        catch (const FLANNException&) {
+            return std::vector<size_t>();
+        }
+    }
+
+    /**
+     * Adds some of the queries to the index and removes some points, one record each
+     */
+    void update(Index<Distance>& index, std::vector<unsigned char>& query_data, size_t round)
+    {
+        index.addPoints(Matrix<unsigned char>(&query_data[(round*kAdded%kQueries)*kVeclen], kAdded, kVeclen));
+        std::vector<size_t> removed;
+        for (size_t i=round;i<kSize;i+=97) removed.push_back(i);
+        index.removePoints(removed);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/index_journal.idx";
+    std::string journal = directory + "/index_journal.journal";
+    std::string other_filename = directory + "/index_journal_other.idx";
+    std::string other_journal = directory + "/index_journal_other.journal";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    // queries near the points of the dataset, so they have neighbors
+    std::vector<unsigned char> query_data(kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) {
+        size_t row = rand_int(kSize);
+        for (size_t j=0;j<kVeclen;++j) query_data[q*kVeclen+j] = data[row*kVeclen+j];
+        query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+
+    LshIndexParams params(6, 14, 1);
+    params["random_seed"] = 7u;
+    params["save_dataset"] = true;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+    index.startJournal(filename, journal);
+    check(searchLoaded(filename, journal, data, query_data)==search(index, query_data), "index without updates differs once loaded");
+
+    // the updates go to the journal, the file of the index is left as it was saved
+    off_t saved_size = fileSize(filename);
+    off_t journal_size = fileSize(journal);
+    for (size_t round=0;round<3;++round) update(index, query_data, round);
+    check(fileSize(filename)==saved_size, "updates changed the file of the index");
+    check(fileSize(journal)>journal_size, "updates not written to the journal");
+    check(searchLoaded(filename, journal, data, query_data)==search(index, query_data), "journal replayed to other results");
+
+    // compacted: the file holds the updates, the journal none
+    index.compactJournal();
+    check(fileSize(journal)==journal_size, "journal not emptied by the compaction");
+    check(searchLoaded(filename, journal, data, query_data)==search(index, query_data), "compacted index differs once loaded");
+    update(index, query_data, 3);
+    check(searchLoaded(filename, journal, data, query_data)==search(index, query_data), "journal replayed after the compaction differs");
+
+    // compacted automatically, the journal stays around the size of one round of updates
+    update(index, query_data, 4);
+    off_t round_size = fileSize(journal)-journal_size;
+    index.setJournalCompaction(false, (size_t)round_size);
+    for (size_t round=5;round<9;++round) {
+        update(index, query_data, round);
+        check(fileSize(journal)-journal_size<=2*round_size, "journal not compacted automatically");
+    }
+    check(searchLoaded(filename, journal, data, query_data)==search(index, query_data), "automatically compacted index differs once loaded");
+
+    // a record cut by a crash is dropped, the journal is loaded up to the record before
+    index.setJournalCompaction(false, 0);
+    std::vector<size_t> before = search(index, query_data);
+    off_t before_size = fileSize(journal);
+    update(index, query_data, 9);
+    check(::truncate(journal.c_str(), before_size+10)==0, "journal not truncated");
+    check(searchLoaded(filename, journal, data, query_data)==before, "cut record of the journal not dropped");
+
+    // a journal is only replayed on the file it was started with
+    Index<Distance> other(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    other.buildIndex();
+    other.startJournal(other_filename, other_journal);
+    check(searchLoaded(filename, other_journal, data, query_data).empty(), "journal replayed on another index file");
+    other.save(other_filename);
+    check(searchLoaded(other_filename, other_journal, data, query_data).empty(), "journal replayed on an index file saved without one");
+
+    remove(filename.c_str());
+    remove(journal.c_str());
+    remove(other_filename.c_str());
+    remove(other_journal.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
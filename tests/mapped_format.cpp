@@ -0,0 +1,168 @@
+//
+//  mapped_format.cpp
+//  LDFlann
+//
+//  Checks the saved index files: an index saved by Index::save (the mapped
+//  format) and loaded again must give the results of the index it was saved
+//  from, for the LSH options that change the file (reordered dataset, inline
+//  and compressed tables, removed points, dataset saved or given back), the
+//  saved dataset must be used from the mapping, and the loaded index must go
+//  on taking updates. Files of the stream format (NNIndex::saveIndex) must
+//  still load, and a missing or unreadable file must throw a FLANNException.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/mapped_format.cpp -o mapped_format
+//  Usage:
+//      ./mapped_format [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    template<typename IndexType>
+    std::vector<size_t> search(IndexType& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+
+    bool hasComponent(const MemoryStats& stats, const std::string& name)
+    {
+        for (size_t i=0;i<stats.components.size();++i) {
+            if (stats.components[i].first==name) return true;
+        }
+        return false;
+    }
+
+    /**
+     * @return true if loading the file throws a FLANNException
+     */
+    bool loadThrows(const std::string& filename, std::vector<unsigned char>& data, const std::string& journal = "")
+    {
+        try {
+            Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename, true, journal));
+        }
+        catch (const FLANNException&) {
+            return true;
+        }
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/mapped_format.idx";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    // queries near the points of the dataset, so they have neighbors
+    std::vector<unsigned char> query_data(kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) {
+        size_t row = rand_int(kSize);
+        for (size_t j=0;j<kVeclen;++j) query_data[q*kVeclen+j] = data[row*kVeclen+j];
+        query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+
+    // every combination of the options changing the file
+    for (int options=0;options<16;++options) {
+        bool save_dataset = (options&1)!=0;
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = save_dataset;
+        params["reorder"] = (options&2)!=0;
+        params["inline_tables"] = (options&4) ? 2 : 0;
+        params["compress_tables"] = (options&8)!=0;
+        Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        index.buildIndex();
+        for (size_t i=0;i<kSize;i+=7) index.removePoint(i);
+        std::vector<size_t> expected = search(index, query_data);
+        index.save(filename);
+
+        // the dataset given to the constructor is only used if the file does not contain it
+        std::vector<unsigned char> other_data(data.size(), 0);
+        Index<Distance> loaded(Matrix<unsigned char>(save_dataset ? &other_data[0] : &data[0], kSize, kVeclen), SavedIndexParams(filename));
+        check(search(loaded, query_data)==expected, "loaded index gives other results than the saved one");
+        check(hasComponent(loaded.memoryStats(), "dataset (mapped)")==save_dataset, "saved dataset not used from the mapping");
+
+        // updates of the loaded index, the file is left as it was saved
+        loaded.addPoints(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen));
+        std::vector<size_t> updated = search(loaded, query_data);
+        bool found_added = true;
+        for (size_t q=0;q<kQueries;++q) {
+            found_added = found_added && updated[kQueries*kKnn+q*kKnn]==0;
+        }
+        check(found_added, "points added to the loaded index not found");
+        Index<Distance> reloaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename));
+        check(search(reloaded, query_data)==expected, "updates of the loaded index changed its file");
+    }
+
+    // stream format
+    {
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = true;
+        params["compress_tables"] = true;
+        LshIndex<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        index.buildIndex();
+        index.removePoint(3);
+        FILE* out = fopen(filename.c_str(), "wb");
+        index.saveIndex(out);
+        fclose(out);
+        Index<Distance> loaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename));
+        check(search(loaded, query_data)==search(index, query_data), "index of the stream format gives other results");
+    }
+
+    // missing and unreadable files
+    std::string missing = directory + "/mapped_format_missing.idx";
+    remove(missing.c_str());
+    check(loadThrows(missing, data), "missing file loaded");
+    check(loadThrows(missing, data, directory + "/mapped_format_missing.journal"), "missing file loaded with a journal");
+    FILE* empty = fopen(filename.c_str(), "wb");
+    fclose(empty);
+    check(loadThrows(filename, data), "empty file loaded");
+    FILE* text = fopen(filename.c_str(), "wb");
+    fprintf(text, "not an index file, long enough for the header of an index file");
+    fclose(text);
+    check(loadThrows(filename, data), "file of another kind loaded");
+
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+//
+//  point_ids.cpp
+//  LDFlann
+//
+//  Checks the lookup of the points by id: getPoint must find the point of
+//  every id, for the ids numbered by the index, ids chosen by the caller far
+//  apart (kept in a hash map rather than in the dense table) and a reordered
+//  dataset, and not find unknown ids. removePoints must count every point
+//  once, whatever the duplicates, unknown ids and number of chunks, and the
+//  ids must be kept when the index is rebuilt, saved and loaded.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/point_ids.cpp -o point_ids
+//  Usage:
+//      ./point_ids [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kAdded = 100;
+    const size_t kVeclen = 32;
+    const size_t kSparseBase = size_t(1) << 40;
+    const size_t kSparseStep = size_t(1) << 30;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Checks that every id of a list gives the point of its row
+     */
+    bool findsPoints(Index<Distance>& index, const std::vector<size_t>& ids, const std::vector<unsigned char>& rows)
+    {
+        for (size_t i=0;i<ids.size();++i) {
+            unsigned char* point = index.getPoint(ids[i]);
+            if (point==NULL || memcmp(point, &rows[i*kVeclen], kVeclen)!=0) return false;
+        }
+        return true;
+    }
+
+    /**
+     * The ids of the nearest neighbor of every row, searched in all the candidates
+     */
+    std::vector<size_t> nearest(Index<Distance>& index, std::vector<unsigned char>& rows, std::vector<DistanceType>& dists)
+    {
+        size_t count = rows.size()/kVeclen;
+        std::vector<size_t> indices(count, size_t(-1));
+        dists.assign(count, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], count, 1);
+        Matrix<DistanceType> dists_mat(&dists[0], count, 1);
+        index.knnSearch(Matrix<unsigned char>(&rows[0], count, kVeclen), indices_mat, dists_mat, 1, SearchParams(-1));
+        return indices;
+    }
+
+    std::vector<size_t> range(size_t first, size_t count, size_t step = 1)
+    {
+        std::vector<size_t> ids(count);
+        for (size_t i=0;i<count;++i) ids[i] = first + i*step;
+        return ids;
+    }
+
+    /**
+     * Some rows of a dataset, in the order of their positions
+     */
+    std::vector<unsigned char> rowsAt(const std::vector<unsigned char>& dataset, const std::vector<size_t>& positions)
+    {
+        std::vector<unsigned char> rows;
+        for (size_t i=0;i<positions.size();++i) {
+            rows.insert(rows.end(), dataset.begin()+positions[i]*kVeclen, dataset.begin()+(positions[i]+1)*kVeclen);
+        }
+        return rows;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/point_ids.idx";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    std::vector<unsigned char> added(kAdded*kVeclen), sparse(kAdded*kVeclen);
+    for (size_t i=0;i<added.size();++i) added[i] = (unsigned char)rand_int(256);
+    for (size_t i=0;i<sparse.size();++i) sparse[i] = (unsigned char)rand_int(256);
+
+    for (int reorder=0;reorder<2;++reorder) {
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = true;
+        params["reorder"] = reorder!=0;
+        Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        index.buildIndex();
+        check(findsPoints(index, range(0, kSize), data), "point of an id of the dataset not found");
+        check(index.getPoint(kSize)==NULL, "point found for an unknown id");
+
+        // removed with duplicates and unknown ids, in several chunks
+        std::vector<size_t> removed = range(0, kSize/10, 10);
+        std::vector<size_t> remove_list;
+        for (size_t i=0;i<200000;++i) {
+            remove_list.push_back(i%3==0 ? removed[(i/3)%removed.size()] : kSize + i);
+        }
+        index.removePoints(remove_list);
+        check(index.size()==kSize-removed.size(), "removed points not counted once");
+        std::vector<size_t> kept = range(1, kSize/10, 10);
+        check(findsPoints(index, kept, rowsAt(data, kept)), "point not found after the removals");
+
+        // ids numbered after the dataset, then ids chosen far apart
+        index.addPoints(Matrix<unsigned char>(&added[0], kAdded, kVeclen));
+        std::vector<size_t> sparse_ids = range(kSparseBase, kAdded, kSparseStep);
+        index.addPoints(Matrix<unsigned char>(&sparse[0], kAdded, kVeclen), sparse_ids);
+        check(findsPoints(index, range(kSize, kAdded), added), "point of a numbered id not found");
+        check(findsPoints(index, sparse_ids, sparse), "point of a sparse id not found");
+        check(findsPoints(index, kept, rowsAt(data, kept)), "point of the dataset not found once the ids are sparse");
+        check(index.getPoint(kSparseBase+1)==NULL, "point found for an unknown sparse id");
+        std::vector<DistanceType> dists;
+        check(nearest(index, sparse, dists)==sparse_ids, "search does not return the sparse ids");
+
+        // removing sparse ids, then rebuilding: the points keep their ids
+        std::vector<size_t> removed_sparse = range(kSparseBase, kAdded/2, 2*kSparseStep);
+        index.removePoints(removed_sparse);
+        index.removePoints(removed_sparse);
+        size_t expected_size = kSize-removed.size()+2*kAdded-removed_sparse.size();
+        check(index.size()==expected_size, "removed sparse points not counted once");
+        index.buildIndex();
+        check(index.size()==expected_size, "rebuilt index has another size");
+        std::vector<size_t> kept_sparse = range(kSparseBase+kSparseStep, kAdded/2, 2*kSparseStep);
+        std::vector<unsigned char> kept_sparse_rows = rowsAt(sparse, range(1, kAdded/2, 2));
+        check(findsPoints(index, kept_sparse, kept_sparse_rows), "point of a sparse id not found once rebuilt");
+        check(index.getPoint(kSparseBase)==NULL && index.getPoint(0)==NULL, "point of a removed id found once rebuilt");
+        check(findsPoints(index, range(kSize, kAdded), added), "point of a numbered id not found once rebuilt");
+        std::vector<size_t> before = nearest(index, sparse, dists);
+
+        // saved and loaded
+        index.save(filename);
+        Index<Distance> loaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename));
+        check(loaded.size()==expected_size, "loaded index has another size");
+        check(nearest(loaded, sparse, dists)==before, "loaded index returns other ids");
+        check(findsPoints(loaded, kept_sparse, kept_sparse_rows), "point of a sparse id not found once loaded");
+        check(findsPoints(loaded, range(kSize, kAdded), added), "point of a numbered id not found once loaded");
+    }
+
+    remove(filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+//
+//  search_filters.cpp
+//  LDFlann
+//
+//  Checks the filtered searches (SearchParams::filter): a filtered k-NN search
+//  must return the nearest allowed candidates, the ones a plain search returns
+//  once the denied points are dropped, and a bitset and a predicate allowing
+//  the same points must agree. Also checks that two asynchronous searches with
+//  different filters, queued together, are not batched with the same filter.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/search_filters.cpp -o search_filters
+//  Usage:
+//      ./search_filters (exits with 1 on the first failure)
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 3000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 5;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Results of a k-NN search of all the queries, unlimited checks so every candidate
+     * of the probed buckets is considered
+     */
+    struct Results
+    {
+        Results(size_t rows, size_t knn) : knn(knn), indices(rows*knn, size_t(-1)), dists(rows*knn, DistanceType(-1))
+        {
+        }
+
+        size_t knn;
+        std::vector<size_t> indices;
+        std::vector<DistanceType> dists;
+
+        Matrix<size_t> indicesMatrix() { return Matrix<size_t>(&indices[0], indices.size()/knn, knn); }
+        Matrix<DistanceType> distsMatrix() { return Matrix<DistanceType>(&dists[0], dists.size()/knn, knn); }
+    };
+
+    SearchParams searchParams(const SearchFilter* filter)
+    {
+        SearchParams params(-1);
+        params.filter = filter;
+        return params;
+    }
+
+    Results search(Index<Distance>& index, Matrix<unsigned char>& queries, size_t knn, const SearchFilter* filter)
+    {
+        Results results(queries.rows, knn);
+        Matrix<size_t> indices = results.indicesMatrix();
+        Matrix<DistanceType> dists = results.distsMatrix();
+        index.knnSearch(queries, indices, dists, knn, searchParams(filter));
+        return results;
+    }
+
+    /**
+     * Checks the filtered results against a plain search of all the candidates whose
+     * denied points are dropped: the distances must be the same (the order of the
+     * points at the same distance is not defined)
+     */
+    bool matches(const Results& filtered, const Results& plain, const DynamicBitset& allowed)
+    {
+        size_t rows = filtered.indices.size()/filtered.knn;
+        for (size_t q=0;q<rows;++q) {
+            std::vector<DistanceType> expected;
+            for (size_t j=0;j<plain.knn && expected.size()<filtered.knn;++j) {
+                size_t id = plain.indices[q*plain.knn+j];
+                if (id!=size_t(-1) && allowed.test(id)) expected.push_back(plain.dists[q*plain.knn+j]);
+            }
+            for (size_t j=0;j<filtered.knn;++j) {
+                size_t id = filtered.indices[q*filtered.knn+j];
+                if (j<expected.size()) {
+                    if (id==size_t(-1) || !allowed.test(id) || filtered.dists[q*filtered.knn+j]!=expected[j]) return false;
+                }
+                else if (id!=size_t(-1)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    // queries near the points of the dataset, so the buckets probed are not empty
+    std::vector<unsigned char> query_data(kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) {
+        size_t row = rand_int(kSize);
+        for (size_t j=0;j<kVeclen;++j) query_data[q*kVeclen+j] = data[row*kVeclen+j];
+        query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+    Matrix<unsigned char> queries(&query_data[0], kQueries, kVeclen);
+
+    LshIndexParams params(8, 16, 1);
+    params["random_seed"] = 7u;
+    Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+    index.buildIndex();
+
+    DynamicBitset even(kSize), odd(kSize);
+    for (size_t i=0;i<kSize;++i) {
+        if (i%2==0) even.set(i);
+        else odd.set(i);
+    }
+    SearchFilter allow_even(even);
+    SearchFilter deny_even(even, false);
+    SearchFilter even_predicate([](size_t id) { return id%2==0; });
+
+    Results plain = search(index, queries, kSize, NULL);
+    Results even_results = search(index, queries, kKnn, &allow_even);
+    Results odd_results = search(index, queries, kKnn, &deny_even);
+    Results predicate_results = search(index, queries, kKnn, &even_predicate);
+    check(matches(even_results, plain, even), "allow filter differs from the filtered plain search");
+    check(matches(odd_results, plain, odd), "deny filter differs from the filtered plain search");
+    check(predicate_results.dists==even_results.dists, "predicate and bitset filters differ");
+
+    // removed points stay out of the filtered searches
+    index.removePoint(0);
+    index.removePoint(2);
+    DynamicBitset kept_even(even);
+    kept_even.reset(0);
+    kept_even.reset(2);
+    Results removed_plain = search(index, queries, kSize, NULL);
+    Results removed_even = search(index, queries, kKnn, &allow_even);
+    check(matches(removed_even, removed_plain, kept_even), "filtered search returned removed points");
+
+    // two asynchronous searches with different filters, coalesced by the batcher only if
+    // their filters are the same
+    index.setAsyncParams(AsyncSearchParams(1024, 1000000));
+    Results async_even(kQueries, kKnn), async_odd(kQueries, kKnn);
+    Matrix<size_t> even_indices = async_even.indicesMatrix(), odd_indices = async_odd.indicesMatrix();
+    Matrix<DistanceType> even_dists = async_even.distsMatrix(), odd_dists = async_odd.distsMatrix();
+    std::future<int> even_done = index.knnSearchAsync(queries, even_indices, even_dists, kKnn, searchParams(&allow_even));
+    std::future<int> odd_done = index.knnSearchAsync(queries, odd_indices, odd_dists, kKnn, searchParams(&deny_even));
+    index.flushAsync();
+    even_done.get();
+    odd_done.get();
+    check(matches(async_even, removed_plain, kept_even), "asynchronous search ran with another filter");
+    check(matches(async_odd, removed_plain, odd), "asynchronous search ran with another filter");
+
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
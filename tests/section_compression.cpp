@@ -0,0 +1,177 @@
+//
+//  section_compression.cpp
+//  LDFlann
+//
+//  Checks the compressed index files (Index::save(filename, true)): every codec
+//  must give back the bytes it compressed, for the widths of its filters, and
+//  refuse a cut block; an index saved compressed must be smaller than saved as
+//  is, for every table layout, and load to the results of the index it was
+//  saved from.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/section_compression.cpp -o section_compression
+//  Usage:
+//      ./section_compression [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 20000;
+    const size_t kClusters = 200;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 3;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    off_t fileSize(const std::string& filename)
+    {
+        struct stat st;
+        return ::stat(filename.c_str(), &st)==0 ? st.st_size : -1;
+    }
+
+    /**
+     * Compresses a block and decompresses it back
+     * @param shrinks set if the block was compressed
+     * @return true if the block was given back as it was
+     */
+    bool roundTrip(compression::Codec codec, size_t width, const std::vector<unsigned char>& block, bool& shrinks)
+    {
+        std::vector<unsigned char> compressed;
+        shrinks = compression::compress_block(codec, width, block.empty() ? NULL : &block[0], block.size(), compressed);
+        if (!shrinks) return true;
+        if (compressed.size()>=block.size()) return false;
+        std::vector<unsigned char> restored(block.size());
+        if (!compression::decompress_block(codec, width, &compressed[0], compressed.size(), &restored[0], restored.size())) return false;
+        // a cut block is refused
+        if (compression::decompress_block(codec, width, &compressed[0], compressed.size()/2, &restored[0], restored.size())) return false;
+        return restored==block;
+    }
+
+    template<typename T>
+    std::vector<unsigned char> sortedValues(size_t count)
+    {
+        std::vector<unsigned char> block(count*sizeof(T));
+        T value = 0;
+        for (size_t i=0;i<count;++i) {
+            value += rand_int(20);
+            memcpy(&block[i*sizeof(T)], &value, sizeof(T));
+        }
+        return block;
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    std::vector<size_t> search(Index<Distance>& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/section_compression.idx";
+    std::string compressed_filename = directory + "/section_compression_compressed.idx";
+
+    seed_random(42);
+
+    // the codecs, on values they compress and on values they do not
+    bool shrinks;
+    std::vector<unsigned char> zeros(100000, 0);
+    std::vector<unsigned char> noise(100000);
+    for (size_t i=0;i<noise.size();++i) noise[i] = (unsigned char)rand_int(256);
+    std::vector<unsigned char> repeated;
+    for (size_t i=0;i<1000;++i) repeated.insert(repeated.end(), noise.begin(), noise.begin()+97);
+    std::vector<unsigned char> sorted32 = sortedValues<uint32_t>(30000);
+    std::vector<unsigned char> sorted64 = sortedValues<uint64_t>(30000);
+
+    check(roundTrip(compression::CODEC_LZ, 1, zeros, shrinks) && shrinks, "LZ codec failed on zeros");
+    check(roundTrip(compression::CODEC_LZ, 1, repeated, shrinks) && shrinks, "LZ codec failed on repeated bytes");
+    check(roundTrip(compression::CODEC_LZ, 1, noise, shrinks), "LZ codec failed on random bytes");
+    check(roundTrip(compression::CODEC_LZ, 1, std::vector<unsigned char>(5, 1), shrinks), "LZ codec failed on a few bytes");
+    size_t widths[] = { 2, 4, 8, 12 };
+    for (size_t i=0;i<sizeof(widths)/sizeof(widths[0]);++i) {
+        check(roundTrip(compression::CODEC_SHUFFLE_LZ, widths[i], sorted32, shrinks) && shrinks, "shuffle codec failed on sorted values");
+        check(roundTrip(compression::CODEC_SHUFFLE_LZ, widths[i], repeated, shrinks) && shrinks, "shuffle codec failed on repeated values");
+        check(roundTrip(compression::CODEC_SHUFFLE_LZ, widths[i], noise, shrinks), "shuffle codec failed on random values");
+    }
+    check(roundTrip(compression::CODEC_DELTA_LZ, 4, sorted32, shrinks) && shrinks, "delta codec failed on sorted 32 bits values");
+    check(roundTrip(compression::CODEC_DELTA_LZ, 8, sorted64, shrinks) && shrinks, "delta codec failed on sorted 64 bits values");
+    check(roundTrip(compression::CODEC_DELTA_LZ, 4, noise, shrinks), "delta codec failed on random values");
+    check(!compression::valid_width(compression::CODEC_DELTA_LZ, 2) && !compression::valid_width(compression::CODEC_SHUFFLE_LZ, 0),
+          "invalid width accepted");
+
+    // clustered points, whose dataset and tables compress
+    std::vector<unsigned char> centers(kClusters*kVeclen);
+    for (size_t i=0;i<centers.size();++i) centers[i] = (unsigned char)rand_int(256);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<kSize;++i) {
+        size_t center = rand_int(kClusters);
+        for (size_t j=0;j<kVeclen;++j) data[i*kVeclen+j] = centers[center*kVeclen+j];
+        data[i*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+    std::vector<unsigned char> query_data(data.begin(), data.begin()+kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+
+    // every table layout
+    for (int options=0;options<8;++options) {
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = true;
+        params["reorder"] = (options&1)!=0;
+        params["inline_tables"] = (options&2) ? 2 : 0;
+        params["compress_tables"] = (options&4)!=0;
+        Index<Distance> index(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        index.buildIndex();
+        index.removePoint(11);
+        std::vector<size_t> expected = search(index, query_data);
+        index.save(filename);
+        index.save(compressed_filename, true);
+        check(fileSize(compressed_filename)<fileSize(filename), "compressed file not smaller");
+
+        bool compressed_section = false;
+        std::vector<mapped::SectionEntry> sections = MappedReader(compressed_filename).sections();
+        for (size_t i=0;i<sections.size();++i) {
+            compressed_section = compressed_section || sections[i].codec!=compression::CODEC_NONE;
+        }
+        check(compressed_section, "no section compressed");
+
+        Index<Distance> loaded(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(compressed_filename));
+        check(search(loaded, query_data)==expected, "compressed index gives other results once loaded");
+    }
+
+    remove(filename.c_str());
+    remove(compressed_filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}
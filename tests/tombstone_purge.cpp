@@ -0,0 +1,172 @@
+//
+//  tombstone_purge.cpp
+//  LDFlann
+//
+//  Checks the purge of the removed points from the LSH buckets (purge_ratio):
+//  for every table layout, and for tables loaded from a file, an index purging
+//  its removed points must give the results of one keeping them in its buckets,
+//  never return a removed point, hold less memory in its tables, and go on
+//  taking updates, purged again.
+//
+//  Build (from the repository root):
+//      c++ -O2 -std=c++11 -pthread -ILDFlann tests/tombstone_purge.cpp -o tombstone_purge
+//  Usage:
+//      ./tombstone_purge [directory of the temporary files, default /tmp]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "flann.cpp"
+#include "random.h"
+
+using namespace LDFlann;
+
+namespace
+{
+    typedef Hamming<unsigned char> Distance;
+    typedef Distance::ResultType DistanceType;
+
+    const size_t kSize = 4000;
+    const size_t kQueries = 200;
+    const size_t kVeclen = 32;
+    const size_t kKnn = 5;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition) {
+            printf("FAILED: %s\n", what);
+            ++failures;
+        }
+    }
+
+    /**
+     * Indices and distances of the neighbors of all the queries, as one vector
+     */
+    std::vector<size_t> search(Index<Distance>& index, std::vector<unsigned char>& query_data)
+    {
+        std::vector<size_t> indices(kQueries*kKnn, size_t(-1));
+        std::vector<DistanceType> dists(kQueries*kKnn, DistanceType(-1));
+        Matrix<size_t> indices_mat(&indices[0], kQueries, kKnn);
+        Matrix<DistanceType> dists_mat(&dists[0], kQueries, kKnn);
+        index.knnSearch(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen), indices_mat, dists_mat, kKnn, SearchParams(-1));
+        indices.insert(indices.end(), dists.begin(), dists.end());
+        return indices;
+    }
+
+    /**
+     * Memory of the tables, all the components but the dataset, the ids and the removed points
+     */
+    size_t tablesMemory(Index<Distance>& index)
+    {
+        MemoryStats stats = index.memoryStats();
+        size_t memory = 0;
+        for (size_t i=0;i<stats.components.size();++i) {
+            const std::string& name = stats.components[i].first;
+            if (name.compare(0, 7, "dataset")!=0 && name!="ids" && name!="removed points") memory += stats.components[i].second;
+        }
+        return memory;
+    }
+
+    /**
+     * Checks if the results hold a point removed by removeRound
+     * @param size the size of the index when the points were removed
+     */
+    bool returnsRemoved(const std::vector<size_t>& results, size_t size, size_t round)
+    {
+        for (size_t i=0;i<kQueries*kKnn;++i) {
+            if (results[i]<size && results[i]%5==round) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Removes the points whose id is round modulo 5, in several calls
+     */
+    void removeRound(Index<Distance>& index, size_t size, size_t round)
+    {
+        std::vector<size_t> ids;
+        for (size_t i=round;i<size;i+=5) {
+            ids.push_back(i);
+            if (ids.size()==100) {
+                index.removePoints(ids);
+                ids.clear();
+            }
+        }
+        index.removePoints(ids);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string directory = argc>1 ? argv[1] : "/tmp";
+    std::string filename = directory + "/tombstone_purge.idx";
+    std::string kept_filename = directory + "/tombstone_purge_kept.idx";
+
+    seed_random(42);
+    std::vector<unsigned char> data(kSize*kVeclen);
+    for (size_t i=0;i<data.size();++i) data[i] = (unsigned char)rand_int(256);
+    // queries near the points of the dataset, so they have neighbors
+    std::vector<unsigned char> query_data(kQueries*kVeclen);
+    for (size_t q=0;q<kQueries;++q) {
+        size_t row = rand_int(kSize);
+        for (size_t j=0;j<kVeclen;++j) query_data[q*kVeclen+j] = data[row*kVeclen+j];
+        query_data[q*kVeclen+rand_int(kVeclen)] ^= (unsigned char)(1 << rand_int(8));
+    }
+
+    // regular, bit packed and inline tables, built or loaded from a file
+    for (int options=0;options<6;++options) {
+        bool loaded = options>=3;
+        LshIndexParams params(6, 14, 1);
+        params["random_seed"] = 7u;
+        params["save_dataset"] = true;
+        params["compress_tables"] = options%3==1;
+        params["inline_tables"] = options%3==2 ? 2 : 0;
+        LshIndexParams kept_params(params);
+        kept_params["purge_ratio"] = 0.0f;
+
+        Index<Distance>* purged = new Index<Distance>(Matrix<unsigned char>(&data[0], kSize, kVeclen), params);
+        Index<Distance>* kept = new Index<Distance>(Matrix<unsigned char>(&data[0], kSize, kVeclen), kept_params);
+        purged->buildIndex();
+        kept->buildIndex();
+        if (loaded) {
+            // the tables are then frozen, in the mapping of the file
+            purged->save(filename);
+            kept->save(kept_filename);
+            delete purged;
+            delete kept;
+            purged = new Index<Distance>(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(filename));
+            kept = new Index<Distance>(Matrix<unsigned char>(&data[0], kSize, kVeclen), SavedIndexParams(kept_filename));
+        }
+
+        // a fifth of the points removed, purged by the removals past purge_ratio
+        removeRound(*purged, kSize, 0);
+        removeRound(*kept, kSize, 0);
+        std::vector<size_t> results = search(*purged, query_data);
+        check(results==search(*kept, query_data), "purged index gives other results");
+        check(!returnsRemoved(results, kSize, 0), "purged index returns removed points");
+        check(tablesMemory(*purged)<tablesMemory(*kept), "purge did not shrink the tables");
+
+        // updates after the purge, purged again
+        purged->addPoints(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen));
+        kept->addPoints(Matrix<unsigned char>(&query_data[0], kQueries, kVeclen));
+        removeRound(*purged, kSize+kQueries, 1);
+        removeRound(*kept, kSize+kQueries, 1);
+        results = search(*purged, query_data);
+        check(results==search(*kept, query_data), "index purged twice gives other results");
+        check(!returnsRemoved(results, kSize, 0) && !returnsRemoved(results, kSize+kQueries, 1), "index purged twice returns removed points");
+        check(purged->size()==kept->size(), "purged index has another size");
+
+        delete purged;
+        delete kept;
+    }
+
+    remove(filename.c_str());
+    remove(kept_filename.c_str());
+    if (failures==0) printf("ok\n");
+    return failures==0 ? 0 : 1;
+}